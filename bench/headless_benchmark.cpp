@@ -0,0 +1,706 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "domain_decomposition.hpp"
+#include "emitters.hpp"
+#include "physics_handler.hpp"
+#include "tracing.hpp"
+#include "trajectory.hpp"
+
+enum class EmitterPattern {
+    Stream,  // same emitter as main.cpp: a column of particles shot from the left wall
+    Rain,    // a row of particles dropped from the top of the world
+    Lattice, // all particles placed at once on a packed lattice
+};
+
+struct Scenario {
+    int32_t particle_count = 25e4;
+    V2i world_size = {200, 200};
+    int32_t threads = cpu_threads;
+    int32_t sub_steps = 0;
+    bool adaptive_sub_steps = false;
+    AdaptiveSubSteps adaptive;
+    EmitterPattern emitter = EmitterPattern::Stream;
+    int32_t emit_count = 20;
+    float large_radius = 2.0f;
+    int32_t large_every = 0;
+    uint32_t seed = 0;
+    float drain_height = 0.0f;
+    int32_t settle_frames = 0;
+    int32_t max_frames = 0;
+    int32_t reorder_interval = 0;
+    int32_t sleep_steps = 0;
+    float sleep_distance = SLEEP_DISTANCE;
+    float neighbour_skin = 0.0f;
+    V2i cloth_size = {0, 0};
+    std::vector<BackendType> backends = {BackendType::SIMD};
+    GridType grid_type = GridType::Dense;
+    std::string output_path;
+    std::string substep_output_path;
+    std::string load_checkpoint_path;
+    std::string save_checkpoint_path;
+    std::string record_path;
+    std::string trace_path;
+    int32_t domain_count = 1;
+    int32_t domain_rank = -1; // -1 starts every rank
+    std::string domain_name;
+};
+
+static void printUsage(const char *program) {
+    std::cout
+        << "usage: " << program << " [options]\n"
+        << "  --particles N         number of particles to emit (default 250000)\n"
+        << "  --world WxH           world size in cells (default 200x200)\n"
+        << "  --backend LIST        comma separated scalar | openmp | simd | cuda, run once per backend (default simd)\n"
+        << "  --grid TYPE           dense | sparse, sparse only stores occupied cells (default dense)\n"
+        << "  --threads N           OpenMP thread count (default " << cpu_threads << ")\n"
+        << "  --block-size N        CUDA threads per block (default " << gpu_block_size << ")\n"
+        << "  --substeps N          physics sub steps per frame (default 8, or the checkpoint's),\n"
+        << "                        the first frame's when adaptive\n"
+        << "  --min-substeps N      adapt the sub steps to the measured error, at least N (default 2)\n"
+        << "  --max-substeps N      adapt the sub steps to the measured error, at most N (default 32)\n"
+        << "  --max-displacement R  adaptive target: movement per sub step / smallest radius (default 1)\n"
+        << "  --max-overlap R       adaptive target: deepest overlap / smallest radius (default 0.5)\n"
+        << "  --emitter PATTERN     stream | rain | lattice (default stream)\n"
+        << "  --emit-count N        particles emitted per frame by stream and rain (default 20)\n"
+        << "  --large-every N       every Nth particle is a large body, 0 for none (default 0)\n"
+        << "  --large-radius R      radius of the large bodies (default 2)\n"
+        << "  --seed N              emitter seed (default 0)\n"
+        << "  --drain H             remove the particles within H of the floor each frame, emission refills\n"
+        << "                        them, so bound the run with --max-frames (default 0, no drain)\n"
+        << "  --settle-frames N     frames simulated after the last particle is emitted (default 0)\n"
+        << "  --max-frames N        hard limit on simulated frames, 0 for none (default 0)\n"
+        << "  --reorder-interval N  sort particles along a Morton curve every N frames, 0 for never (default 0)\n"
+        << "  --sleep-steps N       sub steps below the sleep distance before a particle sleeps, 0 for never (default 0)\n"
+        << "  --sleep-distance D    movement per sub step below which a particle counts as still (default " << SLEEP_DISTANCE << ")\n"
+        << "  --neighbour-skin S    solve collisions from neighbour lists of the particles within their radii\n"
+        << "                        plus S, rebuilt once a particle moved S / 2, 0 to use the grid (default 0)\n"
+        << "  --cloth WxH           hang a linked sheet of W by H particles at the top of the world before\n"
+        << "                        emitting, counted in --particles (default none)\n"
+        << "  --output PATH         per frame csv (default cpu_threads<N>.csv, gpu_block_size<N>.csv for cuda),\n"
+        << "                        suffixed with _<backend> when several backends are run\n"
+        << "  --substep-output PATH per sub step csv (disabled by default)\n"
+        << "  --load-checkpoint PATH\n"
+        << "                        start from a checkpoint, its world size replaces --world\n"
+        << "  --save-checkpoint PATH\n"
+        << "                        write a checkpoint when the run ends\n"
+        << "  --record PATH         record the trajectory of every frame, suffixed like --output\n"
+        << "  --trace PATH          write the traced zones of all runs as Chrome trace JSON,\n"
+        << "                        needs a build with PBD_ENABLE_TRACING\n"
+        << "  --domains N           split the world into N vertical slabs, one process each, exchanging\n"
+        << "                        halos over shared memory; forks the other ranks unless --domain-rank\n"
+        << "  --domain-rank R       run only rank R of --domains, the other ranks are started separately\n"
+        << "  --domain-name NAME    shared memory name of a --domain-rank run, the same for every rank\n";
+}
+
+static bool parseWorldSize(const char *text, V2i &world_size) {
+    const char *separator = std::strchr(text, 'x');
+    if (separator == nullptr) return false;
+    world_size.x = std::atoi(text);
+    world_size.y = std::atoi(separator + 1);
+    return world_size.x > 0 && world_size.y > 0;
+}
+
+static bool parseEmitter(const std::string &text, EmitterPattern &emitter) {
+    if (text == "stream")  { emitter = EmitterPattern::Stream;  return true; }
+    if (text == "rain")    { emitter = EmitterPattern::Rain;    return true; }
+    if (text == "lattice") { emitter = EmitterPattern::Lattice; return true; }
+    return false;
+}
+
+static bool parseBackends(const std::string &text, std::vector<BackendType> &backends) {
+    backends.clear();
+    size_t begin = 0;
+    while (begin <= text.size()) {
+        const size_t end = std::min(text.find(',', begin), text.size());
+        BackendType type;
+        if (!parseBackendType(text.substr(begin, end - begin), type)) return false;
+        backends.push_back(type);
+        begin = end + 1;
+    }
+    return !backends.empty();
+}
+
+static bool parseArguments(const int argc, char **argv, Scenario &scenario) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return false;
+        }
+        const char *value = argv[++i];
+        if      (arg == "--particles")       { scenario.particle_count = std::atoi(value); }
+        else if (arg == "--threads")         { scenario.threads = std::max(1, std::atoi(value)); }
+        else if (arg == "--block-size")      { gpu_block_size = std::max(32, std::atoi(value)); }
+        else if (arg == "--substeps")        { scenario.sub_steps = std::max(1, std::atoi(value)); }
+        else if (arg == "--min-substeps")    { scenario.adaptive.min_sub_steps = std::max(1, std::atoi(value)); scenario.adaptive_sub_steps = true; }
+        else if (arg == "--max-substeps")    { scenario.adaptive.max_sub_steps = std::max(1, std::atoi(value)); scenario.adaptive_sub_steps = true; }
+        else if (arg == "--max-displacement"){ scenario.adaptive.max_displacement = static_cast<float>(std::atof(value)); scenario.adaptive_sub_steps = true; }
+        else if (arg == "--max-overlap")     { scenario.adaptive.max_overlap = static_cast<float>(std::atof(value)); scenario.adaptive_sub_steps = true; }
+        else if (arg == "--emit-count")      { scenario.emit_count = std::max(1, std::atoi(value)); }
+        else if (arg == "--large-every")     { scenario.large_every = std::max(0, std::atoi(value)); }
+        else if (arg == "--large-radius")    { scenario.large_radius = static_cast<float>(std::atof(value)); }
+        else if (arg == "--seed")            { scenario.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10)); }
+        else if (arg == "--drain")           { scenario.drain_height = std::max(0.0f, static_cast<float>(std::atof(value))); }
+        else if (arg == "--settle-frames")   { scenario.settle_frames = std::max(0, std::atoi(value)); }
+        else if (arg == "--max-frames")      { scenario.max_frames = std::max(0, std::atoi(value)); }
+        else if (arg == "--reorder-interval"){ scenario.reorder_interval = std::max(0, std::atoi(value)); }
+        else if (arg == "--sleep-steps")     { scenario.sleep_steps = std::max(0, std::atoi(value)); }
+        else if (arg == "--sleep-distance")  { scenario.sleep_distance = static_cast<float>(std::atof(value)); }
+        else if (arg == "--neighbour-skin")  { scenario.neighbour_skin = std::max(0.0f, static_cast<float>(std::atof(value))); }
+        else if (arg == "--output")          { scenario.output_path = value; }
+        else if (arg == "--substep-output")  { scenario.substep_output_path = value; }
+        else if (arg == "--load-checkpoint") { scenario.load_checkpoint_path = value; }
+        else if (arg == "--save-checkpoint") { scenario.save_checkpoint_path = value; }
+        else if (arg == "--record")          { scenario.record_path = value; }
+        else if (arg == "--domains")         { scenario.domain_count = std::max(1, std::atoi(value)); }
+        else if (arg == "--domain-rank")     { scenario.domain_rank = std::atoi(value); }
+        else if (arg == "--domain-name")     { scenario.domain_name = value; }
+        else if (arg == "--trace") {
+            if (!tracing_enabled) {
+                std::cerr << "--trace needs a build with PBD_ENABLE_TRACING\n";
+                return false;
+            }
+            scenario.trace_path = value;
+        }
+        else if (arg == "--cloth") {
+            if (!parseWorldSize(value, scenario.cloth_size)) {
+                std::cerr << "invalid cloth size: " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--world") {
+            if (!parseWorldSize(value, scenario.world_size)) {
+                std::cerr << "invalid world size: " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--backend") {
+            if (!parseBackends(value, scenario.backends)) {
+                std::cerr << "invalid backend list: " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--grid") {
+            if (!parseGridType(value, scenario.grid_type)) {
+                std::cerr << "unknown grid: " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--emitter") {
+            if (!parseEmitter(value, scenario.emitter)) {
+                std::cerr << "unknown emitter: " << value << "\n";
+                return false;
+            }
+        }
+        else {
+            std::cerr << "unknown option: " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr float lattice_margin = 2.5f;
+
+static V2i getLatticeSize(const V2f world_size) {
+    return {static_cast<int32_t>(world_size.x - 2.0f * lattice_margin), static_cast<int32_t>(world_size.y - 2.0f * lattice_margin)};
+}
+
+// existing particles, from a checkpoint, take the first lattice squares
+static std::unique_ptr<Emitter> createEmitter(const Scenario &scenario, const V2f world_size, const int32_t existing_count) {
+    EmitterSettings settings;
+    settings.hue_step = 0.001f;
+    settings.seed = scenario.seed;
+    switch (scenario.emitter) {
+        case EmitterPattern::Stream:
+            settings.velocity        = {0.075f, 0.0f};
+            settings.velocity_jitter = {0.025f, 0.1f};
+            return std::make_unique<LineEmitter>(settings, V2f{2.0f, 5.75f}, V2f{2.0f, 5.75f + 1.5f * static_cast<float>(scenario.emit_count)}, scenario.emit_count);
+        case EmitterPattern::Rain:
+            // each particle anywhere in its share of the row
+            settings.position_jitter = {(world_size.x - 6.0f) / static_cast<float>(2 * scenario.emit_count), 0.0f};
+            settings.velocity_jitter = {0.05f, 0.0f};
+            return std::make_unique<LineEmitter>(settings, V2f{3.0f, 3.0f}, V2f{world_size.x - 3.0f, 3.0f}, scenario.emit_count);
+        case EmitterPattern::Lattice: {
+            // fill the world from the bottom, one particle per cell
+            const V2i lattice_size = getLatticeSize(world_size);
+            const V2f lattice_min = {lattice_margin - 0.5f, lattice_margin + 0.5f};
+            auto lattice = std::make_unique<LatticeEmitter>(settings, lattice_min, lattice_min + V2f{static_cast<float>(lattice_size.x), static_cast<float>(lattice_size.y)}, 1.0f);
+            lattice->setFilled(existing_count);
+            return lattice;
+        }
+    }
+    return nullptr;
+}
+
+// the next batch after first particles of the scenario, false when they are all emitted
+static bool emitBatch(const Scenario &scenario, Emitter &emitter, ObjectBatch &batch, const int32_t first) {
+    const int32_t remaining = scenario.particle_count - first;
+    if (remaining <= 0) return false;
+    if (emitter.emit(batch, remaining) == 0) return false;
+    if (scenario.large_every > 0) {
+        for (int32_t i = 0; i < batch.size(); ++i) {
+            if ((first + i) % scenario.large_every == scenario.large_every - 1) {
+                batch.radius[i] = scenario.large_radius;
+            }
+        }
+    }
+    return true;
+}
+
+static void emitParticles(PhysicsHandler &physics_handler, const Scenario &scenario, Emitter &emitter, ObjectBatch &batch) {
+    if (emitBatch(scenario, emitter, batch, physics_handler.getObjectsCount())) {
+        physics_handler.createObjects(batch);
+    }
+}
+
+static float percentile(std::vector<float> values, const float p) {
+    if (values.empty()) return 0.0f;
+    const auto rank = static_cast<size_t>(p * static_cast<float>(values.size() - 1) + 0.5f);
+    std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(rank), values.end());
+    return values[rank];
+}
+
+static void printPercentiles(const std::string &name, const std::vector<float> &values) {
+    double sum = 0.0;
+    for (const float value : values) sum += value;
+    const double mean = values.empty() ? 0.0 : sum / static_cast<double>(values.size());
+    std::cout << name
+              << " mean: " << mean
+              << " p50: "  << percentile(values, 0.50f)
+              << " p90: "  << percentile(values, 0.90f)
+              << " p99: "  << percentile(values, 0.99f)
+              << " max: "  << percentile(values, 1.00f) << " (us)\n";
+}
+
+static std::string getOutputPath(const Scenario &scenario, const BackendType backend_type) {
+    std::string path = scenario.output_path;
+    if (path.empty()) {
+        path = backend_type == BackendType::CUDA
+            ? "gpu_block_size" + std::to_string(gpu_block_size) + ".csv"
+            : "cpu_threads" + std::to_string(scenario.threads) + ".csv";
+    }
+    const auto add_suffix = [&path](const std::string &suffix) {
+        const size_t extension = path.rfind('.');
+        const size_t insert_at = extension == std::string::npos || extension < path.find_last_of("/\\") + 1 ? path.size() : extension;
+        path.insert(insert_at, suffix);
+    };
+    if (scenario.backends.size() > 1) {
+        add_suffix(std::string("_") + getBackendName(backend_type));
+    }
+    if (scenario.domain_count > 1) {
+        add_suffix("_rank" + std::to_string(scenario.domain_rank));
+    }
+    return path;
+}
+
+// runs the whole scenario from an empty world or from the checkpoint with the same seed, so every backend
+// simulates the same emission
+static bool runScenario(const Scenario &scenario, const BackendType requested_backend) {
+    PhysicsHandler physics_handler({static_cast<float>(scenario.world_size.x), static_cast<float>(scenario.world_size.y)}, requested_backend, scenario.grid_type);
+    if (!scenario.load_checkpoint_path.empty()) {
+        const auto load_start = std::chrono::high_resolution_clock::now();
+        if (!physics_handler.loadCheckpoint(scenario.load_checkpoint_path)) {
+            return false;
+        }
+        const auto load_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - load_start).count();
+        std::cout << "loaded " << physics_handler.getObjectsCount() << " particles from " << scenario.load_checkpoint_path << " in " << load_time << " ms\n";
+    }
+    if (scenario.sub_steps > 0) {
+        physics_handler.setSubSteps(scenario.sub_steps);
+    }
+    physics_handler.setAdaptiveSubSteps(scenario.adaptive_sub_steps, scenario.adaptive);
+    physics_handler.setProfiling(true);
+    physics_handler.setReorderInterval(scenario.reorder_interval);
+    physics_handler.setSleeping(scenario.sleep_distance, scenario.sleep_steps);
+    physics_handler.setNeighbourSkin(scenario.neighbour_skin);
+    constexpr float delta_time = 1.0f / 60.0f;
+
+    // the CUDA backend may have fallen back to a host backend
+    const BackendType backend_type = physics_handler.getBackendType();
+    const bool device_backend = backend_type == BackendType::CUDA;
+    const std::string output_path = getOutputPath(scenario, requested_backend);
+    std::ofstream output(output_path);
+    if (!output) {
+        std::cerr << "cannot open " << output_path << "\n";
+        return false;
+    }
+    if (device_backend) {
+        output << "object_counts,gpu_elapsed_time,physics_update_elapsed_time,render_elapsed_time,integrate_elapsed_time,grid_elapsed_time,collision_elapsed_time,reorder_elapsed_time,active_object_counts,sub_steps,displacement_error,overlap_error\n";
+    } else {
+        output << "object_counts,physics_update_elapsed_time,render_elapsed_time,integrate_elapsed_time,grid_elapsed_time,collision_elapsed_time,reorder_elapsed_time,active_object_counts,sub_steps,displacement_error,overlap_error\n";
+    }
+
+    std::ofstream substep_output;
+    if (!scenario.substep_output_path.empty()) {
+        Scenario substep_scenario = scenario;
+        substep_scenario.output_path = scenario.substep_output_path;
+        substep_output.open(getOutputPath(substep_scenario, requested_backend));
+        substep_output << "frame,sub_step,object_counts,integrate_elapsed_time,grid_elapsed_time,collision_elapsed_time\n";
+    }
+
+    TrajectoryRecorder recorder;
+    if (!scenario.record_path.empty()) {
+        Scenario record_scenario = scenario;
+        record_scenario.output_path = scenario.record_path;
+        if (!recorder.open(getOutputPath(record_scenario, requested_backend), physics_handler.getWorldSize())) {
+            return false;
+        }
+    }
+
+    if (scenario.cloth_size.x > 0 && scenario.cloth_size.y > 0) {
+        // one particle per cell, centered, as wide as the world allows
+        const V2f world_size = physics_handler.getWorldSize();
+        const int32_t columns = std::min(scenario.cloth_size.x, static_cast<int32_t>(world_size.x) - 2);
+        const int32_t rows = std::min(scenario.cloth_size.y, static_cast<int32_t>(world_size.y) - 2);
+        LinkedBatch cloth;
+        buildCloth(cloth, {0.5f * (world_size.x - static_cast<float>(columns - 1)), 1.5f}, columns, rows, 1.0f, 0.45f);
+        physics_handler.createLinkedObjects(cloth);
+        std::cout << "cloth: " << columns << "x" << rows << " particles, " << physics_handler.getDistanceConstraints().size() << " links\n";
+    }
+
+    std::vector<float> integrate_times, constraint_times, grid_times, collision_times, reorder_times, device_times, frame_times, record_times, drain_times;
+    int64_t drained_count = 0;
+    std::vector<float> active_counts;
+    std::vector<float> frame_sub_steps, displacement_errors, overlap_errors;
+    std::vector<float> work_imbalances;
+    std::vector<double> thread_busy_times;
+    int64_t stolen_tasks = 0;
+    const std::unique_ptr<Emitter> emitter = createEmitter(scenario, physics_handler.getWorldSize(), physics_handler.getObjectsCount());
+    physics_handler.reserveObjects(scenario.particle_count);
+    ObjectBatch batch;
+    int32_t settle_frames = 0;
+    for (int32_t frame = 0; scenario.max_frames == 0 || frame < scenario.max_frames; ++frame) {
+        if (physics_handler.getObjectsCount() >= scenario.particle_count && settle_frames++ >= scenario.settle_frames) {
+            break;
+        }
+        if (scenario.drain_height > 0.0f) {
+            const V2f world_size = physics_handler.getWorldSize();
+            const auto drain_start = std::chrono::high_resolution_clock::now();
+            drained_count += physics_handler.removeObjectsInRect({0.0f, world_size.y - scenario.drain_height}, world_size);
+            drain_times.push_back(std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - drain_start).count());
+        }
+        emitParticles(physics_handler, scenario, *emitter, batch);
+
+        auto physics_update_start = std::chrono::high_resolution_clock::now();
+        physics_handler.update(delta_time);
+        auto physics_update_end = std::chrono::high_resolution_clock::now();
+        auto physics_update_duration = std::chrono::duration_cast<std::chrono::microseconds>(physics_update_end - physics_update_start).count();
+
+        const int32_t object_count = physics_handler.getObjectsCount();
+        SubStepTimings frame_timings;
+        const auto &sub_step_timings = physics_handler.getSubStepTimings();
+        for (size_t i = 0; i < sub_step_timings.size(); ++i) {
+            const SubStepTimings &timings = sub_step_timings[i];
+            frame_timings.integrate_time += timings.integrate_time;
+            frame_timings.grid_time      += timings.grid_time;
+            frame_timings.collision_time += timings.collision_time;
+            integrate_times.push_back(timings.integrate_time);
+            constraint_times.push_back(timings.constraint_time);
+            grid_times.push_back(timings.grid_time);
+            collision_times.push_back(timings.collision_time);
+            if (substep_output.is_open()) {
+                substep_output << frame << "," << i << "," << object_count << ","
+                               << timings.integrate_time << "," << timings.grid_time << "," << timings.collision_time << "\n";
+            }
+        }
+        frame_times.push_back(static_cast<float>(physics_update_duration));
+        if (recorder.isOpen()) {
+            const auto record_start = std::chrono::high_resolution_clock::now();
+            recorder.record(physics_handler);
+            record_times.push_back(std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - record_start).count());
+        }
+        const float reorder_time = physics_handler.getLastReorderTime();
+        if (reorder_time > 0.0f) {
+            reorder_times.push_back(reorder_time);
+        }
+
+        const SleepStats *sleep_stats = physics_handler.getSleepStats();
+        const int32_t active_count = sleep_stats != nullptr ? sleep_stats->active_objects : object_count;
+        active_counts.push_back(static_cast<float>(active_count));
+        frame_sub_steps.push_back(static_cast<float>(physics_handler.getLastSubSteps()));
+        displacement_errors.push_back(physics_handler.getLastSubStepError().displacement);
+        overlap_errors.push_back(physics_handler.getLastSubStepError().overlap);
+        if (const WorkStats *work_stats = physics_handler.getWorkStats()) {
+            work_imbalances.push_back(work_stats->getImbalance());
+            thread_busy_times.resize(std::max(thread_busy_times.size(), work_stats->busy_time.size()), 0.0);
+            for (size_t thread = 0; thread < work_stats->busy_time.size(); ++thread) {
+                thread_busy_times[thread] += work_stats->busy_time[thread];
+            }
+            stolen_tasks += work_stats->stolen_tasks;
+        }
+
+        if (object_count > 0) {
+            output << object_count << ",";
+            if (device_backend) {
+                device_times.push_back(physics_handler.getLastDeviceTime());
+                output << static_cast<int64_t>(physics_handler.getLastDeviceTime()) << ",";
+            }
+            output << physics_update_duration << ",0,"
+                   << static_cast<int64_t>(frame_timings.integrate_time) << ","
+                   << static_cast<int64_t>(frame_timings.grid_time) << ","
+                   << static_cast<int64_t>(frame_timings.collision_time) << ","
+                   << static_cast<int64_t>(reorder_time) << ","
+                   << active_count << ","
+                   << physics_handler.getLastSubSteps() << ","
+                   << physics_handler.getLastSubStepError().displacement << ","
+                   << physics_handler.getLastSubStepError().overlap << "\n";
+        }
+    }
+
+    std::cout << "backend: " << getBackendName(backend_type)
+              << " grid: " << getGridTypeName(physics_handler.getGridType())
+              << " particles: " << physics_handler.getObjectsCount()
+              << " world: " << physics_handler.getWorldSize().x << "x" << physics_handler.getWorldSize().y
+              << " threads: " << scenario.threads
+              << " sub steps: " << physics_handler.getSubSteps()
+              << " frames: " << frame_times.size() << "\n";
+    printPercentiles("frame     ", frame_times);
+    if (!device_times.empty()) {
+        printPercentiles("device    ", device_times);
+    }
+    printPercentiles("integrate ", integrate_times);
+    if (physics_handler.getDistanceConstraints().size() > 0) {
+        printPercentiles("constraint", constraint_times);
+    }
+    printPercentiles("grid      ", grid_times);
+    printPercentiles("collision ", collision_times);
+    if (!reorder_times.empty()) {
+        printPercentiles("reorder   ", reorder_times);
+    }
+    if (!drain_times.empty()) {
+        printPercentiles("drain     ", drain_times);
+        std::cout << "removed particles: " << drained_count << "\n";
+    }
+    if (recorder.isOpen()) {
+        printPercentiles("record    ", record_times);
+        recorder.close();
+        const int64_t recorded_frames = recorder.getRecordedFrames();
+        std::cout << "recorded frames: " << recorded_frames
+                  << " bytes per frame: " << (recorded_frames > 0 ? recorder.getWrittenBytes() / static_cast<uint64_t>(recorded_frames) : 0)
+                  << " waiting for the writer: " << recorder.getWaitTime() << " us\n";
+    }
+    if (physics_handler.isAdaptiveSubSteps() && !frame_sub_steps.empty()) {
+        const auto mean = [](const std::vector<float> &values) {
+            return std::accumulate(values.begin(), values.end(), 0.0f) / static_cast<float>(values.size());
+        };
+        std::cout << "adaptive sub steps mean: " << mean(frame_sub_steps)
+                  << " min: " << *std::min_element(frame_sub_steps.begin(), frame_sub_steps.end())
+                  << " max: " << *std::max_element(frame_sub_steps.begin(), frame_sub_steps.end())
+                  << " displacement error p50: " << percentile(displacement_errors, 0.50f) << " max: " << percentile(displacement_errors, 1.00f)
+                  << " overlap error p50: " << percentile(overlap_errors, 0.50f) << " max: " << percentile(overlap_errors, 1.00f) << "\n";
+    }
+    if (const NeighbourListStats *neighbour_stats = physics_handler.getNeighbourListStats()) {
+        const int64_t list_sub_steps = neighbour_stats->sub_steps;
+        std::cout << "neighbour lists: " << list_sub_steps << " sub steps, rebuilt " << neighbour_stats->rebuilds
+                  << " times (every " << (neighbour_stats->rebuilds > 0 ? static_cast<float>(list_sub_steps) / static_cast<float>(neighbour_stats->rebuilds) : 0.0f)
+                  << " sub steps), " << neighbour_stats->listed_pairs << " listed pairs\n";
+    }
+    if (!work_imbalances.empty()) {
+        std::cout << "collision thread busy time (ms):";
+        for (const double busy_time : thread_busy_times) {
+            std::cout << " " << busy_time / 1000.0;
+        }
+        std::cout << "\ncollision imbalance (busiest thread over mean) p50: " << percentile(work_imbalances, 0.50f)
+                  << " p90: " << percentile(work_imbalances, 0.90f)
+                  << " stolen strips per frame: " << static_cast<float>(stolen_tasks) / static_cast<float>(work_imbalances.size()) << "\n";
+    }
+    if (const SleepStats *sleep_stats = physics_handler.getSleepStats()) {
+        std::cout << "active particles: " << sleep_stats->active_objects
+                  << " active cells: " << sleep_stats->active_cells
+                  << " (mean active particles per frame: " << (active_counts.empty() ? 0.0f : std::accumulate(active_counts.begin(), active_counts.end(), 0.0f) / static_cast<float>(active_counts.size())) << ")\n";
+    }
+    if (const GridStats *grid_stats = physics_handler.getGridStats()) {
+        std::cout << "grid occupied cells: " << grid_stats->occupied_cells
+                  << " max occupancy: " << grid_stats->max_occupancy
+                  << " cells over " << nominal_cell_capacity << ": " << grid_stats->overflow_cells
+                  << " (" << grid_stats->overflow_objects << " particles)\n";
+    }
+    if (!scenario.save_checkpoint_path.empty() && !physics_handler.saveCheckpoint(scenario.save_checkpoint_path)) {
+        return false;
+    }
+    return true;
+}
+
+// One rank of a --domains run. Every rank emits the same batches and keeps the particles of its slab.
+static bool runDomainScenario(const Scenario &scenario, const BackendType backend_type, DomainTransport &transport) {
+    PhysicsHandler physics_handler({static_cast<float>(scenario.world_size.x), static_cast<float>(scenario.world_size.y)}, backend_type, scenario.grid_type);
+    physics_handler.setProfiling(true);
+    DomainSettings domain_settings;
+    domain_settings.reorder_interval = scenario.reorder_interval;
+    if (scenario.sub_steps > 0) {
+        domain_settings.sub_steps = scenario.sub_steps;
+    }
+    DomainHandler domain_handler(physics_handler, transport, domain_settings);
+    constexpr float delta_time = 1.0f / 60.0f;
+
+    const std::string output_path = getOutputPath(scenario, backend_type);
+    std::ofstream output(output_path);
+    if (!output) {
+        std::cerr << "cannot open " << output_path << "\n";
+        return false;
+    }
+    output << "object_counts,physics_update_elapsed_time,exchange_elapsed_time,integrate_elapsed_time,grid_elapsed_time,collision_elapsed_time\n";
+
+    std::vector<float> frame_times, exchange_times, drain_times;
+    int64_t drained_count = 0;
+    const std::unique_ptr<Emitter> emitter = createEmitter(scenario, physics_handler.getWorldSize(), 0);
+    ObjectBatch batch;
+    int32_t emitted_count = 0;
+    int32_t settle_frames = 0;
+    // every rank must run the same frames, so the end depends on the emission only
+    for (int32_t frame = 0; scenario.max_frames == 0 || frame < scenario.max_frames; ++frame) {
+        if (emitted_count >= scenario.particle_count && settle_frames++ >= scenario.settle_frames) {
+            break;
+        }
+        if (scenario.drain_height > 0.0f) {
+            const V2f world_size = physics_handler.getWorldSize();
+            const auto drain_start = std::chrono::high_resolution_clock::now();
+            drained_count += physics_handler.removeObjectsInRect({0.0f, world_size.y - scenario.drain_height}, world_size);
+            drain_times.push_back(std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - drain_start).count());
+        }
+        if (emitBatch(scenario, *emitter, batch, emitted_count)) {
+            emitted_count += batch.size();
+            domain_handler.createObjects(batch);
+        }
+
+        const auto update_start = std::chrono::high_resolution_clock::now();
+        if (!domain_handler.update(delta_time)) {
+            return false;
+        }
+        const float update_time = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - update_start).count();
+        frame_times.push_back(update_time);
+        exchange_times.push_back(domain_handler.getStats().last_exchange_time);
+
+        SubStepTimings frame_timings;
+        for (const SubStepTimings &timings : domain_handler.getSubStepTimings()) {
+            frame_timings.integrate_time += timings.integrate_time;
+            frame_timings.grid_time      += timings.grid_time;
+            frame_timings.collision_time += timings.collision_time;
+        }
+        output << physics_handler.getObjectsCount() << ","
+               << static_cast<int64_t>(update_time) << ","
+               << static_cast<int64_t>(domain_handler.getStats().last_exchange_time) << ","
+               << static_cast<int64_t>(frame_timings.integrate_time) << ","
+               << static_cast<int64_t>(frame_timings.grid_time) << ","
+               << static_cast<int64_t>(frame_timings.collision_time) << "\n";
+    }
+
+    const DomainStats &stats = domain_handler.getStats();
+    const std::string rank_name = "rank " + std::to_string(transport.getRank());
+    std::cout << rank_name << " backend: " << getBackendName(physics_handler.getBackendType())
+              << " slab: " << domain_handler.getSlabMin() << "-" << domain_handler.getSlabMax()
+              << " particles: " << physics_handler.getObjectsCount()
+              << " frames: " << frame_times.size()
+              << " ghosts sent: " << stats.sent_ghosts << " received: " << stats.received_ghosts
+              << " migrated out: " << stats.migrated_out << " in: " << stats.migrated_in << "\n";
+    printPercentiles(rank_name + " frame    ", frame_times);
+    printPercentiles(rank_name + " exchange ", exchange_times);
+    if (!drain_times.empty()) {
+        printPercentiles(rank_name + " drain    ", drain_times);
+        std::cout << rank_name << " removed particles: " << drained_count << "\n";
+    }
+    return true;
+}
+
+// runs every rank of --domains, forking the ranks after the first, or only --domain-rank
+static bool runDomains(Scenario scenario) {
+    const BackendType backend_type = scenario.backends.front();
+    if (backend_type == BackendType::CUDA || scenario.adaptive_sub_steps || scenario.sleep_steps > 0
+        || !scenario.load_checkpoint_path.empty() || !scenario.save_checkpoint_path.empty() || !scenario.record_path.empty()) {
+        std::cerr << "--domains runs host backends without adaptive sub steps, sleeping, checkpoints or recording\n";
+        return false;
+    }
+    if (scenario.domain_rank >= 0) {
+        if (scenario.domain_name.empty() || scenario.domain_rank >= scenario.domain_count) {
+            std::cerr << "--domain-rank needs --domain-name and a rank below --domains\n";
+            return false;
+        }
+        SharedMemoryTransport transport(scenario.domain_name, scenario.domain_rank, scenario.domain_count);
+        return transport.isOpen() && runDomainScenario(scenario, backend_type, transport);
+    }
+#ifdef _WIN32
+    std::cerr << "start one process per rank with --domain-rank and --domain-name\n";
+    return false;
+#else
+    const pid_t parent = getpid();
+    scenario.domain_name = "/pbd_" + std::to_string(parent) + "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    std::vector<pid_t> children;
+    scenario.domain_rank = 0;
+    for (int32_t rank = 1; rank < scenario.domain_count; ++rank) {
+        const pid_t child = fork();
+        if (child == 0) {
+            scenario.domain_rank = rank;
+            children.clear();
+            break;
+        }
+        if (child < 0) {
+            std::cerr << "cannot start rank " << rank << "\n";
+            return false;
+        }
+        children.push_back(child);
+    }
+    bool succeeded;
+    {
+        SharedMemoryTransport transport(scenario.domain_name, scenario.domain_rank, scenario.domain_count);
+        succeeded = transport.isOpen() && runDomainScenario(scenario, backend_type, transport);
+    }
+    std::cout.flush();
+    if (scenario.domain_rank != 0) {
+        _exit(succeeded ? 0 : 1);
+    }
+    for (const pid_t child : children) {
+        int status = 0;
+        succeeded &= waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return succeeded;
+#endif
+}
+
+int main(int argc, char **argv) {
+    Scenario scenario;
+    if (!parseArguments(argc, argv, scenario)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (scenario.emitter == EmitterPattern::Lattice) {
+        const V2i lattice_size = getLatticeSize({static_cast<float>(scenario.world_size.x), static_cast<float>(scenario.world_size.y)});
+        if (scenario.particle_count > lattice_size.x * lattice_size.y) {
+            scenario.particle_count = lattice_size.x * lattice_size.y;
+            std::cerr << "lattice holds at most " << scenario.particle_count << " particles in this world\n";
+        }
+    }
+
+    cpu_threads = scenario.threads;
+    if (scenario.domain_count > 1) {
+        return runDomains(scenario) ? 0 : 1;
+    }
+    PBD_TRACE_THREAD_NAME("main");
+    for (const BackendType backend_type : scenario.backends) {
+        if (!runScenario(scenario, backend_type)) {
+            return 1;
+        }
+    }
+    if (!scenario.trace_path.empty() && !Tracer::instance().writeChromeTrace(scenario.trace_path)) {
+        return 1;
+    }
+    return 0;
+}
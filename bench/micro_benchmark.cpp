@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "cpu_backend.hpp"
+#include "emitters.hpp"
+#include "object.hpp"
+#include "renderer.hpp"
+#include "simulation_backend.hpp"
+
+// Times the host kernels one at a time on fixed particle layouts: the integration, the grid rebuild, the
+// collision pass and the per frame renderer vertex update. Every repetition starts from the same state.
+
+enum class Kernel {
+    UpdateObjects,   // CpuBackend::updateObjects, one sub step
+    UpdateGrids,     // CpuBackend::updateGrids
+    SolveCollisions, // CpuBackend::solveCollisions on a grid built from the same state
+    Vertices,        // writeParticleQuads, the vertex positions a render rewrites each frame
+};
+
+enum class Fixture {
+    Uniform, // spread over a square world, about 12% of it covered
+    Pile,    // packed and slightly overlapping at the bottom of the world, every particle in contact
+    Sparse,  // spread over 16 times the area per particle of uniform, on the sparse grid
+};
+
+static const char *getKernelName(const Kernel kernel) {
+    switch (kernel) {
+        case Kernel::UpdateObjects:   return "update_objects";
+        case Kernel::UpdateGrids:     return "update_grids";
+        case Kernel::SolveCollisions: return "solve_collisions";
+        case Kernel::Vertices:        return "vertices";
+    }
+    return "unknown";
+}
+
+static const char *getFixtureName(const Fixture fixture) {
+    switch (fixture) {
+        case Fixture::Uniform: return "uniform";
+        case Fixture::Pile:    return "pile";
+        case Fixture::Sparse:  return "sparse";
+    }
+    return "unknown";
+}
+
+struct Options {
+    std::vector<Kernel> kernels = {Kernel::UpdateObjects, Kernel::UpdateGrids, Kernel::SolveCollisions, Kernel::Vertices};
+    std::vector<Fixture> fixtures = {Fixture::Uniform, Fixture::Pile, Fixture::Sparse};
+    std::vector<int32_t> particle_counts = {10000, 100000, 1000000};
+    std::vector<int32_t> thread_counts;
+    std::vector<BackendType> backends = {BackendType::SIMD};
+    int32_t repetitions = 10;
+    uint32_t seed = 1;
+    std::string output_path = "micro_benchmark.csv";
+    std::string baseline_path;
+    float tolerance = 0.1f;
+};
+
+// one timed kernel on one fixture, times in microseconds
+struct Result {
+    std::string kernel, fixture, backend;
+    int32_t particles = 0;
+    int32_t threads = 0;
+    int32_t repetitions = 0;
+    double min_time = 0.0, median_time = 0.0, mean_time = 0.0;
+};
+
+static void printUsage(const char *program) {
+    std::cout
+        << "usage: " << program << " [options]\n"
+        << "  --kernels LIST        comma separated update_objects | update_grids | solve_collisions | vertices\n"
+        << "                        (default all)\n"
+        << "  --fixtures LIST       comma separated uniform | pile | sparse (default all)\n"
+        << "  --particles LIST      comma separated particle counts (default 10000,100000,1000000)\n"
+        << "  --threads LIST        comma separated thread counts (default 1, 2, 4... up to " << cpu_threads << ")\n"
+        << "  --backend LIST        comma separated scalar | openmp | simd, scalar runs on one thread only\n"
+        << "                        (default simd)\n"
+        << "  --repetitions N       timed runs of each kernel, after one untimed run (default 10)\n"
+        << "  --seed N              seed of the fixtures (default 1)\n"
+        << "  --output PATH         results csv (default micro_benchmark.csv)\n"
+        << "  --baseline PATH       results csv of an earlier run to compare the medians with; exits with 2\n"
+        << "                        when a kernel is slower than the tolerance allows\n"
+        << "  --tolerance R         slowdown over the baseline median reported as a regression (default 0.1)\n";
+}
+
+template<typename T, typename Parse>
+static bool parseList(const std::string &text, std::vector<T> &values, const Parse &parse) {
+    values.clear();
+    size_t begin = 0;
+    while (begin <= text.size()) {
+        const size_t end = std::min(text.find(',', begin), text.size());
+        T value;
+        if (!parse(text.substr(begin, end - begin), value)) return false;
+        values.push_back(value);
+        begin = end + 1;
+    }
+    return !values.empty();
+}
+
+static bool parseKernel(const std::string &name, Kernel &kernel) {
+    for (const Kernel candidate : {Kernel::UpdateObjects, Kernel::UpdateGrids, Kernel::SolveCollisions, Kernel::Vertices}) {
+        if (name == getKernelName(candidate)) {
+            kernel = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseFixture(const std::string &name, Fixture &fixture) {
+    for (const Fixture candidate : {Fixture::Uniform, Fixture::Pile, Fixture::Sparse}) {
+        if (name == getFixtureName(candidate)) {
+            fixture = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parsePositive(const std::string &text, int32_t &value) {
+    value = std::atoi(text.c_str());
+    return value > 0;
+}
+
+static bool parseHostBackend(const std::string &name, BackendType &type) {
+    return parseBackendType(name, type) && type != BackendType::CUDA;
+}
+
+static bool parseArguments(const int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return false;
+        }
+        const char *value = argv[++i];
+        bool valid = true;
+        if      (arg == "--kernels")     { valid = parseList(value, options.kernels, parseKernel); }
+        else if (arg == "--fixtures")    { valid = parseList(value, options.fixtures, parseFixture); }
+        else if (arg == "--particles")   { valid = parseList(value, options.particle_counts, parsePositive); }
+        else if (arg == "--threads")     { valid = parseList(value, options.thread_counts, parsePositive); }
+        else if (arg == "--backend")     { valid = parseList(value, options.backends, parseHostBackend); }
+        else if (arg == "--repetitions") { options.repetitions = std::max(1, std::atoi(value)); }
+        else if (arg == "--seed")        { options.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10)); }
+        else if (arg == "--output")      { options.output_path = value; }
+        else if (arg == "--baseline")    { options.baseline_path = value; }
+        else if (arg == "--tolerance")   { options.tolerance = std::max(0.0f, static_cast<float>(std::atof(value))); }
+        else {
+            std::cerr << "unknown option: " << arg << "\n";
+            return false;
+        }
+        if (!valid) {
+            std::cerr << "invalid value for " << arg << ": " << value << "\n";
+            return false;
+        }
+    }
+    if (options.thread_counts.empty()) {
+        for (int32_t threads = 1; threads < cpu_threads; threads *= 2) {
+            options.thread_counts.push_back(threads);
+        }
+        options.thread_counts.push_back(cpu_threads);
+    }
+    return true;
+}
+
+// Fills the particles of a fixture from a lattice with jittered positions and radii between 0.3 and 0.5,
+// the same for a seed whatever the thread count. Velocities are small so the integration has work to do.
+static V2f createFixture(const Fixture fixture, const int32_t particle_count, const uint32_t seed, Object &objects) {
+    float spacing = 2.0f;
+    float filled_height = 1.0f; // fraction of the world height the lattice covers, from the bottom
+    switch (fixture) {
+        case Fixture::Uniform: spacing = 2.0f;  filled_height = 1.0f; break;
+        case Fixture::Pile:    spacing = 0.95f; filled_height = 0.5f; break;
+        case Fixture::Sparse:  spacing = 8.0f;  filled_height = 1.0f; break;
+    }
+    // a square world whose filled part holds the particles with a spare row
+    const auto side = static_cast<float>(std::ceil(std::sqrt(static_cast<float>(particle_count) / filled_height) * spacing + spacing)) + 2.0f * WORLD_MARGIN;
+    const V2f world_size = {side, side};
+
+    EmitterSettings settings;
+    settings.min_radius = 0.3f;
+    settings.max_radius = 0.5f;
+    settings.velocity_jitter = {0.01f, 0.01f};
+    settings.position_jitter = fixture == Fixture::Pile ? V2f{0.02f, 0.02f} : V2f{0.25f * spacing, 0.25f * spacing};
+    settings.hue_step = 0.1f;
+    settings.seed = seed;
+    const V2f lattice_min = {WORLD_MARGIN, side - WORLD_MARGIN - filled_height * (side - 2.0f * WORLD_MARGIN)};
+    LatticeEmitter lattice(settings, lattice_min, {side - WORLD_MARGIN, side - WORLD_MARGIN}, spacing);
+    ObjectBatch batch;
+    const int32_t count = lattice.emit(batch, particle_count);
+
+    objects = Object();
+    objects.resize(count);
+    for (int32_t i = 0; i < count; ++i) {
+        objects.position_x[i]      = batch.position_x[i];
+        objects.position_y[i]      = batch.position_y[i];
+        objects.last_position_x[i] = batch.position_x[i] - batch.velocity_x[i];
+        objects.last_position_y[i] = batch.position_y[i] - batch.velocity_y[i];
+        objects.radius[i]          = batch.radius[i];
+        objects.sleep_anchor_x[i]  = batch.position_x[i];
+        objects.sleep_anchor_y[i]  = batch.position_y[i];
+        objects.color[i]           = batch.color[i];
+        objects.max_radius = std::max(objects.max_radius, batch.radius[i]);
+    }
+    objects.size = count;
+    return world_size;
+}
+
+// times repetitions runs of kernel on the fixture, each after restoring it; the first run is not timed
+static Result runKernel(const Kernel kernel, const Fixture fixture, const Object &fixture_objects, const V2f world_size,
+                        const BackendType backend_type, const int32_t threads, const int32_t repetitions) {
+    cpu_threads = threads;
+    const GridType grid_type = fixture == Fixture::Sparse ? GridType::Sparse : GridType::Dense;
+    CpuBackend backend(world_size, backend_type, grid_type);
+    Object objects;
+    std::vector<sf::Vertex> vertices;
+    if (kernel == Kernel::Vertices) {
+        vertices.resize(static_cast<size_t>(fixture_objects.size) * 4);
+    }
+    constexpr float delta_time = 1.0f / 60.0f / 8.0f;
+
+    std::vector<double> times;
+    for (int32_t repetition = 0; repetition <= repetitions; ++repetition) {
+        objects = fixture_objects;
+        if (kernel == Kernel::SolveCollisions) {
+            backend.updateGrids(objects);
+        }
+        const auto start = std::chrono::high_resolution_clock::now();
+        switch (kernel) {
+            case Kernel::UpdateObjects:   backend.updateObjects(objects, delta_time, world_size); break;
+            case Kernel::UpdateGrids:     backend.updateGrids(objects); break;
+            case Kernel::SolveCollisions: backend.solveCollisions(objects); break;
+            case Kernel::Vertices:
+                writeParticleQuads(vertices.data(), objects.position_x.data(), objects.position_y.data(), objects.radius.data(), objects.size);
+                break;
+        }
+        const double time = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+        if (repetition > 0) times.push_back(time);
+    }
+
+    Result result;
+    result.kernel      = getKernelName(kernel);
+    result.fixture     = getFixtureName(fixture);
+    result.backend     = getBackendName(backend_type);
+    result.particles   = fixture_objects.size;
+    result.threads     = threads;
+    result.repetitions = repetitions;
+    std::sort(times.begin(), times.end());
+    result.min_time    = times.front();
+    result.median_time = times[times.size() / 2];
+    double sum = 0.0;
+    for (const double time : times) sum += time;
+    result.mean_time   = sum / static_cast<double>(times.size());
+    return result;
+}
+
+static const char *csv_header = "kernel,fixture,particles,backend,threads,repetitions,min_us,median_us,mean_us,ns_per_particle";
+
+static void writeResult(std::ostream &output, const Result &result) {
+    output << result.kernel << "," << result.fixture << "," << result.particles << "," << result.backend << ","
+           << result.threads << "," << result.repetitions << ","
+           << result.min_time << "," << result.median_time << "," << result.mean_time << ","
+           << 1000.0 * result.median_time / static_cast<double>(std::max(1, result.particles)) << "\n";
+}
+
+using ResultKey = std::tuple<std::string, std::string, int32_t, std::string, int32_t>;
+
+static ResultKey getKey(const Result &result) {
+    return {result.kernel, result.fixture, result.particles, result.backend, result.threads};
+}
+
+// results of an earlier run by kernel, fixture, particles, backend and threads
+static bool readBaseline(const std::string &path, std::map<ResultKey, Result> &baseline) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "cannot open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    if (!std::getline(file, line) || line != csv_header) {
+        std::cerr << path << " is not a micro benchmark csv\n";
+        return false;
+    }
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        for (std::string field; std::getline(stream, field, ',');) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 9) continue;
+        Result result;
+        result.kernel      = fields[0];
+        result.fixture     = fields[1];
+        result.particles   = std::atoi(fields[2].c_str());
+        result.backend     = fields[3];
+        result.threads     = std::atoi(fields[4].c_str());
+        result.repetitions = std::atoi(fields[5].c_str());
+        result.min_time    = std::atof(fields[6].c_str());
+        result.median_time = std::atof(fields[7].c_str());
+        result.mean_time   = std::atof(fields[8].c_str());
+        baseline[getKey(result)] = result;
+    }
+    return true;
+}
+
+// prints every result next to its baseline, returns the number of regressions
+static int32_t compareWithBaseline(const std::vector<Result> &results, const std::map<ResultKey, Result> &baseline, const float tolerance) {
+    int32_t regressions = 0, compared = 0;
+    std::cout << "\ncompared with the baseline medians, tolerance " << tolerance * 100.0f << "%:\n";
+    for (const Result &result : results) {
+        const auto found = baseline.find(getKey(result));
+        if (found == baseline.end()) continue;
+        ++compared;
+        const double ratio = found->second.median_time > 0.0 ? result.median_time / found->second.median_time : 1.0;
+        const bool regressed = ratio > 1.0 + tolerance;
+        regressions += regressed;
+        std::cout << "  " << result.kernel << " " << result.fixture << " " << result.particles << " " << result.backend
+                  << " " << result.threads << " threads: " << result.median_time << " us, baseline " << found->second.median_time
+                  << " us, x" << ratio << (regressed ? "  REGRESSION" : "") << "\n";
+    }
+    std::cout << compared << " results compared, " << regressions << " regressions\n";
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    std::map<ResultKey, Result> baseline;
+    if (!options.baseline_path.empty() && !readBaseline(options.baseline_path, baseline)) {
+        return 1;
+    }
+    std::ofstream output(options.output_path);
+    if (!output) {
+        std::cerr << "cannot open " << options.output_path << "\n";
+        return 1;
+    }
+    output << csv_header << "\n";
+    std::cout << csv_header << "\n";
+
+    std::vector<Result> results;
+    Object fixture_objects;
+    for (const Fixture fixture : options.fixtures) {
+        for (const int32_t particle_count : options.particle_counts) {
+            const V2f world_size = createFixture(fixture, particle_count, options.seed, fixture_objects);
+            for (const BackendType backend_type : options.backends) {
+                for (const int32_t threads : options.thread_counts) {
+                    // the scalar backend ignores the thread count
+                    if (backend_type == BackendType::Scalar && threads != options.thread_counts.front()) continue;
+                    for (const Kernel kernel : options.kernels) {
+                        Result result = runKernel(kernel, fixture, fixture_objects, world_size, backend_type, backend_type == BackendType::Scalar ? 1 : threads, options.repetitions);
+                        writeResult(output, result);
+                        writeResult(std::cout, result);
+                        results.push_back(result);
+                    }
+                }
+            }
+        }
+    }
+    if (!output) {
+        std::cerr << "cannot write " << options.output_path << "\n";
+        return 1;
+    }
+    if (!baseline.empty() && compareWithBaseline(results, baseline, options.tolerance) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef BACKEND_FACTORY_HPP
+#define BACKEND_FACTORY_HPP
+
+#include <iostream>
+#include <memory>
+
+#include "cpu_backend.hpp"
+#include "simulation_backend.hpp"
+#include "utils.hpp"
+
+#ifdef PBD_WITH_CUDA
+extern bool isCudaAvailable();
+extern std::unique_ptr<SimulationBackend> createCudaBackend(V2f world_size);
+#endif
+
+// the CUDA backend falls back to the SIMD backend when the binary is built without CUDA or no device is found,
+// and always uses a dense grid
+inline std::unique_ptr<SimulationBackend> createBackend(const BackendType type, const V2f world_size, const GridType grid_type = GridType::Dense) {
+    if (type == BackendType::CUDA) {
+    #ifdef PBD_WITH_CUDA
+        if (isCudaAvailable()) {
+            if (grid_type != GridType::Dense) {
+                std::cerr << "The cuda backend only supports the dense grid" << std::endl;
+            }
+            return createCudaBackend(world_size);
+        }
+        std::cerr << "No CUDA device found, falling back to the simd backend" << std::endl;
+    #else
+        std::cerr << "Built without CUDA, falling back to the simd backend" << std::endl;
+    #endif
+        return std::make_unique<CpuBackend>(world_size, BackendType::SIMD, grid_type);
+    }
+    return std::make_unique<CpuBackend>(world_size, type, grid_type);
+}
+
+#endif
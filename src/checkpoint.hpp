@@ -0,0 +1,200 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "object.hpp"
+#include "utils.hpp"
+
+// Checkpoint file: a CheckpointHeader followed by one little-endian array per particle attribute, in the order
+// of CheckpointArray. Every array holds object_count 4 byte values and starts on a checkpoint_alignment byte
+// boundary, at the offset stored in the header. Readers reject other versions.
+constexpr char checkpoint_magic[8] = {'P', 'B', 'D', 'C', 'K', 'P', 'T', '\0'};
+constexpr uint32_t checkpoint_version = 3;
+constexpr uint64_t checkpoint_alignment = 64;
+// far above any particle count simulated, the handle maps of a file claiming more would not fit in memory
+constexpr int32_t checkpoint_max_handle_count = 1 << 27;
+
+enum class CheckpointArray : uint32_t {
+    PositionX, PositionY,
+    LastPositionX, LastPositionY,
+    Radius,
+    SleepAnchorX, SleepAnchorY,
+    StillSteps,
+    Color, // packed, see packColor; three float arrays before version 2
+    Handles, // handle of the particle at each index, see PhysicsHandler::getObjectIndex
+};
+constexpr uint32_t checkpoint_array_count = static_cast<uint32_t>(CheckpointArray::Handles) + 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t object_count;
+    int32_t handle_count; // every handle is below it, added in version 3
+    int32_t sub_steps;
+    float world_size_x, world_size_y;
+    float acceleration_x, acceleration_y;
+    float max_radius;
+    uint32_t array_count;
+    uint64_t array_offsets[checkpoint_array_count]; // from the start of the file
+};
+
+// simulation state stored in a checkpoint besides the particles
+struct CheckpointSettings {
+    V2f world_size;
+    int32_t sub_steps = 8;
+    int32_t handle_count = 0; // see PhysicsHandler::getHandleCount
+};
+
+inline bool isLittleEndianHost() {
+    const uint16_t value = 1;
+    uint8_t first_byte = 0;
+    std::memcpy(&first_byte, &value, 1);
+    return first_byte == 1;
+}
+
+inline bool writeCheckpoint(const std::string &path, const Object &objects, const std::vector<int32_t> &index_to_handle, const CheckpointSettings &settings) {
+    if (!isLittleEndianHost()) {
+        std::cerr << "checkpoints are only supported on little-endian hosts" << std::endl;
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "cannot open " << path << std::endl;
+        return false;
+    }
+
+    const void *arrays[checkpoint_array_count] = {
+        objects.position_x.data(), objects.position_y.data(),
+        objects.last_position_x.data(), objects.last_position_y.data(),
+        objects.radius.data(),
+        objects.sleep_anchor_x.data(), objects.sleep_anchor_y.data(),
+        objects.still_steps.data(),
+        objects.color.data(),
+        index_to_handle.data(),
+    };
+    const uint64_t array_size = static_cast<uint64_t>(objects.size) * sizeof(float);
+    const auto align = [](const uint64_t offset) {
+        return (offset + checkpoint_alignment - 1) / checkpoint_alignment * checkpoint_alignment;
+    };
+
+    CheckpointHeader header {};
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version        = checkpoint_version;
+    header.header_size    = sizeof(CheckpointHeader);
+    header.object_count   = objects.size;
+    header.handle_count   = settings.handle_count;
+    header.sub_steps      = settings.sub_steps;
+    header.world_size_x   = settings.world_size.x;
+    header.world_size_y   = settings.world_size.y;
+    header.acceleration_x = objects.acceleration_x;
+    header.acceleration_y = objects.acceleration_y;
+    header.max_radius     = objects.max_radius;
+    header.array_count    = checkpoint_array_count;
+    uint64_t offset = align(sizeof(CheckpointHeader));
+    for (uint64_t &array_offset : header.array_offsets) {
+        array_offset = offset;
+        offset = align(offset + array_size);
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t written = sizeof(header);
+    const char padding[checkpoint_alignment] = {};
+    for (uint32_t array = 0; array < checkpoint_array_count; ++array) {
+        file.write(padding, static_cast<std::streamsize>(header.array_offsets[array] - written));
+        file.write(static_cast<const char *>(arrays[array]), static_cast<std::streamsize>(array_size));
+        written = header.array_offsets[array] + array_size;
+    }
+    if (!file) {
+        std::cerr << "cannot write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Replaces objects and index_to_handle with the particles of the checkpoint. objects is left untouched when the
+// file is not a valid checkpoint.
+inline bool readCheckpoint(const std::string &path, Object &objects, std::vector<int32_t> &index_to_handle, CheckpointSettings &settings) {
+    if (!isLittleEndianHost()) {
+        std::cerr << "checkpoints are only supported on little-endian hosts" << std::endl;
+        return false;
+    }
+    const MappedFile file(path);
+    if (!file.isOpen()) {
+        std::cerr << "cannot map " << path << std::endl;
+        return false;
+    }
+
+    CheckpointHeader header {};
+    std::memcpy(&header, file.getData(), std::min(file.getSize(), sizeof(header)));
+    if (file.getSize() < sizeof(header) || std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0) {
+        std::cerr << path << " is not a checkpoint" << std::endl;
+        return false;
+    }
+    if (header.version != checkpoint_version || header.header_size != sizeof(CheckpointHeader) || header.array_count != checkpoint_array_count) {
+        std::cerr << path << " is a version " << header.version << " checkpoint, expected version " << checkpoint_version << std::endl;
+        return false;
+    }
+    if (!(header.world_size_x >= 1.0f && header.world_size_y >= 1.0f) || header.object_count < 0
+        || header.handle_count < header.object_count || header.handle_count > checkpoint_max_handle_count) {
+        std::cerr << path << " has an invalid world size, particle count or handle count" << std::endl;
+        return false;
+    }
+    const uint64_t array_size = static_cast<uint64_t>(header.object_count) * sizeof(float);
+    for (const uint64_t array_offset : header.array_offsets) {
+        if (array_offset % alignof(float) != 0 || array_offset > file.getSize() || file.getSize() - array_offset < array_size) {
+            std::cerr << path << " is truncated" << std::endl;
+            return false;
+        }
+    }
+
+    const int32_t object_count = header.object_count;
+    // the handles must be distinct and below the handle count, they have gaps where particles were removed
+    const auto *handles = reinterpret_cast<const int32_t *>(file.getData() + header.array_offsets[static_cast<uint32_t>(CheckpointArray::Handles)]);
+    std::vector<int32_t> sorted_handles(handles, handles + object_count);
+    std::sort(sorted_handles.begin(), sorted_handles.end());
+    if ((object_count > 0 && (sorted_handles.front() < 0 || sorted_handles.back() >= header.handle_count)) || std::adjacent_find(sorted_handles.begin(), sorted_handles.end()) != sorted_handles.end()) {
+        std::cerr << path << " has invalid particle handles" << std::endl;
+        return false;
+    }
+
+    const auto read = [&](const CheckpointArray array, auto &values) {
+        using T = typename std::decay_t<decltype(values)>::value_type;
+        const auto *first = reinterpret_cast<const T *>(file.getData() + header.array_offsets[static_cast<uint32_t>(array)]);
+        values.assign(first, first + object_count);
+    };
+    read(CheckpointArray::PositionX, objects.position_x);
+    read(CheckpointArray::PositionY, objects.position_y);
+    read(CheckpointArray::LastPositionX, objects.last_position_x);
+    read(CheckpointArray::LastPositionY, objects.last_position_y);
+    read(CheckpointArray::Radius, objects.radius);
+    read(CheckpointArray::SleepAnchorX, objects.sleep_anchor_x);
+    read(CheckpointArray::SleepAnchorY, objects.sleep_anchor_y);
+    read(CheckpointArray::StillSteps, objects.still_steps);
+    read(CheckpointArray::Color, objects.color);
+    read(CheckpointArray::Handles, index_to_handle);
+    objects.size           = object_count;
+    objects.ghost_count    = 0;
+    // the grid levels follow the largest radius, which the header could understate
+    objects.max_radius     = header.max_radius;
+    for (const float radius : objects.radius) {
+        objects.max_radius = std::max(objects.max_radius, radius);
+    }
+    objects.acceleration_x = header.acceleration_x;
+    objects.acceleration_y = header.acceleration_y;
+    settings.world_size = {header.world_size_x, header.world_size_y};
+    settings.sub_steps  = header.sub_steps;
+    settings.handle_count = header.handle_count;
+    return true;
+}
+
+#endif
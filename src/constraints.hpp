@@ -0,0 +1,293 @@
+#ifndef CONSTRAINTS_HPP
+#define CONSTRAINTS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "object.hpp"
+#include "utils.hpp"
+
+// Distance constraints between particles, structure of arrays kept by handle so they follow the particles when
+// they are reordered or compacted. The constraints are sorted by color: two constraints of a color never share
+// a particle, so a color is solved in parallel without atomics. Colors are assigned greedily when constraints
+// were added or removed since the last prepare, a particle with links of every one of the max_color_count
+// colors sends its next links to a last color solved serially.
+class DistanceConstraints {
+public:
+    static constexpr int32_t max_color_count = 64;
+
+    // stiffness is the fraction of the length error corrected each sub step, in [0, 1]
+    void add(const int32_t _handle_a, const int32_t _handle_b, const float _rest_length, const float _stiffness) {
+        handle_a.push_back(_handle_a);
+        handle_b.push_back(_handle_b);
+        rest_length.push_back(_rest_length);
+        stiffness.push_back(std::clamp(_stiffness, 0.0f, 1.0f));
+        colored = false;
+    }
+
+    void clear() {
+        for (std::vector<int32_t> *values : {&handle_a, &handle_b, &index_a, &index_b}) {
+            values->clear();
+        }
+        rest_length.clear();
+        stiffness.clear();
+        color_start.assign(1, 0);
+        colored = true;
+    }
+
+    [[nodiscard]]
+    int32_t size() const {
+        return static_cast<int32_t>(handle_a.size());
+    }
+
+    // removes the constraints of the particles whose handle maps to no index, returns the number removed
+    int32_t removeReleased(const std::vector<int32_t> &handle_to_index) {
+        int32_t kept = 0;
+        for (int32_t i = 0; i < size(); ++i) {
+            if (handle_to_index[handle_a[i]] < 0 || handle_to_index[handle_b[i]] < 0) continue;
+            handle_a[kept]    = handle_a[i];
+            handle_b[kept]    = handle_b[i];
+            rest_length[kept] = rest_length[i];
+            stiffness[kept]   = stiffness[i];
+            ++kept;
+        }
+        const int32_t removed = size() - kept;
+        if (removed > 0) {
+            resize(kept);
+            colored = false;
+        }
+        return removed;
+    }
+
+    // colors the constraints when they changed and maps their handles to the current particle indices
+    void prepare(const std::vector<int32_t> &handle_to_index, const uint64_t layout_version) {
+        const bool recolored = !colored;
+        if (recolored) {
+            color(static_cast<int32_t>(handle_to_index.size()));
+        }
+        if (!recolored && mapped_layout_version == layout_version) return;
+        const int32_t count = size();
+        index_a.resize(count);
+        index_b.resize(count);
+        #pragma omp parallel for num_threads(cpu_threads) if(count >= 65536)
+        for (int32_t i = 0; i < count; ++i) {
+            index_a[i] = handle_to_index[handle_a[i]];
+            index_b[i] = handle_to_index[handle_b[i]];
+        }
+        mapped_layout_version = layout_version;
+    }
+
+    // colors after prepare, the last one is solved serially when some particle ran out of colors
+    [[nodiscard]]
+    int32_t getColorCount() const {
+        return static_cast<int32_t>(color_start.size()) - 1;
+    }
+
+    // constraints [getColorStart(c), getColorStart(c + 1)) have color c
+    [[nodiscard]]
+    int32_t getColorStart(const int32_t color) const {
+        return color_start[color];
+    }
+
+    [[nodiscard]]
+    bool isSerialColor(const int32_t color) const {
+        return color == max_color_count;
+    }
+
+    // particle indices after prepare
+    [[nodiscard]]
+    const int32_t *getIndicesA() const {
+        return index_a.data();
+    }
+
+    [[nodiscard]]
+    const int32_t *getIndicesB() const {
+        return index_b.data();
+    }
+
+    [[nodiscard]]
+    const float *getRestLengths() const {
+        return rest_length.data();
+    }
+
+    [[nodiscard]]
+    const float *getStiffnesses() const {
+        return stiffness.data();
+    }
+
+private:
+    void resize(const int32_t count) {
+        handle_a.resize(count);
+        handle_b.resize(count);
+        rest_length.resize(count);
+        stiffness.resize(count);
+    }
+
+    // greedy coloring in the current order, then a stable counting sort by color
+    void color(const int32_t handle_count) {
+        const int32_t count = size();
+        used_colors.assign(handle_count, 0);
+        colors.resize(count);
+        color_start.assign(max_color_count + 2, 0);
+        for (int32_t i = 0; i < count; ++i) {
+            uint64_t &used_a = used_colors[handle_a[i]];
+            uint64_t &used_b = used_colors[handle_b[i]];
+            const uint64_t free_colors = ~(used_a | used_b);
+            int32_t constraint_color = max_color_count;
+            if (free_colors != 0) {
+                constraint_color = countTrailingZeros(free_colors);
+                used_a |= uint64_t{1} << constraint_color;
+                used_b |= uint64_t{1} << constraint_color;
+            }
+            colors[i] = constraint_color;
+            ++color_start[constraint_color + 1];
+        }
+        // the serial color only exists when used
+        const int32_t color_count = color_start[max_color_count + 1] > 0 ? max_color_count + 1 : std::min<int32_t>(max_color_count, getUsedColorCount());
+        for (int32_t c = 0; c < max_color_count + 1; ++c) {
+            color_start[c + 1] += color_start[c];
+        }
+        sorted.resize(count);
+        std::vector<int32_t> next(color_start.begin(), color_start.end() - 1);
+        for (int32_t i = 0; i < count; ++i) {
+            sorted[next[colors[i]]++] = i;
+        }
+        permute(handle_a);
+        permute(handle_b);
+        permute(rest_length);
+        permute(stiffness);
+        color_start.resize(color_count + 1);
+        colored = true;
+    }
+
+    // colors below max_color_count up to the highest one used
+    [[nodiscard]]
+    int32_t getUsedColorCount() const {
+        int32_t used = 0;
+        for (int32_t c = 0; c < max_color_count; ++c) {
+            if (color_start[c + 1] > 0) used = c + 1;
+        }
+        return used;
+    }
+
+    static int32_t countTrailingZeros(uint64_t value) {
+        int32_t zeros = 0;
+        while ((value & 1u) == 0) {
+            value >>= 1;
+            ++zeros;
+        }
+        return zeros;
+    }
+
+    // new[i] = old[sorted[i]]
+    template<typename T>
+    void permute(std::vector<T> &values) const {
+        std::vector<T> permuted(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            permuted[i] = values[sorted[i]];
+        }
+        values.swap(permuted);
+    }
+
+    std::vector<int32_t> handle_a, handle_b;
+    std::vector<float> rest_length, stiffness;
+    std::vector<int32_t> index_a, index_b;
+    std::vector<int32_t> color_start = {0};
+    std::vector<uint64_t> used_colors;
+    std::vector<int32_t> colors, sorted;
+    bool colored = true;
+    uint64_t mapped_layout_version = ~uint64_t{0};
+};
+
+// Particles and the distance constraints linking them, created together by PhysicsHandler::createLinkedObjects.
+// Links are pairs of indices into the batch, their rest length is the distance at creation.
+struct LinkedBatch {
+    ObjectBatch objects;
+    std::vector<int32_t> link_a, link_b;
+
+    void clear() {
+        objects.resize(0);
+        link_a.clear();
+        link_b.clear();
+    }
+
+    int32_t addObject(const V2f position, const float radius, const float r, const float g, const float b) {
+        const int32_t index = objects.size();
+        objects.resize(index + 1);
+        objects.position_x[index] = position.x;
+        objects.position_y[index] = position.y;
+        objects.velocity_x[index] = 0.0f;
+        objects.velocity_y[index] = 0.0f;
+        objects.radius[index]     = radius;
+        objects.color[index]      = packColor(r, g, b);
+        return index;
+    }
+
+    void addLink(const int32_t a, const int32_t b) {
+        link_a.push_back(a);
+        link_b.push_back(b);
+    }
+};
+
+// count particles from start to end, each linked to the next
+inline void buildChain(LinkedBatch &batch, const V2f start, const V2f end, const int32_t count, const float radius, const float r = 255.0f, const float g = 255.0f, const float b = 255.0f) {
+    const int32_t first = batch.objects.size();
+    for (int32_t i = 0; i < count; ++i) {
+        const float t = count > 1 ? static_cast<float>(i) / static_cast<float>(count - 1) : 0.0f;
+        batch.addObject(start + (end - start) * t, radius, r, g, b);
+        if (i > 0) batch.addLink(first + i - 1, first + i);
+    }
+}
+
+// columns x rows particles spacing apart from min, linked to their right and lower neighbours and across both
+// diagonals of each square so the sheet resists shearing
+inline void buildCloth(LinkedBatch &batch, const V2f min, const int32_t columns, const int32_t rows, const float spacing, const float radius, const float r = 255.0f, const float g = 255.0f, const float b = 255.0f) {
+    const int32_t first = batch.objects.size();
+    const auto at = [&](const int32_t x, const int32_t y) { return first + y * columns + x; };
+    for (int32_t y = 0; y < rows; ++y) {
+        for (int32_t x = 0; x < columns; ++x) {
+            batch.addObject({min.x + static_cast<float>(x) * spacing, min.y + static_cast<float>(y) * spacing}, radius, r, g, b);
+        }
+    }
+    for (int32_t y = 0; y < rows; ++y) {
+        for (int32_t x = 0; x < columns; ++x) {
+            if (x + 1 < columns) batch.addLink(at(x, y), at(x + 1, y));
+            if (y + 1 < rows) batch.addLink(at(x, y), at(x, y + 1));
+            if (x + 1 < columns && y + 1 < rows) {
+                batch.addLink(at(x, y), at(x + 1, y + 1));
+                batch.addLink(at(x + 1, y), at(x, y + 1));
+            }
+        }
+    }
+}
+
+// count particles around a circle, each linked to its two following neighbours and to the particle opposite it,
+// a ring that keeps its shape without a center particle. Needs at least 3 particles, false and nothing added
+// otherwise.
+inline bool buildBlob(LinkedBatch &batch, const V2f center, const float blob_radius, const int32_t count, const float radius, const float r = 255.0f, const float g = 255.0f, const float b = 255.0f) {
+    if (count < 3) {
+        std::cerr << "A blob needs at least 3 particles" << std::endl;
+        return false;
+    }
+    constexpr float two_pi = 6.28318531f;
+    const int32_t first = batch.objects.size();
+    for (int32_t i = 0; i < count; ++i) {
+        const float angle = two_pi * static_cast<float>(i) / static_cast<float>(count);
+        batch.addObject({center.x + blob_radius * std::cos(angle), center.y + blob_radius * std::sin(angle)}, radius, r, g, b);
+    }
+    // each pair is linked once: with 4 particles the second neighbour is the opposite one, with 3 and 5 the
+    // neighbours already link every pair
+    const bool second_links   = count >= 5;
+    const bool opposite_links = count == 4 || count >= 6;
+    for (int32_t i = 0; i < count; ++i) {
+        batch.addLink(first + i, first + (i + 1) % count);
+        if (second_links) batch.addLink(first + i, first + (i + 2) % count);
+        if (opposite_links && i < count / 2) batch.addLink(first + i, first + i + count / 2);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,904 @@
+#ifndef CPU_BACKEND_HPP
+#define CPU_BACKEND_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "grid_helper.hpp"
+#include "object.hpp"
+#include "simd_kernels.hpp"
+#include "simulation_backend.hpp"
+#include "sparse_grid_helper.hpp"
+#include "task_scheduler.hpp"
+#include "tracing.hpp"
+#include "utils.hpp"
+
+// Host backend behind the scalar, OpenMP and SIMD backend types. They share the grid and the
+// collision scheme and only differ by thread count and kernels. Only the grid of grid_type is allocated.
+class CpuBackend : public SimulationBackend {
+public:
+    CpuBackend(const V2f world_size, const BackendType _type, const GridType _grid_type = GridType::Dense)
+        : type(_type)
+        , grid_type(_grid_type)
+        , grid_helper(static_cast<int32_t>(world_size.x), static_cast<int32_t>(world_size.y))
+        , sparse_grid_helper(static_cast<int32_t>(world_size.x), static_cast<int32_t>(world_size.y))
+    {}
+
+    [[nodiscard]]
+    BackendType getType() const override {
+        return type;
+    }
+
+    [[nodiscard]]
+    GridType getGridType() const override {
+        return grid_type;
+    }
+
+    [[nodiscard]]
+    const GridStats *getGridStats() const override {
+        return isSparse() ? &sparse_grid_helper.getStats() : &grid_helper.getStats();
+    }
+
+    void setSleeping(const float sleep_distance, const int32_t _sleep_steps) override {
+        sleeping = _sleep_steps > 0;
+        sleep_distance2 = sleeping ? sleep_distance * sleep_distance : -1.0f;
+        sleep_steps = std::max(1, _sleep_steps);
+        awake_tracked = false;
+    }
+
+    [[nodiscard]]
+    const SleepStats *getSleepStats() const override {
+        return sleeping ? &sleep_stats : nullptr;
+    }
+
+    [[nodiscard]]
+    float getLastMaxOverlap() const override {
+        return last_max_overlap;
+    }
+
+    void setNeighbourSkin(const float skin) override {
+        neighbour_skin = std::max(0.0f, skin);
+        neighbour_lists_valid = false;
+        neighbour_stats = {};
+    }
+
+    [[nodiscard]]
+    const NeighbourListStats *getNeighbourListStats() const override {
+        return usesNeighbourLists() ? &neighbour_stats : nullptr;
+    }
+
+    [[nodiscard]]
+    const WorkStats *getWorkStats() const override {
+        return &task_scheduler.getStats();
+    }
+
+    void beginFrame(Object &) override {
+        task_scheduler.resetStats();
+    }
+
+    // While the awake particles are tracked only they are integrated, and the sleeping particles pushed since
+    // the last sub step are put back, otherwise every particle is.
+    void updateObjects(Object &objects, const float delta_time, const V2f world_size) override {
+        PBD_TRACE_ZONE("updateObjects");
+        if (sleeping && isAwakeTracked(objects)) {
+            restoreDisplacedObjects(objects);
+        } else {
+            // ghosts move like the particles they copy
+            const int32_t object_count = objects.size + objects.ghost_count;
+            awake_blocks.clear();
+            for (int32_t begin = 0; begin < object_count; begin += integration_block_size) {
+                awake_blocks.emplace_back(begin, std::min(begin + integration_block_size, object_count));
+            }
+            restored_objects.clear();
+        }
+        displaced_objects.clear();
+        for (std::vector<int32_t> &displaced : thread_displaced) {
+            displaced.clear();
+        }
+        const auto block_count = static_cast<int32_t>(awake_blocks.size());
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            // one zone per thread, ended before the barrier so the trace shows the imbalance
+            PBD_TRACE_ZONE("integrateBlocks");
+            #pragma omp for nowait
+            for (int32_t block = 0; block < block_count; ++block) {
+                const auto [begin, end] = awake_blocks[block];
+                if (!sleeping && isVectorized()) {
+                    integrateAwakeObjectsSimd(objects, begin, end, delta_time, world_size.x, world_size.y);
+                } else if (!sleeping) {
+                    integrateAwakeObjectsScalar(objects, begin, end, delta_time, world_size.x, world_size.y);
+                } else if (isVectorized()) {
+                    integrateObjectsSimd(objects, begin, end, delta_time, world_size.x, world_size.y, sleep_distance2, sleep_steps);
+                } else {
+                    integrateObjectsScalar(objects, begin, end, delta_time, world_size.x, world_size.y, sleep_distance2, sleep_steps);
+                }
+            }
+        }
+    }
+
+    // Colors are solved one after the other, the constraints of a color in parallel blocks, so the result is the
+    // same for every thread count. The last color of particles out of colors is solved by a single thread.
+    void solveConstraints(Object &objects, const DistanceConstraints &constraints, const int32_t iterations) override {
+        PBD_TRACE_ZONE("solveConstraints");
+        constexpr int32_t block_size = 1024;
+        const int32_t color_count = constraints.getColorCount();
+        const int32_t *index_a = constraints.getIndicesA();
+        const int32_t *index_b = constraints.getIndicesB();
+        const float *rest_length = constraints.getRestLengths();
+        const float *stiffness = constraints.getStiffnesses();
+        const auto solve = [&](const int32_t begin, const int32_t end) {
+            if (isVectorized()) {
+                solveDistanceConstraintsSimd(objects, index_a, index_b, rest_length, stiffness, begin, end);
+            } else {
+                solveDistanceConstraintsScalar(objects, index_a, index_b, rest_length, stiffness, begin, end);
+            }
+        };
+        #pragma omp parallel num_threads(getThreadCount()) if(constraints.size() >= 4 * block_size)
+        for (int32_t iteration = 0; iteration < iterations; ++iteration) {
+            for (int32_t color = 0; color < color_count; ++color) {
+                const int32_t color_begin = constraints.getColorStart(color);
+                const int32_t color_end   = constraints.getColorStart(color + 1);
+                if (constraints.isSerialColor(color)) {
+                    #pragma omp single
+                    solve(color_begin, color_end);
+                    continue;
+                }
+                const int32_t block_count = (color_end - color_begin + block_size - 1) / block_size;
+                #pragma omp for schedule(static)
+                for (int32_t block = 0; block < block_count; ++block) {
+                    const int32_t begin = color_begin + block * block_size;
+                    solve(begin, std::min(begin + block_size, color_end));
+                }
+            }
+        }
+        // the sleeping particles moved are put back by the next integration
+        if (sleeping) {
+            const int32_t *still_steps = objects.still_steps.data();
+            for (int32_t i = 0; i < constraints.size(); ++i) {
+                if (still_steps[index_a[i]] >= sleep_steps) displaced_objects.push_back(index_a[i]);
+                if (still_steps[index_b[i]] >= sleep_steps) displaced_objects.push_back(index_b[i]);
+            }
+        }
+    }
+
+    // With neighbour lists the grid is only rebuilt, along with the lists, once they are stale. This runs after
+    // the integration, so lists rebuilt here from the current positions hold every contact of this sub step.
+    // With sleeping the grid is kept while none of the particles that may have moved left its cell.
+    void updateGrids(const Object &objects) override {
+        PBD_TRACE_ZONE("updateGrids");
+        solving_from_lists = false;
+        if (usesNeighbourLists()) {
+            const NeighbourListState state = checkNeighbourLists(objects);
+            if (state == NeighbourListState::Valid) {
+                ++neighbour_stats.sub_steps;
+                solving_from_lists = true;
+                return;
+            }
+            ++neighbour_stats.sub_steps;
+            ++neighbour_stats.rebuilds;
+            solving_from_lists = true;
+        }
+        const bool binned = objects.layout_version == binned_layout_version && objects.ghost_count == 0;
+        if (sleeping && binned && isSparse() && !trackedObjectsLeftCells(sparse_grid_helper, objects)) {
+            return;
+        }
+        if (sleeping && binned && !isSparse() && !trackedObjectsLeftCells(grid_helper, objects)) {
+            return;
+        }
+        if (isSparse()) {
+            sparse_grid_helper.updateGrids(objects, getThreadCount());
+        } else {
+            grid_helper.updateGrids(objects, getThreadCount());
+        }
+        binned_layout_version = objects.layout_version;
+        if (solving_from_lists && isSparse()) {
+            buildNeighbourLists(sparse_grid_helper, objects);
+        } else if (solving_from_lists) {
+            buildNeighbourLists(grid_helper, objects);
+        }
+    }
+
+    // Cells are processed in vertical strips of at least two columns of the coarsest level. A cell only
+    // touches particles of its own and the two adjacent columns of its level or of a coarser level, so
+    // strips of the same parity never share a particle: even strips are solved in parallel first, then
+    // odd strips. Strips are cut so they hold about the same particles, a pile fills few columns with
+    // most of them, and handed to the threads by the TaskScheduler. Each strip is solved serially and the
+    // strips do not depend on the thread count, so the result is the same for every thread count. With
+    // neighbour lists the strips are those cut when the lists were built.
+    void solveCollisions(Object &objects) override {
+        PBD_TRACE_ZONE("solveCollisions");
+        const bool neighbour_lists = solving_from_lists;
+        if (sleeping && isSparse()) {
+            updateActiveCellsSparse(objects);
+        } else if (sleeping) {
+            updateActiveCells(objects);
+        }
+        if (neighbour_lists) {
+            // strips were cut by buildNeighbourLists
+        } else if (isSparse()) {
+            updateStrips(sparse_grid_helper, 2);
+        } else {
+            updateStrips(grid_helper, 2);
+        }
+        const auto strip_count = static_cast<int32_t>(strip_begin.size()) - 1;
+        thread_max_overlap.assign(static_cast<size_t>(getThreadCount()), 0.0f);
+        thread_displaced.resize(getThreadCount());
+        for (int32_t parity = 0; parity < 2; ++parity) {
+            // tasks are the strips of the parity, strip_weight is laid out the same way
+            parity_weights.clear();
+            for (int32_t strip = parity; strip < strip_count; strip += 2) {
+                parity_weights.push_back(strip_weight[strip]);
+            }
+            task_scheduler.run(static_cast<int32_t>(parity_weights.size()), parity_weights.data(), getThreadCount(), [&](const int32_t task, const int32_t thread) {
+                PBD_TRACE_ZONE("solveStrip");
+                const int32_t strip = parity + 2 * task;
+                float overlap = 0.0f;
+                if (neighbour_lists) {
+                    overlap = solveNeighbourList(objects, strip_lists[strip]);
+                } else if (isSparse()) {
+                    overlap = solveCollisionsInColumns(sparse_grid_helper, objects, strip_begin[strip], strip_begin[strip + 1], thread_displaced[thread]);
+                } else {
+                    overlap = solveCollisionsInColumns(grid_helper, objects, strip_begin[strip], strip_begin[strip + 1], thread_displaced[thread]);
+                }
+                thread_max_overlap[thread] = std::max(thread_max_overlap[thread], overlap);
+            });
+        }
+        last_max_overlap = *std::max_element(thread_max_overlap.begin(), thread_max_overlap.end());
+    }
+
+private:
+    enum class NeighbourListState {
+        Valid,
+        Stale, // rebuilt before solving
+    };
+
+    // particles of a strip in solve order, with the neighbours of particle objects[i] at
+    // neighbours[neighbour_start[i], neighbour_start[i + 1])
+    struct NeighbourList {
+        std::vector<int32_t> objects;
+        std::vector<int32_t> neighbour_start;
+        std::vector<int32_t> neighbours;
+    };
+
+    // The candidates gathered around one cell, their positions and radii copied next to each other
+    struct NeighbourCandidates {
+        std::vector<int32_t> objects;
+        std::vector<float> position_x, position_y, radius;
+    };
+
+    struct FlaggedCell {
+        int32_t cell;
+        int32_t level, grid_x, grid_y;
+    };
+
+    // per thread buffers of updateActiveCells
+    struct SleepScratch {
+        std::vector<FlaggedCell> cells;
+        std::vector<int32_t> woken;
+        std::vector<int32_t> objects;
+    };
+
+    [[nodiscard]]
+    int32_t getThreadCount() const {
+        return type == BackendType::Scalar ? 1 : cpu_threads;
+    }
+
+    [[nodiscard]]
+    bool isVectorized() const {
+        return type == BackendType::SIMD;
+    }
+
+    [[nodiscard]]
+    bool isSparse() const {
+        return grid_type == GridType::Sparse;
+    }
+
+    // active cells need the grid of every sub step, so sleeping turns the neighbour lists off
+    [[nodiscard]]
+    bool usesNeighbourLists() const {
+        return neighbour_skin > 0.0f && !sleeping;
+    }
+
+    [[nodiscard]]
+    bool isAwakeTracked(const Object &objects) const {
+        return awake_tracked && objects.layout_version == tracked_layout_version && objects.ghost_count == 0;
+    }
+
+    // Calls function, inside a parallel region, on every particle that may have moved since the last sub step:
+    // those integrated, those put back and the sleeping ones moved by the constraints.
+    template<typename Function>
+    void forEachTrackedObject(Function &&function) const {
+        const auto block_count = static_cast<int32_t>(awake_blocks.size());
+        #pragma omp for schedule(static) nowait
+        for (int32_t block = 0; block < block_count; ++block) {
+            for (int32_t idx = awake_blocks[block].first; idx < awake_blocks[block].second; ++idx) {
+                function(idx);
+            }
+        }
+        const auto restored_count = static_cast<int32_t>(restored_objects.size());
+        #pragma omp for schedule(static) nowait
+        for (int32_t i = 0; i < restored_count; ++i) {
+            function(restored_objects[i]);
+        }
+        const auto displaced_count = static_cast<int32_t>(displaced_objects.size());
+        #pragma omp for schedule(static)
+        for (int32_t i = 0; i < displaced_count; ++i) {
+            function(displaced_objects[i]);
+        }
+    }
+
+    template<typename Grid>
+    bool trackedObjectsLeftCells(const Grid &grid, const Object &objects) const {
+        bool left = false;
+        #pragma omp parallel num_threads(getThreadCount()) reduction(||: left)
+        forEachTrackedObject([&](const int32_t idx) {
+            left = left || grid.leftCell(objects, idx);
+        });
+        return left;
+    }
+
+    // The sleeping particles pushed by the last constraints and collisions go back to where they fell asleep,
+    // as integrateObjectsScalar does for every sleeping particle
+    void restoreDisplacedObjects(Object &objects) {
+        restored_objects.assign(displaced_objects.begin(), displaced_objects.end());
+        for (const std::vector<int32_t> &displaced : thread_displaced) {
+            restored_objects.insert(restored_objects.end(), displaced.begin(), displaced.end());
+        }
+        for (const int32_t idx : restored_objects) {
+            if (objects.still_steps[idx] >= sleep_steps) {
+                objects.position_x[idx] = objects.last_position_x[idx];
+                objects.position_y[idx] = objects.last_position_y[idx];
+            }
+        }
+    }
+
+    // sets flag on cell, returns the flags the cell had
+    static uint8_t setCellFlag(std::vector<uint8_t> &flags, const int32_t cell, const uint8_t flag) {
+        uint8_t previous;
+        #pragma omp atomic capture
+        { previous = flags[cell]; flags[cell] |= flag; }
+        return previous;
+    }
+
+    // clears the cells the last updateActiveCells flagged, or every cell once their count changed
+    void clearCellFlags(const int32_t grids_count) {
+        if (static_cast<int32_t>(cell_moving.size()) != grids_count) {
+            cell_moving.assign(grids_count, 0);
+            cell_near_moving.assign(grids_count, 0);
+            cell_active.assign(grids_count, 0);
+        } else {
+            for (const FlaggedCell &flagged : moving_cells) cell_moving[flagged.cell] = 0;
+            for (const FlaggedCell &flagged : near_cells)   cell_near_moving[flagged.cell] = 0;
+            for (const int32_t cell : active_cells)         cell_active[cell] = 0;
+        }
+        moving_cells.clear();
+        near_cells.clear();
+        coarse_cells.clear();
+        active_cells.clear();
+        sleep_scratch.resize(getThreadCount());
+    }
+
+    // appends the cells each thread flagged to flagged
+    void collectFlaggedCells(std::vector<FlaggedCell> &flagged) {
+        for (SleepScratch &scratch : sleep_scratch) {
+            flagged.insert(flagged.end(), scratch.cells.begin(), scratch.cells.end());
+            scratch.cells.clear();
+        }
+    }
+
+    void collectSleeping(const Object &objects, const int32_t *cell_objects, const int32_t count, std::vector<int32_t> &woken) const {
+        for (int32_t i = 0; i < count; ++i) {
+            if (objects.still_steps[cell_objects[i]] >= sleep_steps) woken.push_back(cell_objects[i]);
+        }
+    }
+
+    // A cell is active when it holds an awake particle, only active cells are solved. Sleeping particles act
+    // as fixed obstacles: awake particles still collide with them and their pushes are undone by the next
+    // integration. A particle moving fast enough during the last integration wakes the sleeping particles of
+    // the 3x3 cells around it, at its level for finer and equal particles and at their level for coarser ones.
+    // An awake particle of a coarse level also wakes the finer sleeping particles around it: their contacts
+    // are solved from the finer particle's cell, which has to be active. Only the particles that may have
+    // moved are checked, and only the cells around the moving ones are dilated and searched for particles
+    // to wake.
+    void updateActiveCells(Object &objects) {
+        PBD_TRACE_ZONE("updateActiveCells");
+        constexpr uint8_t moving_flag = 1, coarse_awake_flag = 2;
+        const GridHelper &grid = grid_helper;
+        const int32_t level_count = grid.getLevelCount();
+        const int32_t top_level = level_count - 1;
+        const int32_t *still_steps = objects.still_steps.data();
+        const float *position_x      = objects.position_x.data();
+        const float *position_y      = objects.position_y.data();
+        const float *last_position_x = objects.last_position_x.data();
+        const float *last_position_y = objects.last_position_y.data();
+        const float *radius          = objects.radius.data();
+        // moving half the sleep distance in one sub step wakes the neighbourhood
+        const float wake_distance2 = sleep_distance2 * 0.25f;
+        clearCellFlags(grid.getGridsCount());
+
+        // the flags are only ever set, so concurrent writes to the same cell agree
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            std::vector<FlaggedCell> &flagged = sleep_scratch[omp_get_thread_num()].cells;
+            const auto flag = [&](const int32_t level, const int32_t idx, const uint8_t cell_flag) {
+                const int32_t grid_x = grid.getGridX(level, position_x[idx]);
+                const int32_t grid_y = grid.getGridY(level, position_y[idx]);
+                const int32_t cell = grid.getLevel(level).first_cell + grid_x * grid.getLevel(level).height + grid_y;
+                if (setCellFlag(cell_moving, cell, cell_flag) == 0) flagged.push_back({cell, level, grid_x, grid_y});
+            };
+            forEachTrackedObject([&](const int32_t idx) {
+                const float movement_x = position_x[idx] - last_position_x[idx];
+                const float movement_y = position_y[idx] - last_position_y[idx];
+                const int32_t object_level = std::min(getGridLevelForRadius(radius[idx]), top_level);
+                if (movement_x * movement_x + movement_y * movement_y > wake_distance2) {
+                    for (int32_t level = object_level; level < level_count; ++level) {
+                        flag(level, idx, moving_flag);
+                    }
+                } else if (top_level > 0 && still_steps[idx] < sleep_steps && 2.0f * radius[idx] > 1.0f) {
+                    flag(object_level, idx, coarse_awake_flag);
+                }
+            });
+        }
+        collectFlaggedCells(moving_cells);
+
+        // 3x3 dilation of the flagged cells
+        const auto moving_count = static_cast<int32_t>(moving_cells.size());
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            std::vector<FlaggedCell> &flagged = sleep_scratch[omp_get_thread_num()].cells;
+            #pragma omp for schedule(static)
+            for (int32_t i = 0; i < moving_count; ++i) {
+                const FlaggedCell &moving = moving_cells[i];
+                const GridLevel &grid_level = grid.getLevel(moving.level);
+                const uint8_t flags = cell_moving[moving.cell];
+                for (int32_t grid_x = std::max(moving.grid_x - 1, 0); grid_x <= std::min(moving.grid_x + 1, grid_level.width - 1); ++grid_x) {
+                    for (int32_t grid_y = std::max(moving.grid_y - 1, 0); grid_y <= std::min(moving.grid_y + 1, grid_level.height - 1); ++grid_y) {
+                        const int32_t cell = grid_level.first_cell + grid_x * grid_level.height + grid_y;
+                        if (setCellFlag(cell_near_moving, cell, flags) == 0) flagged.push_back({cell, moving.level, grid_x, grid_y});
+                    }
+                }
+            }
+        }
+        collectFlaggedCells(near_cells);
+
+        // the sleeping particles of a cell near a moving one of its level, or inside a flagged cell of a coarser level
+        const auto near_count = static_cast<int32_t>(near_cells.size());
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            SleepScratch &scratch = sleep_scratch[omp_get_thread_num()];
+            scratch.woken.clear();
+            #pragma omp for schedule(dynamic, 64)
+            for (int32_t i = 0; i < near_count; ++i) {
+                const FlaggedCell &near = near_cells[i];
+                if (cell_near_moving[near.cell] & moving_flag) {
+                    collectSleeping(objects, grid.getCellObjects(near.cell), grid.getCellCount(near.cell), scratch.woken);
+                }
+                for (int32_t level = 0; level < near.level; ++level) {
+                    const int32_t shift = near.level - level;
+                    scratch.objects.clear();
+                    grid.gatherCells(level, near.grid_x << shift, near.grid_y << shift, ((near.grid_x + 1) << shift) - 1, ((near.grid_y + 1) << shift) - 1, scratch.objects);
+                    collectSleeping(objects, scratch.objects.data(), static_cast<int32_t>(scratch.objects.size()), scratch.woken);
+                }
+            }
+        }
+        updateAwakeObjects(grid, objects);
+    }
+
+    // Same rules on the occupied cells of the sparse grid, without a dilation over the world. A moving particle
+    // flags the occupied cells among the 3x3 cells around it at its level and every coarser level. A sleeping
+    // particle wakes when its cell is flagged or when an awake particle of a coarser level is in the 3x3 cells
+    // around it at that level.
+    void updateActiveCellsSparse(Object &objects) {
+        PBD_TRACE_ZONE("updateActiveCellsSparse");
+        constexpr uint8_t near_moving_flag = 1, coarse_awake_flag = 2;
+        const SparseGridHelper &grid = sparse_grid_helper;
+        const int32_t level_count = grid.getLevelCount();
+        const int32_t top_level = level_count - 1;
+        const int32_t *still_steps = objects.still_steps.data();
+        const float *position_x      = objects.position_x.data();
+        const float *position_y      = objects.position_y.data();
+        const float *last_position_x = objects.last_position_x.data();
+        const float *last_position_y = objects.last_position_y.data();
+        const float *radius          = objects.radius.data();
+        const float wake_distance2 = sleep_distance2 * 0.25f;
+        clearCellFlags(grid.getGridsCount());
+
+        // the coarse awake cells go to the woken list of the scratch first, as indices into coarse_cells
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            SleepScratch &scratch = sleep_scratch[omp_get_thread_num()];
+            scratch.objects.clear();
+            std::vector<FlaggedCell> coarse;
+            forEachTrackedObject([&](const int32_t idx) {
+                const int32_t object_level = std::min(getGridLevelForRadius(radius[idx]), top_level);
+                const float movement_x = position_x[idx] - last_position_x[idx];
+                const float movement_y = position_y[idx] - last_position_y[idx];
+                const bool moving = movement_x * movement_x + movement_y * movement_y > wake_distance2;
+                if (moving) {
+                    for (int32_t level = object_level; level < level_count; ++level) {
+                        const int32_t grid_x = grid.getGridX(level, position_x[idx]);
+                        const int32_t grid_y = grid.getGridY(level, position_y[idx]);
+                        for (int32_t neighbour_x = std::max(grid_x - 1, 0); neighbour_x <= std::min(grid_x + 1, grid.getLevel(level).width - 1); ++neighbour_x) {
+                            const auto [first, last] = grid.findCells(level, neighbour_x, grid_y - 1, grid_y + 1);
+                            for (int32_t cell = first; cell < last; ++cell) {
+                                if (setCellFlag(cell_moving, cell, near_moving_flag) == 0) {
+                                    scratch.cells.push_back({cell, level, neighbour_x, grid.getCellRow(level, cell)});
+                                }
+                            }
+                        }
+                    }
+                }
+                if (object_level > 0 && (moving || still_steps[idx] < sleep_steps)) {
+                    const int32_t cell = grid.getObjectCell(idx);
+                    const uint8_t previous = setCellFlag(cell_moving, cell, coarse_awake_flag);
+                    const FlaggedCell flagged = {cell, object_level, grid.getGridX(object_level, position_x[idx]), grid.getGridY(object_level, position_y[idx])};
+                    if (previous == 0) scratch.cells.push_back(flagged);
+                    if ((previous & coarse_awake_flag) == 0) coarse.push_back(flagged);
+                }
+            });
+            #pragma omp critical
+            coarse_cells.insert(coarse_cells.end(), coarse.begin(), coarse.end());
+        }
+        collectFlaggedCells(moving_cells);
+
+        // the sleeping particles of a cell near a moving particle, or within the 3x3 cells of a coarse awake one
+        const auto moving_count = static_cast<int32_t>(moving_cells.size());
+        const auto coarse_count = static_cast<int32_t>(coarse_cells.size());
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            SleepScratch &scratch = sleep_scratch[omp_get_thread_num()];
+            scratch.woken.clear();
+            #pragma omp for schedule(dynamic, 64) nowait
+            for (int32_t i = 0; i < moving_count; ++i) {
+                const int32_t cell = moving_cells[i].cell;
+                if (cell_moving[cell] & near_moving_flag) {
+                    collectSleeping(objects, grid.getCellObjects(cell), grid.getCellCount(cell), scratch.woken);
+                }
+            }
+            #pragma omp for schedule(dynamic, 16)
+            for (int32_t i = 0; i < coarse_count; ++i) {
+                const FlaggedCell &coarse = coarse_cells[i];
+                for (int32_t level = 0; level < coarse.level; ++level) {
+                    const int32_t shift = coarse.level - level;
+                    scratch.objects.clear();
+                    grid.gatherCells(level, (coarse.grid_x - 1) << shift, (coarse.grid_y - 1) << shift, ((coarse.grid_x + 2) << shift) - 1, ((coarse.grid_y + 2) << shift) - 1, scratch.objects);
+                    collectSleeping(objects, scratch.objects.data(), static_cast<int32_t>(scratch.objects.size()), scratch.woken);
+                }
+            }
+        }
+        updateAwakeObjects(grid, objects);
+    }
+
+    // The awake particles are the integrated ones still awake and the sleeping ones the threads found to wake.
+    // Their cells are the active cells, and runs of consecutive indices are integrated by the next sub step.
+    template<typename Grid>
+    void updateAwakeObjects(const Grid &grid, Object &objects) {
+        int32_t *still_steps = objects.still_steps.data();
+        woken_objects.clear();
+        for (SleepScratch &scratch : sleep_scratch) {
+            woken_objects.insert(woken_objects.end(), scratch.woken.begin(), scratch.woken.end());
+        }
+        std::sort(woken_objects.begin(), woken_objects.end());
+        woken_objects.erase(std::unique(woken_objects.begin(), woken_objects.end()), woken_objects.end());
+        for (const int32_t idx : woken_objects) {
+            still_steps[idx] = 0;
+        }
+
+        // the blocks are sorted and hold no sleeping particle the threads found
+        std::vector<int32_t> &awake = still_awake_objects;
+        awake.clear();
+        for (const auto &[begin, end] : awake_blocks) {
+            for (int32_t idx = begin; idx < end; ++idx) {
+                if (still_steps[idx] < sleep_steps && !std::binary_search(woken_objects.begin(), woken_objects.end(), idx)) awake.push_back(idx);
+            }
+        }
+        awake_objects.resize(awake.size() + woken_objects.size());
+        std::merge(awake.begin(), awake.end(), woken_objects.begin(), woken_objects.end(), awake_objects.begin());
+
+        const auto awake_count = static_cast<int32_t>(awake_objects.size());
+        #pragma omp parallel num_threads(getThreadCount())
+        {
+            std::vector<FlaggedCell> &flagged = sleep_scratch[omp_get_thread_num()].cells;
+            #pragma omp for schedule(static)
+            for (int32_t i = 0; i < awake_count; ++i) {
+                const int32_t cell = grid.getObjectCell(awake_objects[i]);
+                if (setCellFlag(cell_active, cell, 1) == 0) flagged.push_back({cell, 0, 0, 0});
+            }
+        }
+        for (SleepScratch &scratch : sleep_scratch) {
+            for (const FlaggedCell &flagged : scratch.cells) {
+                active_cells.push_back(flagged.cell);
+            }
+            scratch.cells.clear();
+        }
+
+        awake_blocks.clear();
+        for (int32_t i = 0; i < awake_count;) {
+            const int32_t begin = awake_objects[i];
+            int32_t end = begin + 1;
+            for (++i; i < awake_count && awake_objects[i] == end && end - begin < integration_block_size; ++i) {
+                ++end;
+            }
+            awake_blocks.emplace_back(begin, end);
+        }
+        awake_tracked = true;
+        tracked_layout_version = objects.layout_version;
+        sleep_stats.active_objects = awake_count;
+        sleep_stats.active_cells   = static_cast<int32_t>(active_cells.size());
+    }
+
+    // Cuts the columns of the coarsest level into strips of equal weight and at least min_width columns, a
+    // column weighing its particles at every level plus one so empty columns are spread too. Both grids count
+    // the same particles, so they cut the same strips.
+    template<typename Grid>
+    void updateStrips(const Grid &grid, const int32_t min_width) {
+        constexpr int64_t object_weight = 16;
+        const int32_t level_count = grid.getLevelCount();
+        const int32_t columns = grid.getLevel(level_count - 1).width;
+        column_weight.resize(static_cast<size_t>(columns) + 1);
+        #pragma omp parallel for num_threads(getThreadCount()) schedule(static)
+        for (int32_t column = 0; column < columns; ++column) {
+            int64_t weight = 1;
+            for (int32_t level = 0; level < level_count; ++level) {
+                const int32_t scale = 1 << (level_count - 1 - level);
+                const int32_t level_column_end = std::min((column + 1) * scale, grid.getLevel(level).width);
+                for (int32_t grid_x = column * scale; grid_x < level_column_end; ++grid_x) {
+                    weight += object_weight * grid.getColumnObjectCount(level, grid_x);
+                }
+            }
+            column_weight[column + 1] = weight;
+        }
+        // prefix sums, column_weight[c] is the weight of columns [0, c)
+        column_weight[0] = 0;
+        for (int32_t column = 0; column < columns; ++column) {
+            column_weight[column + 1] += column_weight[column];
+        }
+
+        const int32_t strip_count = std::max(1, std::min(max_strip_count, columns / min_width));
+        const int64_t total_weight = column_weight[columns];
+        strip_begin.resize(static_cast<size_t>(strip_count) + 1);
+        strip_weight.resize(strip_count);
+        strip_begin[0] = 0;
+        for (int32_t strip = 1; strip < strip_count; ++strip) {
+            const int64_t target = total_weight * strip / strip_count;
+            const auto column = static_cast<int32_t>(std::lower_bound(column_weight.begin(), column_weight.end(), target) - column_weight.begin());
+            // at least min_width columns for this strip and every one after it
+            strip_begin[strip] = std::clamp(column, strip_begin[strip - 1] + min_width, columns - min_width * (strip_count - strip));
+        }
+        strip_begin[strip_count] = columns;
+        for (int32_t strip = 0; strip < strip_count; ++strip) {
+            strip_weight[strip] = column_weight[strip_begin[strip + 1]] - column_weight[strip_begin[strip]];
+        }
+    }
+
+    // Stale when the particles were created, removed or reordered since the lists were built, or when one of
+    // them moved more than half the skin since: two particles closing in then may have met without being listed.
+    // Ghosts are replaced before every sub step, lists holding them are always stale.
+    [[nodiscard]]
+    NeighbourListState checkNeighbourLists(const Object &objects) const {
+        const float max_distance2 = 0.25f * neighbour_skin * neighbour_skin;
+        const bool built = neighbour_lists_valid && objects.layout_version == built_layout_version && objects.ghost_count == 0;
+        if (!built) return NeighbourListState::Stale;
+        const float *position_x = objects.position_x.data();
+        const float *position_y = objects.position_y.data();
+        int32_t stale = 0;
+        #pragma omp parallel for num_threads(getThreadCount()) schedule(static) reduction(max: stale)
+        for (int32_t idx = 0; idx < objects.size; ++idx) {
+            const float delta_x = position_x[idx] - built_position_x[idx];
+            const float delta_y = position_y[idx] - built_position_y[idx];
+            if (delta_x * delta_x + delta_y * delta_y > max_distance2) stale = 1;
+        }
+        return stale != 0 ? NeighbourListState::Stale : NeighbourListState::Valid;
+    }
+
+    // Lists for each particle the neighbours solveCollisionsInColumns would check whose distance is below their
+    // radii plus the skin. The candidates are gathered once per cell, from the cells of each level within that
+    // distance of the bounds of the cell's particles, the particles of a level being at most its cell size
+    // across; each particle of the cell then keeps those close enough, in the order a gather around the
+    // particle alone would give. A listed pair is at most reach columns of the coarsest level apart, so strips
+    // of 2 * reach columns keep the strips of a parity independent. Each strip keeps its particles in the order
+    // solveCollisionsInColumns solves them.
+    template<typename Grid>
+    void buildNeighbourLists(const Grid &grid, const Object &objects) {
+        PBD_TRACE_ZONE("buildNeighbourLists");
+        const int32_t level_count = grid.getLevelCount();
+        const int32_t reach = 1 + static_cast<int32_t>(std::ceil(neighbour_skin / grid.getLevel(level_count - 1).cell_size));
+        updateStrips(grid, 2 * reach);
+        const auto strip_count = static_cast<int32_t>(strip_begin.size()) - 1;
+        strip_lists.resize(strip_count);
+        const float skin = neighbour_skin;
+        const float *position_x = objects.position_x.data();
+        const float *position_y = objects.position_y.data();
+        const float *radius     = objects.radius.data();
+        const bool vectorized = isVectorized();
+        thread_candidates.resize(getThreadCount());
+        int64_t listed_pairs = 0;
+        #pragma omp parallel for num_threads(getThreadCount()) schedule(dynamic) reduction(+: listed_pairs)
+        for (int32_t strip = 0; strip < strip_count; ++strip) {
+            NeighbourList &list = strip_lists[strip];
+            list.objects.clear();
+            list.neighbour_start.assign(1, 0);
+            list.neighbours.clear();
+            NeighbourCandidates &candidates = thread_candidates[omp_get_thread_num()];
+            for (int32_t level = 0; level < level_count; ++level) {
+                const GridLevel &grid_level = grid.getLevel(level);
+                const int32_t scale = 1 << (level_count - 1 - level);
+                const int32_t level_column_end = std::min(strip_begin[strip + 1] * scale, grid_level.width);
+                for (int32_t grid_x = strip_begin[strip] * scale; grid_x < level_column_end; ++grid_x) {
+                    const auto [first_cell, last_cell] = grid.getColumnCells(level, grid_x);
+                    for (int32_t idx = first_cell; idx < last_cell; ++idx) {
+                        const int32_t object_count = grid.getCellCount(idx);
+                        const int32_t *cell_objects = grid.getCellObjects(idx);
+                        if (object_count == 0) continue;
+                        float min_x = position_x[cell_objects[0]], max_x = min_x;
+                        float min_y = position_y[cell_objects[0]], max_y = min_y;
+                        float max_radius = 0.0f;
+                        for (int32_t i = 0; i < object_count; ++i) {
+                            const int32_t object = cell_objects[i];
+                            min_x = std::min(min_x, position_x[object]);
+                            max_x = std::max(max_x, position_x[object]);
+                            min_y = std::min(min_y, position_y[object]);
+                            max_y = std::max(max_y, position_y[object]);
+                            max_radius = std::max(max_radius, radius[object]);
+                        }
+                        candidates.objects.clear();
+                        for (int32_t candidate_level = level; candidate_level < level_count; ++candidate_level) {
+                            const GridLevel &candidate_grid = grid.getLevel(candidate_level);
+                            const float half_size = max_radius + 0.5f * candidate_grid.cell_size + skin;
+                            grid.gatherCells(candidate_level,
+                                             static_cast<int32_t>(floorf((min_x - half_size) * candidate_grid.inverse_cell_size)),
+                                             static_cast<int32_t>(floorf((min_y - half_size) * candidate_grid.inverse_cell_size)),
+                                             static_cast<int32_t>(floorf((max_x + half_size) * candidate_grid.inverse_cell_size)),
+                                             static_cast<int32_t>(floorf((max_y + half_size) * candidate_grid.inverse_cell_size)),
+                                             candidates.objects);
+                        }
+                        const auto candidate_count = static_cast<int32_t>(candidates.objects.size());
+                        candidates.position_x.resize(candidate_count);
+                        candidates.position_y.resize(candidate_count);
+                        candidates.radius.resize(candidate_count);
+                        for (int32_t c = 0; c < candidate_count; ++c) {
+                            const int32_t candidate = candidates.objects[c];
+                            candidates.position_x[c] = position_x[candidate];
+                            candidates.position_y[c] = position_y[candidate];
+                            candidates.radius[c]     = radius[candidate];
+                        }
+                        for (int32_t i = 0; i < object_count; ++i) {
+                            const int32_t object = cell_objects[i];
+                            const size_t first_neighbour = list.neighbours.size();
+                            list.neighbours.resize(first_neighbour + candidate_count);
+                            const int32_t neighbour_count = vectorized
+                                ? selectNeighboursSimd(object, position_x[object], position_y[object], radius[object], skin, candidates.objects.data(),
+                                                       candidates.position_x.data(), candidates.position_y.data(), candidates.radius.data(),
+                                                       candidate_count, list.neighbours.data() + first_neighbour)
+                                : selectNeighboursScalar(object, position_x[object], position_y[object], radius[object], skin, candidates.objects.data(),
+                                                         candidates.position_x.data(), candidates.position_y.data(), candidates.radius.data(),
+                                                         candidate_count, list.neighbours.data() + first_neighbour);
+                            list.neighbours.resize(first_neighbour + neighbour_count);
+                            list.objects.push_back(object);
+                            list.neighbour_start.push_back(static_cast<int32_t>(list.neighbours.size()));
+                        }
+                    }
+                }
+            }
+            listed_pairs += static_cast<int64_t>(list.neighbours.size());
+        }
+        built_position_x.assign(objects.position_x.begin(), objects.position_x.begin() + objects.size);
+        built_position_y.assign(objects.position_y.begin(), objects.position_y.begin() + objects.size);
+        built_layout_version = objects.layout_version;
+        neighbour_lists_valid = true;
+        neighbour_stats.listed_pairs = listed_pairs;
+    }
+
+    // Returns the deepest overlap met
+    float solveNeighbourList(Object &objects, const NeighbourList &list) const {
+        const bool vectorized = isVectorized();
+        float max_overlap = 0.0f;
+        const auto object_count = static_cast<int32_t>(list.objects.size());
+        for (int32_t i = 0; i < object_count; ++i) {
+            const int32_t *neighbours = list.neighbours.data() + list.neighbour_start[i];
+            const int32_t neighbours_count = list.neighbour_start[i + 1] - list.neighbour_start[i];
+            const float overlap = vectorized
+                ? solveContactBatchSimd(objects, list.objects[i], neighbours, neighbours_count)
+                : solveContactBatchScalar(objects, list.objects[i], neighbours, neighbours_count);
+            max_overlap = std::max(max_overlap, overlap);
+        }
+        return max_overlap;
+    }
+
+    // Every particle of a cell is checked in one batch against the particles of the 3x3 cells around it at its
+    // own level and at every coarser level. Contacts between two levels are only solved from the finer side.
+    // Columns are columns of the coarsest level. Grid is GridHelper or SparseGridHelper. With sleeping, the
+    // sleeping particles checked are appended to displaced. Returns the deepest overlap met.
+    template<typename Grid>
+    float solveCollisionsInColumns(const Grid &grid, Object &objects, const int32_t column_begin, const int32_t column_end, std::vector<int32_t> &displaced) const {
+        const int32_t level_count = grid.getLevelCount();
+        const bool vectorized = isVectorized();
+        std::vector<int32_t> neighbours;
+        float max_overlap = 0.0f;
+        for (int32_t level = 0; level < level_count; ++level) {
+            const GridLevel &grid_level = grid.getLevel(level);
+            const int32_t scale = 1 << (level_count - 1 - level);
+            const int32_t level_column_end = std::min(column_end * scale, grid_level.width);
+            for (int32_t grid_x = column_begin * scale; grid_x < level_column_end; ++grid_x) {
+                const auto [first_cell, last_cell] = grid.getColumnCells(level, grid_x);
+                for (int32_t idx = first_cell; idx < last_cell; ++idx) {
+                    const int32_t object_count = grid.getCellCount(idx);
+                    if (object_count <= 0 || (sleeping && !cell_active[idx])) continue;
+
+                    const int32_t grid_y = grid.getCellRow(level, idx);
+                    neighbours.clear();
+                    grid.gatherNeighbours(level, grid_x, grid_y, neighbours);
+                    for (int32_t coarse_level = level + 1; coarse_level < level_count; ++coarse_level) {
+                        const int32_t shift = coarse_level - level;
+                        grid.gatherNeighbours(coarse_level, grid_x >> shift, grid_y >> shift, neighbours);
+                    }
+
+                    const int32_t *cell_objects = grid.getCellObjects(idx);
+                    const auto neighbours_count = static_cast<int32_t>(neighbours.size());
+                    for (int32_t i = 0; i < object_count; ++i) {
+                        const float overlap = vectorized
+                            ? solveContactBatchSimd(objects, cell_objects[i], neighbours.data(), neighbours_count)
+                            : solveContactBatchScalar(objects, cell_objects[i], neighbours.data(), neighbours_count);
+                        max_overlap = std::max(max_overlap, overlap);
+                    }
+                    if (sleeping) {
+                        for (const int32_t neighbour : neighbours) {
+                            if (objects.still_steps[neighbour] >= sleep_steps) displaced.push_back(neighbour);
+                        }
+                    }
+                }
+            }
+        }
+        return max_overlap;
+    }
+
+    BackendType type;
+    GridType grid_type;
+    GridHelper grid_helper;
+    SparseGridHelper sparse_grid_helper;
+    bool sleeping = false;
+    float sleep_distance2 = -1.0f;
+    int32_t sleep_steps = SLEEP_STEPS;
+    static constexpr int32_t integration_block_size = 1024;
+    // the awake particles are tracked from one sub step to the next while the layout stays the same
+    bool awake_tracked = false;
+    uint64_t tracked_layout_version = 0;
+    std::vector<int32_t> awake_objects;                    // sorted
+    std::vector<std::pair<int32_t, int32_t>> awake_blocks; // particles [begin, end) integrated by updateObjects
+    std::vector<int32_t> displaced_objects;                // sleeping particles moved by the constraints
+    std::vector<std::vector<int32_t>> thread_displaced;    // sleeping particles checked by the collisions, per thread
+    std::vector<int32_t> restored_objects;                 // the displaced particles put back by updateObjects
+    std::vector<int32_t> still_awake_objects, woken_objects;
+    uint64_t binned_layout_version = ~uint64_t{0};
+    std::vector<uint8_t> cell_moving;
+    std::vector<uint8_t> cell_near_moving;
+    std::vector<uint8_t> cell_active;
+    // the cells set in the flags above, cleared by the next updateActiveCells
+    std::vector<FlaggedCell> moving_cells, near_cells, coarse_cells;
+    std::vector<int32_t> active_cells;
+    std::vector<SleepScratch> sleep_scratch;
+    SleepStats sleep_stats;
+    float last_max_overlap = 0.0f;
+    // enough strips per parity for 16 threads to steal from each other
+    static constexpr int32_t max_strip_count = 128;
+    TaskScheduler task_scheduler;
+    std::vector<int64_t> column_weight;
+    std::vector<int32_t> strip_begin;
+    std::vector<int64_t> strip_weight;
+    std::vector<int64_t> parity_weights;
+    std::vector<float> thread_max_overlap;
+
+    float neighbour_skin = 0.0f;
+    bool neighbour_lists_valid = false;
+    bool solving_from_lists = false; // decided by updateGrids for the next solveCollisions
+    uint64_t built_layout_version = 0;
+    std::vector<float> built_position_x, built_position_y; // positions when the lists were built
+    std::vector<NeighbourCandidates> thread_candidates; // per thread, kept between rebuilds
+    std::vector<NeighbourList> strip_lists;
+    NeighbourListStats neighbour_stats;
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef DOMAIN_DECOMPOSITION_HPP
+#define DOMAIN_DECOMPOSITION_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "domain_transport.hpp"
+#include "object.hpp"
+#include "physics_handler.hpp"
+#include "tracing.hpp"
+#include "utils.hpp"
+
+struct DomainSettings {
+    int32_t sub_steps = 8;
+    float halo_width = 0.0f;      // 0 for one cell of the coarsest grid level
+    int32_t reorder_interval = 0; // frames between Morton reorderings of the rank's particles, 0 for never
+};
+
+// totals since the DomainHandler was created
+struct DomainStats {
+    int64_t sent_ghosts = 0;
+    int64_t received_ghosts = 0;
+    int64_t migrated_out = 0;
+    int64_t migrated_in = 0;
+    float last_exchange_time = 0.0f; // of the last update, in microseconds
+};
+
+// One rank of a world split into vertical slabs of whole grid columns, rank r owning the columns from
+// width * r / ranks to width * (r + 1) / ranks, so a slab is a contiguous range of the column major cell order.
+// Each rank simulates its own particles with a PhysicsHandler over the whole world, whose walls stay the world
+// walls. Before every sub step the particles that left the slab migrate to the neighbouring rank, then each
+// rank sends copies of its particles within the halo width of a shared border, the ghosts. The ghosts received
+// overwrite the previous ones after the rank's own particles, see PhysicsHandler::addGhosts, so they take no
+// handle and leave the layout version alone; a ghost takes part in the sub step like any particle while its
+// owner applies the same contacts from its side. The solve order differs from a single PhysicsHandler, so
+// results are close but not identical. Host backends only, the sub steps are driven from here and sleeping
+// particles would not match their ghosts. Pinning each rank to a NUMA node is left to numactl or taskset.
+class DomainHandler {
+public:
+    DomainHandler(PhysicsHandler &_physics_handler, DomainTransport &_transport, const DomainSettings &_settings = {})
+        : physics_handler(_physics_handler)
+        , transport(_transport)
+        , settings(_settings)
+    {
+        const auto world_width = static_cast<int32_t>(physics_handler.getWorldSize().x);
+        const int32_t rank = transport.getRank();
+        const int32_t rank_count = transport.getRankCount();
+        slab_min = static_cast<float>(static_cast<int64_t>(world_width) * rank / rank_count);
+        slab_max = static_cast<float>(static_cast<int64_t>(world_width) * (rank + 1) / rank_count);
+        if (rank == rank_count - 1) {
+            slab_max = physics_handler.getWorldSize().x;
+        }
+        settings.sub_steps = std::max(1, settings.sub_steps);
+        settings.reorder_interval = std::max(0, settings.reorder_interval);
+        // PhysicsHandler::update runs once per sub step here, so the reordering is counted in frames below
+        physics_handler.setSubSteps(1);
+        physics_handler.setAdaptiveSubSteps(false);
+        physics_handler.setReorderInterval(0);
+    }
+
+    [[nodiscard]]
+    float getSlabMin() const {
+        return slab_min;
+    }
+
+    [[nodiscard]]
+    float getSlabMax() const {
+        return slab_max;
+    }
+
+    // creates the particles of the batch inside the slab, every rank is given the same batches
+    int32_t createObjects(const ObjectBatch &batch) {
+        selected.clear();
+        for (int32_t i = 0; i < batch.size(); ++i) {
+            if (getDestination(batch.position_x[i]) == transport.getRank()) selected.push_back(i);
+        }
+        if (static_cast<int32_t>(selected.size()) == batch.size()) {
+            return physics_handler.createObjects(batch);
+        }
+        const auto count = static_cast<int32_t>(selected.size());
+        slab_batch.resize(count);
+        for (int32_t i = 0; i < count; ++i) {
+            const int32_t source = selected[i];
+            slab_batch.position_x[i] = batch.position_x[source];
+            slab_batch.position_y[i] = batch.position_y[source];
+            slab_batch.velocity_x[i] = batch.velocity_x[source];
+            slab_batch.velocity_y[i] = batch.velocity_y[source];
+            slab_batch.radius[i]     = batch.radius[source];
+            slab_batch.color[i]      = batch.color[source];
+        }
+        return physics_handler.createObjects(slab_batch);
+    }
+
+    // the sub steps of one frame, every rank must call it; false when the transport failed
+    bool update(const float delta_time) {
+        PBD_TRACE_ZONE("domainUpdate");
+        const float sub_delta_time = delta_time / static_cast<float>(settings.sub_steps);
+        sub_step_timings.clear();
+        stats.last_exchange_time = 0.0f;
+        if (settings.reorder_interval > 0 && ++frames_since_reorder >= settings.reorder_interval) {
+            frames_since_reorder = 0;
+            physics_handler.reorderObjects();
+        }
+        for (int32_t step = 0; step < settings.sub_steps; ++step) {
+            const auto exchange_start = std::chrono::high_resolution_clock::now();
+            if (!migrateObjects() || !exchangeGhosts()) return false;
+            stats.last_exchange_time += std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - exchange_start).count();
+            physics_handler.update(sub_delta_time);
+            const std::vector<SubStepTimings> &timings = physics_handler.getSubStepTimings();
+            sub_step_timings.insert(sub_step_timings.end(), timings.begin(), timings.end());
+        }
+        return true;
+    }
+
+    [[nodiscard]]
+    const DomainStats &getStats() const {
+        return stats;
+    }
+
+    // timings of every sub step of the last update, when the PhysicsHandler is profiling
+    [[nodiscard]]
+    const std::vector<SubStepTimings> &getSubStepTimings() const {
+        return sub_step_timings;
+    }
+
+private:
+    // rank owning the column of x, the world walls keep x inside the world
+    [[nodiscard]]
+    int32_t getDestination(const float x) const {
+        if (x < slab_min) return std::max(0, transport.getRank() - 1);
+        if (x >= slab_max) return std::min(transport.getRankCount() - 1, transport.getRank() + 1);
+        return transport.getRank();
+    }
+
+    [[nodiscard]]
+    float getHaloWidth() const {
+        if (settings.halo_width > 0.0f) return settings.halo_width;
+        // the cell of the coarsest level holds the largest diameter
+        float cell_size = 1.0f;
+        while (cell_size < 2.0f * physics_handler.getObjects()->max_radius) cell_size *= 2.0f;
+        return cell_size;
+    }
+
+    bool migrateObjects() {
+        const Object &objects = *physics_handler.getObjects();
+        left_indices.clear();
+        right_indices.clear();
+        for (int32_t idx = 0; idx < objects.size; ++idx) {
+            const int32_t destination = getDestination(objects.position_x[idx]);
+            if (destination < transport.getRank()) left_indices.push_back(idx);
+            else if (destination > transport.getRank()) right_indices.push_back(idx);
+        }
+        // encoded before they are removed, the removal moves other particles into their indices
+        outgoing_handles.clear();
+        for (const std::vector<int32_t> *indices : {&left_indices, &right_indices}) {
+            for (const int32_t idx : *indices) outgoing_handles.push_back(physics_handler.getObjectHandles()[idx]);
+        }
+        const int32_t rank = transport.getRank();
+        if (rank > 0) {
+            encodeObjects(left_indices, message);
+            if (!transport.send(rank - 1, message)) return false;
+        }
+        if (rank + 1 < transport.getRankCount()) {
+            encodeObjects(right_indices, message);
+            if (!transport.send(rank + 1, message)) return false;
+        }
+        physics_handler.removeObjects(outgoing_handles.data(), static_cast<int32_t>(outgoing_handles.size()));
+        stats.migrated_out += static_cast<int64_t>(outgoing_handles.size());
+        if (!receiveObjects()) return false;
+        stats.migrated_in += received_count;
+        return true;
+    }
+
+    bool exchangeGhosts() {
+        const Object &objects = *physics_handler.getObjects();
+        const float halo_width = getHaloWidth();
+        left_indices.clear();
+        right_indices.clear();
+        for (int32_t idx = 0; idx < objects.size; ++idx) {
+            const float x = objects.position_x[idx];
+            if (x < slab_min + halo_width) left_indices.push_back(idx);
+            if (x >= slab_max - halo_width) right_indices.push_back(idx);
+        }
+        const int32_t rank = transport.getRank();
+        if (rank > 0) {
+            encodeObjects(left_indices, message);
+            if (!transport.send(rank - 1, message)) return false;
+            stats.sent_ghosts += static_cast<int64_t>(left_indices.size());
+        }
+        if (rank + 1 < transport.getRankCount()) {
+            encodeObjects(right_indices, message);
+            if (!transport.send(rank + 1, message)) return false;
+            stats.sent_ghosts += static_cast<int64_t>(right_indices.size());
+        }
+        physics_handler.clearGhosts();
+        for (const int32_t neighbour : {rank - 1, rank + 1}) {
+            if (neighbour < 0 || neighbour >= transport.getRankCount()) continue;
+            if (!transport.receive(neighbour, message) || !decodeObjects(message, received)) return false;
+            physics_handler.addGhosts(received);
+            stats.received_ghosts += received.size();
+        }
+        return true;
+    }
+
+    // creates the particles migrating from both neighbours
+    bool receiveObjects() {
+        const int32_t rank = transport.getRank();
+        received_count = 0;
+        for (const int32_t neighbour : {rank - 1, rank + 1}) {
+            if (neighbour < 0 || neighbour >= transport.getRankCount()) continue;
+            if (!transport.receive(neighbour, message) || !decodeObjects(message, received)) return false;
+            received_count += physics_handler.createObjects(received);
+        }
+        return true;
+    }
+
+    // int32 count, then one 4 byte array per ObjectBatch attribute; velocities are displacements per update
+    void encodeObjects(const std::vector<int32_t> &indices, std::vector<uint8_t> &bytes) const {
+        const Object &objects = *physics_handler.getObjects();
+        const auto count = static_cast<int32_t>(indices.size());
+        bytes.resize(sizeof(int32_t) + static_cast<size_t>(count) * batch_attribute_count * sizeof(float));
+        std::memcpy(bytes.data(), &count, sizeof(int32_t));
+        auto *values = reinterpret_cast<float *>(bytes.data() + sizeof(int32_t));
+        auto *colors = reinterpret_cast<uint32_t *>(values + 5 * count);
+        for (int32_t i = 0; i < count; ++i) {
+            const int32_t idx = indices[i];
+            values[0 * count + i] = objects.position_x[idx];
+            values[1 * count + i] = objects.position_y[idx];
+            values[2 * count + i] = objects.position_x[idx] - objects.last_position_x[idx];
+            values[3 * count + i] = objects.position_y[idx] - objects.last_position_y[idx];
+            values[4 * count + i] = objects.radius[idx];
+            colors[i]             = objects.color[idx];
+        }
+    }
+
+    static bool decodeObjects(const std::vector<uint8_t> &bytes, ObjectBatch &batch) {
+        int32_t count = 0;
+        if (bytes.size() < sizeof(int32_t)) return false;
+        std::memcpy(&count, bytes.data(), sizeof(int32_t));
+        if (count < 0 || bytes.size() != sizeof(int32_t) + static_cast<size_t>(count) * batch_attribute_count * sizeof(float)) return false;
+        batch.resize(count);
+        // empty arrays may have no data to copy into
+        if (count == 0) return true;
+        const uint8_t *values = bytes.data() + sizeof(int32_t);
+        const size_t array_size = static_cast<size_t>(count) * sizeof(float);
+        int32_t attribute = 0;
+        for (std::vector<float> *array : {&batch.position_x, &batch.position_y, &batch.velocity_x, &batch.velocity_y, &batch.radius}) {
+            std::memcpy(array->data(), values + attribute++ * array_size, array_size);
+        }
+        std::memcpy(batch.color.data(), values + attribute * array_size, array_size);
+        return true;
+    }
+
+    static constexpr int32_t batch_attribute_count = 6;
+
+    PhysicsHandler &physics_handler;
+    DomainTransport &transport;
+    DomainSettings settings;
+    float slab_min = 0.0f;
+    float slab_max = 0.0f;
+    DomainStats stats;
+    std::vector<SubStepTimings> sub_step_timings;
+    int32_t frames_since_reorder = 0;
+    std::vector<int32_t> left_indices, right_indices, outgoing_handles, selected;
+    std::vector<uint8_t> message;
+    ObjectBatch received, slab_batch;
+    int32_t received_count = 0;
+};
+
+#endif
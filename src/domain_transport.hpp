@@ -0,0 +1,295 @@
+#ifndef DOMAIN_TRANSPORT_HPP
+#define DOMAIN_TRANSPORT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Moves messages between the processes of a decomposed simulation, see DomainHandler. Messages from one rank
+// to another arrive in the order they were sent. send may block until the last message to the same rank was
+// received, so every rank sends to all its neighbours before receiving from them.
+class DomainTransport {
+public:
+    virtual ~DomainTransport() = default;
+
+    [[nodiscard]]
+    virtual int32_t getRank() const = 0;
+
+    [[nodiscard]]
+    virtual int32_t getRankCount() const = 0;
+
+    // false when the message cannot be delivered
+    virtual bool send(int32_t rank, const std::vector<uint8_t> &message) = 0;
+
+    // waits for the next message from rank, false when none arrives
+    virtual bool receive(int32_t rank, std::vector<uint8_t> &message) = 0;
+};
+
+// Ranks on one machine exchanging messages through a named shared memory segment, shm_open or a named file
+// mapping. Each ordered pair of ranks has a mailbox holding one message of at most mailbox_capacity bytes;
+// senders and receivers spin on its sequence numbers. Rank 0 creates the segment and removes the name once
+// every rank has attached, so the name must be unique to the run. isOpen is false when the segment cannot be
+// created or the other ranks do not attach within the timeout.
+class SharedMemoryTransport : public DomainTransport {
+public:
+    SharedMemoryTransport(const std::string &_name, const int32_t _rank, const int32_t _rank_count, const uint64_t _mailbox_capacity = 16 << 20, const float _timeout = 30.0f)
+        : rank(_rank)
+        , rank_count(_rank_count)
+        , mailbox_capacity(_mailbox_capacity)
+        , mailbox_stride((sizeof(Mailbox) + _mailbox_capacity + 63) / 64 * 64)
+        , timeout(_timeout)
+    {
+        if (rank < 0 || rank >= rank_count) {
+            std::cerr << "rank " << rank << " is not below the rank count " << rank_count << std::endl;
+            return;
+        }
+    #ifdef _WIN32
+        name = "Local\\" + _name;
+    #else
+        name = _name.empty() || _name[0] != '/' ? "/" + _name : _name;
+    #endif
+        if (!(rank == 0 ? create() : attach())) {
+            unmap();
+            return;
+        }
+        header->attached.fetch_add(1, std::memory_order_acq_rel);
+        if (!waitFor([this] { return header->attached.load(std::memory_order_acquire) == rank_count; })) {
+            std::cerr << "ranks did not attach to " << name << std::endl;
+            unmap();
+            return;
+        }
+    #ifndef _WIN32
+        if (rank == 0) shm_unlink(name.c_str());
+    #endif
+        open = true;
+    }
+
+    ~SharedMemoryTransport() override {
+        unmap();
+    }
+
+    SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+    SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+
+    [[nodiscard]]
+    bool isOpen() const {
+        return open;
+    }
+
+    [[nodiscard]]
+    int32_t getRank() const override {
+        return rank;
+    }
+
+    [[nodiscard]]
+    int32_t getRankCount() const override {
+        return rank_count;
+    }
+
+    bool send(const int32_t to, const std::vector<uint8_t> &message) override {
+        if (!open || to < 0 || to >= rank_count) return false;
+        if (message.size() > mailbox_capacity) {
+            std::cerr << "message of " << message.size() << " bytes does not fit a " << mailbox_capacity << " byte mailbox" << std::endl;
+            return false;
+        }
+        Mailbox &mailbox = getMailbox(rank, to);
+        const uint64_t sequence = mailbox.written.load(std::memory_order_relaxed);
+        if (!waitFor([&] { return mailbox.read.load(std::memory_order_acquire) == sequence; })) {
+            std::cerr << "rank " << to << " did not receive" << std::endl;
+            return false;
+        }
+        mailbox.size = message.size();
+        std::memcpy(getData(mailbox), message.data(), message.size());
+        mailbox.written.store(sequence + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool receive(const int32_t from, std::vector<uint8_t> &message) override {
+        if (!open || from < 0 || from >= rank_count) return false;
+        Mailbox &mailbox = getMailbox(from, rank);
+        const uint64_t sequence = mailbox.read.load(std::memory_order_relaxed);
+        if (!waitFor([&] { return mailbox.written.load(std::memory_order_acquire) > sequence; })) {
+            std::cerr << "rank " << from << " did not send" << std::endl;
+            return false;
+        }
+        message.resize(mailbox.size);
+        std::memcpy(message.data(), getData(mailbox), mailbox.size);
+        mailbox.read.store(sequence + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static constexpr uint32_t ready_magic = 0x50424453; // "PBDS"
+
+    struct Header {
+        std::atomic<uint32_t> ready {0};
+        std::atomic<int32_t> attached {0};
+        int32_t rank_count = 0;
+        uint64_t mailbox_capacity = 0;
+    };
+
+    // followed by the message bytes
+    struct alignas(64) Mailbox {
+        std::atomic<uint64_t> written {0}; // messages sent
+        std::atomic<uint64_t> read {0};    // messages received
+        uint64_t size = 0;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+    Mailbox &getMailbox(const int32_t from, const int32_t to) {
+        uint8_t *first = reinterpret_cast<uint8_t *>(header) + (sizeof(Header) + 63) / 64 * 64;
+        return *reinterpret_cast<Mailbox *>(first + (static_cast<uint64_t>(from) * rank_count + to) * mailbox_stride);
+    }
+
+    static uint8_t *getData(Mailbox &mailbox) {
+        return reinterpret_cast<uint8_t *>(&mailbox) + sizeof(Mailbox);
+    }
+
+    // spins, then yields, until done or the timeout
+    template<typename Condition>
+    bool waitFor(const Condition &done) const {
+        for (int32_t spin = 0; spin < 1024; ++spin) {
+            if (done()) return true;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        while (!done()) {
+            if (std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() > timeout) return false;
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    bool create() {
+    #ifdef _WIN32
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(getMappedSize() >> 32), static_cast<DWORD>(getMappedSize()), name.c_str());
+        if (mapping == nullptr) {
+            std::cerr << "cannot create " << name << std::endl;
+            return false;
+        }
+        void *mapped = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (mapped == nullptr) {
+            std::cerr << "cannot map " << name << std::endl;
+            return false;
+        }
+    #else
+        // a segment left behind by a crashed run
+        shm_unlink(name.c_str());
+        descriptor = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (descriptor < 0 || ftruncate(descriptor, static_cast<off_t>(getMappedSize())) != 0) {
+            std::cerr << "cannot create " << name << std::endl;
+            return false;
+        }
+        void *mapped = mmap(nullptr, getMappedSize(), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "cannot map " << name << std::endl;
+            return false;
+        }
+    #endif
+        header = new (mapped) Header;
+        header->rank_count = rank_count;
+        header->mailbox_capacity = mailbox_capacity;
+        for (int32_t from = 0; from < rank_count; ++from) {
+            for (int32_t to = 0; to < rank_count; ++to) {
+                new (&getMailbox(from, to)) Mailbox;
+            }
+        }
+        header->ready.store(ready_magic, std::memory_order_release);
+        return true;
+    }
+
+    // retries until rank 0 has created the segment
+    bool attach() {
+        const bool attached = waitFor([this] {
+        #ifdef _WIN32
+            mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+            if (mapping == nullptr) return false;
+            void *mapped = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+            if (mapped == nullptr) {
+                unmap();
+                return false;
+            }
+        #else
+            descriptor = shm_open(name.c_str(), O_RDWR, 0600);
+            struct stat segment_stat {};
+            if (descriptor < 0 || fstat(descriptor, &segment_stat) != 0 || static_cast<uint64_t>(segment_stat.st_size) != getMappedSize()) {
+                unmap();
+                return false;
+            }
+            void *mapped = mmap(nullptr, getMappedSize(), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+            if (mapped == MAP_FAILED) {
+                unmap();
+                return false;
+            }
+        #endif
+            header = static_cast<Header *>(mapped);
+            if (header->ready.load(std::memory_order_acquire) != ready_magic) {
+                unmap();
+                return false;
+            }
+            return true;
+        });
+        if (!attached) {
+            std::cerr << "cannot attach to " << name << std::endl;
+            return false;
+        }
+        if (header->rank_count != rank_count || header->mailbox_capacity != mailbox_capacity) {
+            std::cerr << name << " was created for other ranks or mailboxes" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    [[nodiscard]]
+    uint64_t getMappedSize() const {
+        return (sizeof(Header) + 63) / 64 * 64 + static_cast<uint64_t>(rank_count) * static_cast<uint64_t>(rank_count) * mailbox_stride;
+    }
+
+    void unmap() {
+        open = false;
+    #ifdef _WIN32
+        if (header != nullptr) UnmapViewOfFile(header);
+        if (mapping != nullptr) CloseHandle(mapping);
+        mapping = nullptr;
+    #else
+        if (header != nullptr) munmap(header, getMappedSize());
+        if (descriptor >= 0) close(descriptor);
+        descriptor = -1;
+    #endif
+        header = nullptr;
+    }
+
+    int32_t rank;
+    int32_t rank_count;
+    uint64_t mailbox_capacity;
+    uint64_t mailbox_stride;
+    float timeout; // seconds
+    std::string name;
+    Header *header = nullptr;
+    bool open = false;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+};
+
+#endif
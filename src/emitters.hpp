@@ -0,0 +1,212 @@
+#ifndef EMITTERS_HPP
+#define EMITTERS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "object.hpp"
+#include "utils.hpp"
+
+// Particles an emitter generates, velocities are displacements per update like createObject's
+struct EmitterSettings {
+    float min_radius = 0.2f;
+    float max_radius = 0.5f;
+    V2f velocity = {0.0f, 0.0f};
+    V2f velocity_jitter = {0.0f, 0.0f}; // each component gets a random offset within +-jitter
+    V2f position_jitter = {0.0f, 0.0f};
+    float hue = 0.0f;      // fully saturated color of the next batch
+    float hue_step = 0.0f; // added to the hue after each batch
+    uint32_t seed = 0;
+};
+
+// Generates whole batches of particles for PhysicsHandler::createObjects. The random values are hashed from
+// the seed, the batch and the particle index instead of drawn in sequence, so a batch is filled in parallel and
+// comes out the same for any thread count.
+class Emitter {
+public:
+    explicit Emitter(const EmitterSettings &_settings)
+        : settings(_settings)
+    {}
+
+    virtual ~Emitter() = default;
+
+    // replaces the contents of batch with the next batch of at most max_count particles, returns its size
+    int32_t emit(ObjectBatch &batch, const int32_t max_count = std::numeric_limits<int32_t>::max()) {
+        const int32_t count = std::max(0, std::min(getBatchSize(), max_count));
+        batch.resize(count);
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+        HSVtoRGB(settings.hue - std::floor(settings.hue), 1.0f, 1.0f, r, g, b);
+        const uint32_t color = packColor(r, g, b);
+        const uint32_t batch_hash = hash(settings.seed ^ hash(batch_index));
+        #pragma omp parallel for num_threads(cpu_threads) if(count >= 4096)
+        for (int32_t i = 0; i < count; ++i) {
+            const V2f position = getPosition(i);
+            batch.position_x[i] = position.x + settings.position_jitter.x * (2.0f * random(batch_hash, i, 0) - 1.0f);
+            batch.position_y[i] = position.y + settings.position_jitter.y * (2.0f * random(batch_hash, i, 1) - 1.0f);
+            batch.velocity_x[i] = settings.velocity.x + settings.velocity_jitter.x * (2.0f * random(batch_hash, i, 2) - 1.0f);
+            batch.velocity_y[i] = settings.velocity.y + settings.velocity_jitter.y * (2.0f * random(batch_hash, i, 3) - 1.0f);
+            batch.radius[i]     = settings.min_radius + (settings.max_radius - settings.min_radius) * random(batch_hash, i, 4);
+            batch.color[i]      = color;
+        }
+        advance(count);
+        settings.hue += settings.hue_step;
+        ++batch_index;
+        return count;
+    }
+
+    [[nodiscard]]
+    EmitterSettings &getSettings() {
+        return settings;
+    }
+
+protected:
+    // particles of the next batch
+    [[nodiscard]]
+    virtual int32_t getBatchSize() const = 0;
+
+    // position of the particle index of the next batch, called in parallel
+    [[nodiscard]]
+    virtual V2f getPosition(int32_t index) const = 0;
+
+    // after a batch of count particles
+    virtual void advance(int32_t) {}
+
+private:
+    static uint32_t hash(uint32_t value) {
+        value ^= value >> 16;
+        value *= 0x7feb352du;
+        value ^= value >> 15;
+        value *= 0x846ca68bu;
+        value ^= value >> 16;
+        return value;
+    }
+
+    // uniform in [0, 1)
+    static float random(const uint32_t batch_hash, const int32_t index, const uint32_t channel) {
+        return static_cast<float>(hash(batch_hash + static_cast<uint32_t>(index) * 8u + channel) >> 8) * (1.0f / 16777216.0f);
+    }
+
+    EmitterSettings settings;
+    uint32_t batch_index = 0;
+};
+
+// count particles evenly spaced along the segment from start to end, each at the middle of its share
+class LineEmitter : public Emitter {
+public:
+    LineEmitter(const EmitterSettings &_settings, const V2f _start, const V2f _end, const int32_t _count)
+        : Emitter(_settings)
+        , start(_start)
+        , end(_end)
+        , count(_count)
+    {}
+
+    void setLine(const V2f _start, const V2f _end, const int32_t _count) {
+        start = _start;
+        end = _end;
+        count = std::max(0, _count);
+    }
+
+protected:
+    [[nodiscard]]
+    int32_t getBatchSize() const override {
+        return count;
+    }
+
+    [[nodiscard]]
+    V2f getPosition(const int32_t index) const override {
+        const float t = (static_cast<float>(index) + 0.5f) / static_cast<float>(count);
+        return start + (end - start) * t;
+    }
+
+private:
+    V2f start;
+    V2f end;
+    int32_t count;
+};
+
+// count particles spread evenly over a disc along a sunflower spiral
+class DiscEmitter : public Emitter {
+public:
+    DiscEmitter(const EmitterSettings &_settings, const V2f _center, const float _radius, const int32_t _count)
+        : Emitter(_settings)
+        , center(_center)
+        , radius(_radius)
+        , count(_count)
+    {}
+
+protected:
+    [[nodiscard]]
+    int32_t getBatchSize() const override {
+        return count;
+    }
+
+    [[nodiscard]]
+    V2f getPosition(const int32_t index) const override {
+        constexpr float golden_angle = 2.39996323f;
+        const float distance = radius * std::sqrt((static_cast<float>(index) + 0.5f) / static_cast<float>(count));
+        const float angle = golden_angle * static_cast<float>(index);
+        return {center.x + distance * std::cos(angle), center.y + distance * std::sin(angle)};
+    }
+
+private:
+    V2f center;
+    float radius;
+    int32_t count;
+};
+
+// Fills the rectangle from min to max with one particle per spacing square, row by row from the bottom. Each
+// batch continues where the last one stopped, until every square is filled.
+class LatticeEmitter : public Emitter {
+public:
+    LatticeEmitter(const EmitterSettings &_settings, const V2f _min, const V2f _max, const float _spacing)
+        : Emitter(_settings)
+        , min(_min)
+        , spacing(_spacing)
+        , columns(std::max(0, static_cast<int32_t>((_max.x - _min.x) / _spacing)))
+        , rows(std::max(0, static_cast<int32_t>((_max.y - _min.y) / _spacing)))
+    {}
+
+    [[nodiscard]]
+    int32_t getCapacity() const {
+        return columns * rows;
+    }
+
+    // squares filled so far, set it to skip squares
+    void setFilled(const int32_t _filled) {
+        filled = std::clamp(_filled, 0, getCapacity());
+    }
+
+    [[nodiscard]]
+    int32_t getFilled() const {
+        return filled;
+    }
+
+protected:
+    [[nodiscard]]
+    int32_t getBatchSize() const override {
+        return getCapacity() - filled;
+    }
+
+    [[nodiscard]]
+    V2f getPosition(const int32_t index) const override {
+        const int32_t square = filled + index;
+        const float x = min.x + (static_cast<float>(square % columns) + 0.5f) * spacing;
+        const float y = min.y + (static_cast<float>(rows - 1 - square / columns) + 0.5f) * spacing;
+        return {x, y};
+    }
+
+    void advance(const int32_t count) override {
+        filled += count;
+    }
+
+private:
+    V2f min;
+    float spacing;
+    int32_t columns;
+    int32_t rows;
+    int32_t filled = 0;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef FRAME_SCHEDULER_HPP
+#define FRAME_SCHEDULER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// Work shed by the FrameScheduler, each level keeps the ones before it
+enum class DegradationLevel {
+    None,
+    HalfRenderRate, // every second frame is drawn
+    NoEmission,     // no new particles
+    FewerSubSteps,  // at most half the sub steps
+};
+
+constexpr int32_t degradation_level_count = static_cast<int32_t>(DegradationLevel::FewerSubSteps) + 1;
+
+inline const char *getDegradationName(const DegradationLevel level) {
+    switch (level) {
+        case DegradationLevel::None:           return "none";
+        case DegradationLevel::HalfRenderRate: return "half render rate";
+        case DegradationLevel::NoEmission:     return "no emission";
+        case DegradationLevel::FewerSubSteps:  return "fewer sub steps";
+    }
+    return "unknown";
+}
+
+// Limits of the FrameScheduler, loads are frame work over its budget
+struct SchedulerSettings {
+    int32_t max_steps_per_frame = 4;
+    int32_t shed_frames = 15;     // frames over budget before the next level is shed
+    int32_t recover_frames = 120; // frames under recover_load before a level is given back
+    float recover_load = 0.6f;
+    int32_t min_sub_steps = 2;    // the sub steps are never shed below this
+};
+
+// How often and how hard the FrameScheduler degraded
+struct SchedulerStats {
+    int64_t frames = 0;
+    int64_t skipped_renders = 0;
+    std::array<int64_t, degradation_level_count> level_frames {}; // frames spent at each level
+    int32_t degradations = 0;  // times the level went up
+    float worst_load = 0.0f;   // largest frame work over its budget
+    float dropped_time = 0.0f; // simulated time given up because the physics fell behind, in seconds
+};
+
+// Runs the physics at a fixed step from the real elapsed time and keeps the work of a frame within a budget.
+// The real time accumulates and whole steps are taken from it, the remainder is the interpolation between the
+// last two physics states. When the physics update or the frame work stays over budget for shed_frames frames
+// the next level of work is shed: first the render rate, then the emission, then the sub steps. A level is only
+// given back after recover_frames frames well under budget, so a load close to the budget does not flip it
+// every frame.
+class FrameScheduler {
+public:
+    FrameScheduler(const float _step_time, const float _budget, const SchedulerSettings &_settings = {})
+        : step_time(_step_time)
+        , budget(_budget)
+        , settings(_settings)
+    {}
+
+    // adds the real time elapsed since the last frame and returns the physics steps to run now
+    int32_t beginFrame(const float elapsed_time) {
+        accumulated_time += elapsed_time;
+        auto steps = static_cast<int32_t>(accumulated_time / step_time);
+        if (steps > settings.max_steps_per_frame) {
+            // a stall, the simulation slows down instead of spending the next frames catching up
+            steps = settings.max_steps_per_frame;
+            const float kept_time = static_cast<float>(steps) * step_time;
+            stats.dropped_time += accumulated_time - kept_time;
+            accumulated_time = kept_time;
+        }
+        accumulated_time -= static_cast<float>(steps) * step_time;
+        rendering = level < DegradationLevel::HalfRenderRate || !rendering;
+        return steps;
+    }
+
+    // the physics updates just waited for, update_time in seconds
+    void addPhysicsTime(const float update_time, const int32_t steps) {
+        front_steps = std::max(1, steps);
+        physics_load = update_time / (static_cast<float>(front_steps) * step_time);
+    }
+
+    // work of the frame on this thread except waiting for the display, in seconds
+    void endFrame(const float frame_time) {
+        const float render_interval = level >= DegradationLevel::HalfRenderRate ? 2.0f : 1.0f;
+        const float load = std::max(physics_load, rendering ? frame_time / (budget * render_interval) : 0.0f);
+        ++stats.frames;
+        ++stats.level_frames[static_cast<int32_t>(level)];
+        if (!rendering) ++stats.skipped_renders;
+        stats.worst_load = std::max(stats.worst_load, load);
+        last_load = load;
+
+        if (load > 1.0f) {
+            recover_count = 0;
+            if (++shed_count >= settings.shed_frames && level < DegradationLevel::FewerSubSteps) {
+                level = static_cast<DegradationLevel>(static_cast<int32_t>(level) + 1);
+                ++stats.degradations;
+                shed_count = 0;
+            }
+        } else if (load < settings.recover_load) {
+            shed_count = 0;
+            if (++recover_count >= settings.recover_frames && level > DegradationLevel::None) {
+                level = static_cast<DegradationLevel>(static_cast<int32_t>(level) - 1);
+                recover_count = 0;
+            }
+        } else {
+            shed_count = 0;
+            recover_count = 0;
+        }
+    }
+
+    // whether the frame begun last is drawn
+    [[nodiscard]]
+    bool shouldRender() const {
+        return rendering;
+    }
+
+    [[nodiscard]]
+    bool isEmissionPaused() const {
+        return level >= DegradationLevel::NoEmission;
+    }
+
+    // sub step cap for PhysicsHandler::setSubStepLimit, 0 when the sub steps are not shed
+    [[nodiscard]]
+    int32_t getSubStepLimit(const int32_t sub_steps) const {
+        return level >= DegradationLevel::FewerSubSteps ? std::max(settings.min_sub_steps, sub_steps / 2) : 0;
+    }
+
+    // fraction of the way from the previous to the last physics state to draw
+    [[nodiscard]]
+    float getInterpolation() const {
+        return std::clamp(accumulated_time / (static_cast<float>(front_steps) * step_time), 0.0f, 1.0f);
+    }
+
+    [[nodiscard]]
+    DegradationLevel getLevel() const {
+        return level;
+    }
+
+    // load of the last frame, 1 is the budget
+    [[nodiscard]]
+    float getLastLoad() const {
+        return last_load;
+    }
+
+    [[nodiscard]]
+    const SchedulerStats &getStats() const {
+        return stats;
+    }
+
+private:
+    float step_time;
+    float budget;
+    SchedulerSettings settings;
+    float accumulated_time = 0.0f;
+    int32_t front_steps = 1;
+    float physics_load = 0.0f;
+    float last_load = 0.0f;
+    bool rendering = false;
+    DegradationLevel level = DegradationLevel::None;
+    int32_t shed_count = 0;
+    int32_t recover_count = 0;
+    SchedulerStats stats;
+};
+
+#endif
@@ -1,84 +1,313 @@
 #ifndef GRID_HELPER_HPP
 #define GRID_HELPER_HPP
 
-#include "utils.hpp"
-
-#ifdef USE_CPU
-
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <utility>
 #include <vector>
+#include <omp.h>
 
 #include "object.hpp"
+#include "utils.hpp"
 
-constexpr int num_cell = 16;
+// capacity of a cell in the former fixed-size layout, cells holding more are reported as overflowing
+constexpr int32_t nominal_cell_capacity = 16;
 
-struct Grid {
-    Grid() = default;
+struct GridStats {
+    int32_t occupied_cells   = 0;
+    int32_t max_occupancy    = 0;
+    int32_t overflow_cells   = 0; // cells holding more than nominal_cell_capacity particles
+    int32_t overflow_objects = 0; // particles above nominal_cell_capacity, summed over all cells
+};
 
-    void clear() {
-        object_count = 0;
-    }
+// Particles with a diameter up to 1 are binned in cells of one world unit. Larger particles go to coarser
+// levels whose cells are twice as large as the previous level's, the first level whose cell size covers
+// their diameter, so the 3x3 cells around a particle at its own level hold every particle of that level
+// it can touch. Level l cell (x, y) lies inside level l + 1 cell (x / 2, y / 2).
+struct GridLevel {
+    float cell_size;
+    float inverse_cell_size;
+    int32_t width, height;
+    int32_t first_cell; // index of cell (0, 0) of this level among the cells of every level
+};
 
-    void addObject(const int32_t idx) {
-        object_idx[object_count++] = idx;
+// smallest level whose cells are at least as large as the diameter
+inline int32_t getGridLevelForRadius(const float radius) {
+    int32_t level = 0;
+    for (float cell_size = 1.0f; 2.0f * radius > cell_size; cell_size *= 2.0f) {
+        ++level;
     }
+    return level;
+}
 
-    int32_t object_idx[num_cell]{};
-    int32_t object_count = 0;
-};
+inline std::vector<GridLevel> makeGridLevels(const int32_t world_width, const int32_t world_height, const int32_t level_count) {
+    std::vector<GridLevel> levels;
+    int32_t first_cell = 0;
+    float cell_size = 1.0f;
+    for (int32_t level = 0; level < level_count; ++level) {
+        GridLevel grid_level;
+        grid_level.cell_size = cell_size;
+        grid_level.inverse_cell_size = 1.0f / cell_size;
+        grid_level.width  = static_cast<int32_t>(std::ceil(static_cast<float>(world_width) / cell_size));
+        grid_level.height = static_cast<int32_t>(std::ceil(static_cast<float>(world_height) / cell_size));
+        grid_level.first_cell = first_cell;
+        levels.push_back(grid_level);
+        first_cell += grid_level.width * grid_level.height;
+        cell_size *= 2.0f;
+    }
+    return levels;
+}
 
+// Particles are binned with a counting sort: the indices of the particles of cell c are stored in
+// cell_objects[cell_start[c], cell_start[c] + cell_count[c]). Cells are column-major inside a level, so the cells
+// (x, y - 1), (x, y) and (x, y + 1) are adjacent and their particles form one contiguous range.
+// Every cell of the world is stored, they are allocated by the first updateGrids.
 class GridHelper {
 public:
     GridHelper(const int32_t _world_width, const int32_t _world_height)
         : world_width(_world_width)
         , world_height(_world_height)
-    {
-        const int32_t grids_count = world_width * world_height;
-        grids.resize(grids_count);
+    {}
+
+    [[nodiscard]]
+    int32_t getLevelCount() const {
+        return static_cast<int32_t>(levels.size());
     }
 
-    Grid &getGridAt(const int32_t index) {
-        return grids[index];
+    [[nodiscard]]
+    const GridLevel &getLevel(const int32_t level) const {
+        return levels[level];
     }
 
+    // cells of every level
     [[nodiscard]]
     int32_t getGridsCount() const {
-        return static_cast<int32_t>(grids.size());
+        return static_cast<int32_t>(cell_count.size());
+    }
+
+    [[nodiscard]]
+    int32_t getCellStart(const int32_t index) const {
+        return cell_start[index];
+    }
+
+    [[nodiscard]]
+    int32_t getCellCount(const int32_t index) const {
+        return cell_count[index];
+    }
+
+    // indices of the particles in cells [first_index, last_index], which must be one column of one level
+    [[nodiscard]]
+    const int32_t *getCellObjects(const int32_t first_index) const {
+        return cell_objects.data() + cell_start[first_index];
+    }
+
+    [[nodiscard]]
+    int32_t getCellsObjectCount(const int32_t first_index, const int32_t last_index) const {
+        return cell_start[last_index + 1] - cell_start[first_index];
+    }
+
+    // particles in a column of a level
+    [[nodiscard]]
+    int32_t getColumnObjectCount(const int32_t level, const int32_t grid_x) const {
+        const auto [first, last] = getColumnCells(level, grid_x);
+        return cell_start[last] - cell_start[first];
+    }
+
+    // cells [first, last) of a column of a level
+    [[nodiscard]]
+    std::pair<int32_t, int32_t> getColumnCells(const int32_t level, const int32_t grid_x) const {
+        const GridLevel &grid_level = levels[level];
+        const int32_t first = grid_level.first_cell + grid_x * grid_level.height;
+        return {first, first + grid_level.height};
+    }
+
+    [[nodiscard]]
+    int32_t getCellRow(const int32_t level, const int32_t index) const {
+        return (index - levels[level].first_cell) % levels[level].height;
+    }
+
+    // appends the particles of the 3x3 cells around (grid_x, grid_y) of a level
+    void gatherNeighbours(const int32_t level, const int32_t grid_x, const int32_t grid_y, std::vector<int32_t> &neighbours) const {
+        gatherCells(level, grid_x - 1, grid_y - 1, grid_x + 1, grid_y + 1, neighbours);
+    }
+
+    // appends the particles of the cells from (first_x, first_y) to (last_x, last_y) included of a level that are
+    // inside it, one contiguous range per column
+    void gatherCells(const int32_t level, const int32_t first_x, const int32_t first_y, const int32_t last_x, const int32_t last_y, std::vector<int32_t> &neighbours) const {
+        const GridLevel &grid_level = levels[level];
+        const int32_t height = grid_level.height;
+        const int32_t first_row = std::max(first_y, 0);
+        const int32_t last_row  = std::min(last_y, height - 1);
+        if (first_row > last_row) return;
+        for (int32_t neighbour_x = std::max(first_x, 0); neighbour_x <= std::min(last_x, grid_level.width - 1); ++neighbour_x) {
+            const int32_t first_idx = grid_level.first_cell + neighbour_x * height + first_row;
+            const int32_t *column_objects = getCellObjects(first_idx);
+            neighbours.insert(neighbours.end(), column_objects, column_objects + getCellsObjectCount(first_idx, first_idx + last_row - first_row));
+        }
+    }
+
+    // cell of a particle at the last updateGrids
+    [[nodiscard]]
+    int32_t getObjectCell(const int32_t object_index) const {
+        return object_cell[object_index];
+    }
+
+    // whether a particle moved out of the cell it was binned in by the last updateGrids
+    [[nodiscard]]
+    bool leftCell(const Object &objects, const int32_t object_index) const {
+        const int32_t top_level = getLevelCount() - 1;
+        int32_t level = 0;
+        while (level < top_level && 2.0f * objects.radius[object_index] > levels[level].cell_size) {
+            ++level;
+        }
+        return getGridIndexForPosition(level, objects.position_x[object_index], objects.position_y[object_index]) != object_cell[object_index];
     }
 
     [[nodiscard]]
-    int32_t getGridsWidthCount() const {
-        return world_width;
+    const GridStats &getStats() const {
+        return stats;
     }
 
     [[nodiscard]]
-    int32_t getGridsHeightCount() const {
-        return world_height;
+    int32_t getGridX(const int32_t level, const float position_x) const {
+        const GridLevel &grid_level = levels[level];
+        return std::clamp(static_cast<int32_t>(floorf(position_x * grid_level.inverse_cell_size)), 0, grid_level.width - 1);
     }
 
     [[nodiscard]]
-    int32_t getGridIndexForObject(const Object &object) const {
-        const auto idx_x = static_cast<int32_t>(floorf(object.position_x));
-        const auto idx_y = static_cast<int32_t>(floorf(object.position_y));
-        return idx_x * getGridsHeightCount() + idx_y;
+    int32_t getGridY(const int32_t level, const float position_y) const {
+        const GridLevel &grid_level = levels[level];
+        return std::clamp(static_cast<int32_t>(floorf(position_y * grid_level.inverse_cell_size)), 0, grid_level.height - 1);
     }
 
-    void updateGrids(const std::vector<Object> &objects) {
-        for (auto &grid : grids) {
-            grid.clear();
+    [[nodiscard]]
+    int32_t getGridIndexForPosition(const int32_t level, const float position_x, const float position_y) const {
+        const GridLevel &grid_level = levels[level];
+        return grid_level.first_cell + getGridX(level, position_x) * grid_level.height + getGridY(level, position_y);
+    }
+
+    [[nodiscard]]
+    int32_t getGridIndexForPosition(const float position_x, const float position_y) const {
+        return getGridIndexForPosition(0, position_x, position_y);
+    }
+
+    // adds the levels needed by the largest particle, levels are never removed
+    void reserveLevels(const float max_radius) {
+        const int32_t level_count = getGridLevelForRadius(max_radius) + 1;
+        if (level_count > getLevelCount()) {
+            setLevelCount(level_count);
         }
+    }
+
+    // parallel histogram, prefix sum and scatter; particles keep their relative order inside a cell
+    void updateGrids(const Object &objects, const int32_t thread_count_limit) {
+        reserveLevels(objects.max_radius);
+        const int32_t object_count = objects.size + objects.ghost_count;
+        const int32_t top_level = getLevelCount() - 1;
+        const int32_t grids_count  = getGridsCount();
+        object_cell.resize(object_count);
+        cell_objects.resize(object_count);
+        thread_offsets.resize(static_cast<size_t>(thread_count_limit) * grids_count);
+        block_sums.resize(thread_count_limit + 1);
+
+        int32_t occupied_cells = 0, max_occupancy = 0, overflow_cells = 0, overflow_objects = 0;
+        #pragma omp parallel num_threads(thread_count_limit)
+        {
+            const int32_t thread_count = omp_get_num_threads();
+            const int32_t thread = omp_get_thread_num();
+            int32_t *histogram = thread_offsets.data() + static_cast<size_t>(thread) * grids_count;
+            std::fill(histogram, histogram + grids_count, 0);
+
+            const int32_t object_begin = static_cast<int32_t>(static_cast<int64_t>(object_count) * thread / thread_count);
+            const int32_t object_end   = static_cast<int32_t>(static_cast<int64_t>(object_count) * (thread + 1) / thread_count);
+            for (int32_t idx = object_begin; idx < object_end; ++idx) {
+                int32_t level = 0;
+                while (level < top_level && 2.0f * objects.radius[idx] > levels[level].cell_size) {
+                    ++level;
+                }
+                const int32_t grid_index = getGridIndexForPosition(level, objects.position_x[idx], objects.position_y[idx]);
+                object_cell[idx] = grid_index;
+                ++histogram[grid_index];
+            }
+            #pragma omp barrier
 
-        for (int32_t idx = 0; idx < objects.size(); idx++) {
-            const int32_t grid_index = getGridIndexForObject(objects[idx]);
-            grids[grid_index].addObject(idx);
+            // per cell: turn the thread histograms into offsets inside the cell and store the cell size
+            #pragma omp for reduction(+: occupied_cells, overflow_cells, overflow_objects) reduction(max: max_occupancy)
+            for (int32_t grid_index = 0; grid_index < grids_count; ++grid_index) {
+                int32_t count = 0;
+                for (int32_t t = 0; t < thread_count; ++t) {
+                    int32_t &offset = thread_offsets[static_cast<size_t>(t) * grids_count + grid_index];
+                    const int32_t thread_count_in_cell = offset;
+                    offset = count;
+                    count += thread_count_in_cell;
+                }
+                cell_count[grid_index] = count;
+                occupied_cells += count > 0;
+                max_occupancy = std::max(max_occupancy, count);
+                if (count > nominal_cell_capacity) {
+                    ++overflow_cells;
+                    overflow_objects += count - nominal_cell_capacity;
+                }
+            }
+
+            // exclusive prefix sum of the cell sizes, one block of cells per thread
+            const int32_t cell_begin = static_cast<int32_t>(static_cast<int64_t>(grids_count) * thread / thread_count);
+            const int32_t cell_end   = static_cast<int32_t>(static_cast<int64_t>(grids_count) * (thread + 1) / thread_count);
+            int32_t block_sum = 0;
+            for (int32_t grid_index = cell_begin; grid_index < cell_end; ++grid_index) {
+                block_sum += cell_count[grid_index];
+            }
+            block_sums[thread + 1] = block_sum;
+            #pragma omp barrier
+            #pragma omp single
+            {
+                block_sums[0] = 0;
+                for (int32_t t = 0; t < thread_count; ++t) {
+                    block_sums[t + 1] += block_sums[t];
+                }
+            }
+            int32_t sum = block_sums[thread];
+            for (int32_t grid_index = cell_begin; grid_index < cell_end; ++grid_index) {
+                cell_start[grid_index] = sum;
+                sum += cell_count[grid_index];
+            }
+            #pragma omp barrier
+            #pragma omp single
+            {
+                cell_start[grids_count] = object_count;
+            }
+
+            for (int32_t idx = object_begin; idx < object_end; ++idx) {
+                const int32_t grid_index = object_cell[idx];
+                cell_objects[cell_start[grid_index] + histogram[grid_index]++] = idx;
+            }
         }
+
+        stats.occupied_cells   = occupied_cells;
+        stats.max_occupancy    = max_occupancy;
+        stats.overflow_cells   = overflow_cells;
+        stats.overflow_objects = overflow_objects;
     }
 
 private:
+    void setLevelCount(const int32_t level_count) {
+        levels = makeGridLevels(world_width, world_height, level_count);
+        const GridLevel &top = levels.back();
+        const int32_t cells_count = top.first_cell + top.width * top.height;
+        cell_start.assign(static_cast<size_t>(cells_count) + 1, 0);
+        cell_count.assign(cells_count, 0);
+    }
+
     int32_t world_width, world_height;
-    std::vector<Grid> grids;
+    std::vector<GridLevel> levels;
+    std::vector<int32_t> cell_start;
+    std::vector<int32_t> cell_count;
+    std::vector<int32_t> cell_objects;
+    std::vector<int32_t> object_cell;
+    std::vector<int32_t> thread_offsets;
+    std::vector<int32_t> block_sums;
+    GridStats stats;
 };
 
 #endif
-
-#endif
@@ -1,11 +1,19 @@
 #include <SFML/Graphics/Font.hpp>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <thread>
 
+#include "emitters.hpp"
 #include "fps_counter.hpp"
+#include "frame_scheduler.hpp"
 #include "physics_handler.hpp"
-#include "random_number_generator.hpp"
+#include "physics_thread.hpp"
 #include "renderer.hpp"
+#include "tracing.hpp"
+#include "trajectory.hpp"
 #include "window_handler.hpp"
 
 #ifdef OUTPUT_RESULTS
@@ -14,20 +22,83 @@ std::ofstream output_file;
 int32_t particle_min_count = 0;
 int32_t particle_max_count = 25e4;
 
-int main() {
+static bool parseArguments(const int argc, char **argv, BackendType &backend_type, GridType &grid_type, std::string &checkpoint_path, std::string &record_path, std::string &replay_path, std::string &trace_path) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        const char *value = argv[i + 1];
+        if      (arg == "--threads")    { cpu_threads = std::max(1, std::atoi(value)); }
+        else if (arg == "--block-size") { gpu_block_size = std::max(32, std::atoi(value)); }
+        else if (arg == "--backend") {
+            if (!parseBackendType(value, backend_type)) {
+                std::cerr << "unknown backend: " << value << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--load")       { checkpoint_path = value; }
+        else if (arg == "--record")     { record_path = value; }
+        else if (arg == "--replay")     { replay_path = value; }
+        else if (arg == "--trace") {
+            if (!tracing_enabled) {
+                std::cerr << "--trace needs a build with PBD_ENABLE_TRACING\n";
+                return false;
+            }
+            trace_path = value;
+        }
+        else if (arg == "--grid") {
+            if (!parseGridType(value, grid_type)) {
+                std::cerr << "unknown grid: " << value << "\n";
+                return false;
+            }
+        }
+        else {
+            std::cerr << "unknown option: " << arg << "\n";
+            return false;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cerr << "missing value for " << argv[argc - 1] << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    BackendType backend_type = BackendType::SIMD;
+    GridType grid_type = GridType::Dense;
+    std::string checkpoint_path, record_path, replay_path, trace_path;
+    if (!parseArguments(argc, argv, backend_type, grid_type, checkpoint_path, record_path, replay_path, trace_path)) {
+        std::cerr << "usage: " << argv[0] << " [--backend scalar|openmp|simd|cuda] [--grid dense|sparse] [--threads N] [--block-size N] [--load CHECKPOINT] [--record TRAJECTORY | --replay TRAJECTORY] [--trace TRACE_JSON]\n";
+        return 1;
+    }
+
     constexpr uint32_t window_width  = 1920;
     constexpr uint32_t window_height = 1080;
     const V2i world_size = {200, 200};
 
     WindowHandler window_handler("Test", sf::Vector2u(window_width, window_height));
-    PhysicsHandler physics_handler({static_cast<float>(world_size.x), static_cast<float>(world_size.y)});
-    Renderer renderer(physics_handler);
+    PhysicsHandler physics_handler({static_cast<float>(world_size.x), static_cast<float>(world_size.y)}, backend_type, grid_type);
+    if (!checkpoint_path.empty() && !physics_handler.loadCheckpoint(checkpoint_path)) {
+        return 1;
+    }
+    TrajectoryRecorder recorder;
+    if (!record_path.empty() && !recorder.open(record_path, physics_handler.getWorldSize())) {
+        return 1;
+    }
+    // --replay plays a recorded trajectory in a loop instead of simulating
+    TrajectoryReader replay;
+    Object replay_objects;
+    const bool replaying = !replay_path.empty();
+    if (replaying && !replay.open(replay_path)) {
+        return 1;
+    }
+    const V2f view_size = replaying ? replay.getWorldSize() : physics_handler.getWorldSize();
+    Renderer renderer;
     constexpr float delta_time = 1.0f / 60.0f;
 
     constexpr float margin = 20.0f;
-    const float zoom = static_cast<float>(window_height - margin) / static_cast<float>(world_size.y);
+    const float zoom = static_cast<float>(window_height - margin) / view_size.y;
     window_handler.setZoom(zoom);
-    window_handler.setFocus({static_cast<float>(world_size.x) * 0.5f, static_cast<float>(world_size.y) * 0.5f});
+    window_handler.setFocus(view_size * 0.5f);
 
     bool isEmitting = true;
     window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::Space, [&](const sf::Event&) {
@@ -42,8 +113,60 @@ int main() {
         emit_count = std::min(30, emit_count + 1);
     });
 
-    int32_t rainbow_index = 0;
-    constexpr int32_t rainbow_count = 1000;
+    // cycles through the backends, the particles are kept
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::B, [&](const sf::Event&) {
+        const auto next = static_cast<BackendType>((static_cast<int32_t>(physics_handler.getBackendType()) + 1) % (static_cast<int32_t>(BackendType::CUDA) + 1));
+        physics_handler.setBackend(next);
+    });
+
+    // F5 saves the simulation, F9 restores it; the checkpoint of --load by default
+    const std::string quick_save_path = checkpoint_path.empty() ? "checkpoint.pbd" : checkpoint_path;
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::F5, [&](const sf::Event&) {
+        (void) physics_handler.saveCheckpoint(quick_save_path);
+    });
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::F9, [&](const sf::Event&) {
+        if (physics_handler.loadCheckpoint(quick_save_path)) {
+            renderer.resetParticles();
+        }
+    });
+
+    // adaptive sub steps, driven by the measured displacement and overlap
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::A, [&](const sf::Event&) {
+        physics_handler.setAdaptiveSubSteps(!physics_handler.isAdaptiveSubSteps());
+    });
+
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::G, [&](const sf::Event&) {
+        physics_handler.setGridType(physics_handler.getGridType() == GridType::Dense ? GridType::Sparse : GridType::Dense);
+    });
+
+    // S puts settled particles to sleep, or wakes them all
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::S, [&](const sf::Event&) {
+        physics_handler.setSleeping(SLEEP_DISTANCE, physics_handler.isSleeping() ? 0 : SLEEP_STEPS);
+    });
+
+    // D drains the particles that reach the floor, each updated frame
+    constexpr float drain_height = 5.0f;
+    bool draining = false;
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::D, [&](const sf::Event&) {
+        draining = !draining;
+    });
+
+    // L drops a soft ring of linked particles from the top of the world with the next emission
+    bool dropping_blob = false;
+    window_handler.getEventManager().addKeyPressedCallback(sf::Keyboard::L, [&](const sf::Event&) {
+        dropping_blob = true;
+    });
+    LinkedBatch blob;
+
+    // a column of particles shot from the left wall, one particle per 1.5 units, cycling through the rainbow
+    EmitterSettings stream_settings;
+    stream_settings.velocity        = {0.075f, 0.0f};
+    stream_settings.velocity_jitter = {0.025f, 0.1f};
+    stream_settings.hue_step        = 0.001f;
+    LineEmitter stream(stream_settings, {2.0f, 5.75f}, {2.0f, 5.75f}, 0);
+    ObjectBatch emitted;
+    physics_handler.setObjectLimit(particle_max_count);
+    physics_handler.reserveObjects(particle_max_count);
 
     sf::Font font;
     font.loadFromFile("D:/Workspace/C++/PBD/res/times.ttf");
@@ -51,71 +174,161 @@ int main() {
     FPSCounter fps_counter;
 
 #ifdef OUTPUT_RESULTS
-#ifdef USE_CPU
-    std::string path = "D:/Workspace/C++/PBD/result/cpu_threads" + std::to_string(cpu_threads) + ".csv";
-    output_file.open(path);
-    output_file << "object_counts,physics_update_elapsed_time,render_elapsed_time\n";
-#elif defined USE_GPU
-    std::string path = "D:/Workspace/C++/PBD/result/gpu_block_size" + std::to_string(gpu_block_size) + ".csv";
-    output_file.open(path);
-    output_file << "object_counts,gpu_elapsed_time,physics_update_elapsed_time,render_elapsed_time\n";
-#endif
+    const bool device_backend = physics_handler.getBackendType() == BackendType::CUDA;
+    if (device_backend) {
+        std::string path = "D:/Workspace/C++/PBD/result/gpu_block_size" + std::to_string(gpu_block_size) + ".csv";
+        output_file.open(path);
+        output_file << "object_counts,gpu_elapsed_time,physics_update_elapsed_time,render_elapsed_time\n";
+    } else {
+        std::string path = "D:/Workspace/C++/PBD/result/cpu_threads" + std::to_string(cpu_threads) + ".csv";
+        output_file.open(path);
+        output_file << "object_counts,physics_update_elapsed_time,render_elapsed_time\n";
+    }
 #endif
 
-    while (window_handler.run()) {
-        if (isEmitting && physics_handler.getObjectsCount() < particle_max_count) {
-            for (int i = emit_count; i > 0; i--) {
-                float hue = static_cast<float>(rainbow_index) / static_cast<float>(rainbow_count);
-                float r = 0, g = 0, b = 0;
-                Renderer::HSVtoRGB(hue, 1.0f, 1.0f, r, g, b);
-                const float vel_x  = RandomNumberGenerator::getFloat(0.05f, 0.1f);
-                const float vel_y  = RandomNumberGenerator::getFloat(-0.1f, 0.1f);
-                const float radius = RandomNumberGenerator::getFloat(0.2f, 0.5f);
-            #ifdef USE_CPU
-                int obj_idx = physics_handler.createObject(2.0f, 5.0f + 1.5f * static_cast<float>(i), vel_x, vel_y, radius, r, g, b);
-            #elif defined USE_GPU
-                int obj_idx = physics_handler.createObject(2.0f, 5.0f + 1.5f * static_cast<float>(i), vel_x, vel_y, radius, r, g, b);
-            #endif
+    // the physics thread simulates the next steps while this frame is drawn, physics_handler is only used between
+    // wait and start; the scheduler decides how many steps, and what to shed when a frame runs over budget
+    PhysicsThread physics_thread(physics_handler);
+    FrameScheduler scheduler(delta_time, delta_time);
+    int32_t started_steps = 0;
+    float unrendered_time = 0.0f;
+    PBD_TRACE_THREAD_NAME("main");
+    for (;;) {
+        {
+            PBD_TRACE_ZONE("waitPhysics");
+            physics_thread.wait();
+        }
+        const auto frame_start = std::chrono::high_resolution_clock::now();
+        if (!window_handler.run()) break;
+
+        if (replaying) {
+            if (!replay.readFrame(replay_objects)) {
+                replay.rewind();
+                replay_objects = Object();
+                renderer.resetParticles();
+                if (!replay.readFrame(replay_objects)) {
+                    std::cerr << replay_path << " has no frames" << std::endl;
+                    return 1;
+                }
             }
+            fps_counter.update(clock.restart().asSeconds());
+            window_handler.clear();
+            renderer.render(window_handler, replay_objects, replay.getWorldSize());
+            window_handler.displayText(font, "FPS: " + std::to_string(static_cast<int>(fps_counter.getFPS())), {10.0f, 10.0f});
+            window_handler.displayText(font, "Replay frame: " + std::to_string(replay.getFrameIndex()), {10.0f, 40.0f});
+            window_handler.display();
+            continue;
         }
 
+        // the snapshots drawn below are the states before and after the updates just waited for
+        const Object &snapshot = physics_thread.getSnapshot();
+        const Object &previous_snapshot = physics_thread.getPreviousSnapshot();
+        const bool updated = started_steps > 0;
+        if (updated) {
+            recorder.record(physics_handler);
+            scheduler.addPhysicsTime(physics_thread.getLastUpdateTime() * 1e-6f, physics_thread.getLastStepCount());
+        }
+        // the snapshots also hold the free handles
+        const int32_t object_count = physics_handler.getObjectsCount();
+    #ifdef OUTPUT_RESULTS
+        const bool output_frame = updated && object_count > particle_min_count;
+        if (output_frame) {
+            output_file << object_count << ",";
+            if (device_backend) {
+                output_file << static_cast<int64_t>(physics_handler.getLastDeviceTime()) << ",";
+            }
+            output_file << static_cast<int64_t>(physics_thread.getLastUpdateTime()) << ",";
+        }
+    #endif
+        const SleepStats *sleep_stats = physics_handler.getSleepStats();
+        const int32_t active_count = sleep_stats != nullptr ? sleep_stats->active_objects : -1;
+        const std::string backend_text = std::string("Backend: ") + getBackendName(physics_handler.getBackendType()) + " (" + getGridTypeName(physics_handler.getGridType()) + " grid)";
+        const V2f current_world_size = physics_handler.getWorldSize();
+        const std::string sub_steps_text = "Sub steps: " + std::to_string(physics_handler.getLastSubSteps()) + (physics_handler.isAdaptiveSubSteps() ? " (adaptive)" : "");
+        const std::string load_text = "Load: " + std::to_string(static_cast<int>(scheduler.getLastLoad() * 100.0f)) + "% (shed: " + getDegradationName(scheduler.getLevel()) + ")";
+
         const float dt = clock.restart().asSeconds();
-        fps_counter.update(dt);
+        started_steps = scheduler.beginFrame(dt);
+        const bool rendering = scheduler.shouldRender();
+        unrendered_time += dt;
+        if (rendering) {
+            fps_counter.update(unrendered_time);
+            unrendered_time = 0.0f;
+        }
 
-    #ifdef OUTPUT_RESULTS
-        if (physics_handler.getObjectsCount() > particle_min_count) {
-            output_file << physics_handler.getObjectsCount() << ",";
+        if (started_steps > 0 && draining) {
+            PBD_TRACE_ZONE("drain");
+            (void) physics_handler.removeObjectsInRect({0.0f, current_world_size.y - drain_height}, current_world_size);
         }
 
-        auto physics_update_start = std::chrono::high_resolution_clock::now();
-    #endif
-        physics_handler.update(delta_time);
-    #ifdef OUTPUT_RESULTS
-        auto physics_update_end = std::chrono::high_resolution_clock::now();
-        auto physics_update_duration = std::chrono::duration_cast<std::chrono::microseconds>(physics_update_end - physics_update_start).count();
-        if (physics_handler.getObjectsCount() > particle_min_count) {
-            output_file << physics_update_duration << ",";
+        if (started_steps > 0 && isEmitting && !scheduler.isEmissionPaused()) {
+            PBD_TRACE_ZONE("emit");
+            stream.setLine({2.0f, 5.75f}, {2.0f, 5.75f + 1.5f * static_cast<float>(emit_count)}, emit_count);
+            stream.emit(emitted);
+            physics_handler.createObjects(emitted);
+        }
+
+        if (started_steps > 0 && dropping_blob) {
+            blob.clear();
+            buildBlob(blob, {0.5f * current_world_size.x, 15.0f}, 8.0f, 48, 0.5f);
+            physics_handler.createLinkedObjects(blob);
+            dropping_blob = false;
+        }
+
+        if (started_steps > 0) {
+            physics_handler.setSubStepLimit(scheduler.getSubStepLimit(physics_handler.getSubSteps()));
+            physics_thread.start(delta_time, started_steps);
         }
+        if (!rendering) {
+            // nothing to display, waits out the frame instead of the display
+        #ifdef OUTPUT_RESULTS
+            if (output_frame) {
+                output_file << 0 << "\n";
+            }
+        #endif
+            const float frame_time = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - frame_start).count();
+            scheduler.endFrame(frame_time);
+            std::this_thread::sleep_for(std::chrono::duration<float>(std::max(0.0f, delta_time - frame_time)));
+            continue;
+        }
+
+    #ifdef OUTPUT_RESULTS
         auto render_start = std::chrono::high_resolution_clock::now();
     #endif
         window_handler.clear();
-        renderer.render(window_handler);
+        renderer.render(window_handler, snapshot, current_world_size, &previous_snapshot, scheduler.getInterpolation());
     #ifdef OUTPUT_RESULTS
         auto render_end = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(render_end - render_start).count();
-        if (physics_handler.getObjectsCount() > particle_min_count) {
+        if (output_frame) {
             output_file << duration << "\n";
         }
     #endif
 
         float fps = fps_counter.getFPS();
-        int32_t object_count = physics_handler.getObjectsCount();
 
         window_handler.displayText(font, "FPS: " + std::to_string(static_cast<int>(fps)), {10.0f, 10.0f});
-        window_handler.displayText(font, "Objects: " + std::to_string(object_count), {10.0f, 40.0f});
+        window_handler.displayText(font, "Objects: " + std::to_string(object_count) + (draining ? " (draining)" : ""), {10.0f, 40.0f});
+        if (active_count >= 0) {
+            window_handler.displayText(font, "Active: " + std::to_string(active_count), {10.0f, 100.0f});
+        }
+        window_handler.displayText(font, backend_text, {10.0f, 70.0f});
+        window_handler.displayText(font, sub_steps_text, {10.0f, 130.0f});
+        window_handler.displayText(font, load_text, {10.0f, 160.0f});
+        scheduler.endFrame(std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - frame_start).count());
+        PBD_TRACE_ZONE("display");
         window_handler.display();
+    }
 
-        rainbow_index = (rainbow_index + 1) % rainbow_count;
+    const SchedulerStats &stats = scheduler.getStats();
+    std::cout << "frames: " << stats.frames << ", skipped renders: " << stats.skipped_renders
+              << ", degradations: " << stats.degradations << ", worst load: " << stats.worst_load
+              << ", dropped simulated time: " << stats.dropped_time << " s\n";
+    for (int32_t level = 0; level < degradation_level_count; ++level) {
+        std::cout << "  shed " << getDegradationName(static_cast<DegradationLevel>(level)) << ": " << stats.level_frames[level] << " frames\n";
+    }
+    if (!trace_path.empty() && !Tracer::instance().writeChromeTrace(trace_path)) {
+        return 1;
     }
     return 0;
 }
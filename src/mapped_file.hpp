@@ -0,0 +1,90 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only view of a whole file, mapped with mmap or MapViewOfFile. isOpen is false when the file cannot be
+// opened or mapped, or is empty.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+    #ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) return;
+        data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data != nullptr) {
+            size = static_cast<size_t>(file_size.QuadPart);
+        }
+    #else
+        descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return;
+        struct stat file_stat {};
+        if (fstat(descriptor, &file_stat) != 0 || file_stat.st_size == 0) return;
+        void *mapped = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapped == MAP_FAILED) return;
+        // the file is read once from start to end
+        madvise(mapped, static_cast<size_t>(file_stat.st_size), MADV_SEQUENTIAL);
+        data = static_cast<const uint8_t *>(mapped);
+        size = static_cast<size_t>(file_stat.st_size);
+    #endif
+    }
+
+    ~MappedFile() {
+    #ifdef _WIN32
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    #else
+        if (data != nullptr) munmap(const_cast<uint8_t *>(data), size);
+        if (descriptor >= 0) close(descriptor);
+    #endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    [[nodiscard]]
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    [[nodiscard]]
+    const uint8_t *getData() const {
+        return data;
+    }
+
+    [[nodiscard]]
+    size_t getSize() const {
+        return size;
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+};
+
+#endif
@@ -1,46 +1,97 @@
 #ifndef OBJECT_HPP
 #define OBJECT_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
 #include "utils.hpp"
 
-constexpr int32_t N = 5e5;
 constexpr float GRAVITY = 50.0f;
+constexpr float VELOCITY_DAMPING = 40.0f;
+constexpr float WORLD_MARGIN = 2.0f;
+// a particle staying within SLEEP_DISTANCE of the same point for SLEEP_STEPS sub steps falls asleep
+constexpr float SLEEP_DISTANCE = 0.05f;
+constexpr int32_t SLEEP_STEPS = 64;
+
+// 0xRRGGBBAA, the layout of sf::Color::toInteger, from channels in [0, 255]
+inline uint32_t packColor(const float r, const float g, const float b, const float a = 255.0f) {
+    const auto channel = [](const float value) {
+        return static_cast<uint32_t>(std::clamp(value, 0.0f, 255.0f));
+    };
+    return channel(r) << 24 | channel(g) << 16 | channel(b) << 8 | channel(a);
+}
+
+inline uint8_t getRed(const uint32_t color) {
+    return static_cast<uint8_t>(color >> 24);
+}
 
+inline uint8_t getGreen(const uint32_t color) {
+    return static_cast<uint8_t>(color >> 16);
+}
+
+inline uint8_t getBlue(const uint32_t color) {
+    return static_cast<uint8_t>(color >> 8);
+}
+
+// Host particle storage shared by every backend, structure of arrays with one entry per particle.
+// Device backends keep their own copies and synchronize them once per frame. The simulation arrays come first;
+// the render attributes after them are never read by the physics and are kept as compact as possible.
 struct Object {
     Object() = default;
 
-#ifdef USE_CPU
-    explicit Object(const float pos_x = 0.0f, const float pos_y = 0.0f, const float vel_x = 0.0f, const float vel_y = 0.0f, const float r = 0.5f, const float red = 255.0f, const float green = 255.0f, const float blue = 255.0f)
-        : position_x(pos_x)
-        , position_y(pos_y)
-        , last_position_x(pos_x - vel_x)
-        , last_position_y(pos_y - vel_y)
-        , acceleration_x(0.0f)
-        , acceleration_y(GRAVITY)
-        , radius(r)
-        , color_r(red)
-        , color_g(green)
-        , color_b(blue)
-    {}
-
-    float position_x{}, position_y{};
-    float last_position_x{}, last_position_y{};
-    float acceleration_x{}, acceleration_y{};
-    float radius{};
-    float color_r{}, color_g{}, color_b{};
-#elif defined USE_GPU
-    float position_x[N]{0.0f}, position_y[N]{0.0f};
-    float last_position_x[N]{0.0f}, last_position_y[N]{0.0f};
-    float radius[N]{0.5f};
-    float color_r[N]{255.0f}, color_g[N]{255.0f}, color_b[N]{255.0f};
+    std::vector<float> position_x, position_y;
+    std::vector<float> last_position_x, last_position_y;
+    std::vector<float> radius;
+    std::vector<float> sleep_anchor_x, sleep_anchor_y; // position when the particle last moved further than the sleep distance
+    std::vector<int32_t> still_steps; // sub steps spent near the sleep anchor, asleep once it reaches the sleep steps
+    std::vector<uint32_t> color; // packed, see packColor
+    std::vector<uint32_t> generation; // copies in handle order only: generation of each handle, see PhysicsHandler::getHandleGenerations
     int32_t size = 0;
+    int32_t ghost_count = 0; // copies of particles owned elsewhere, after the first size, see PhysicsHandler::addGhosts
+    uint64_t layout_version = 0; // changes whenever particles are created, removed or reordered, for caches indexed by particle
+    float max_radius = 0.0f; // largest radius ever created, decides the grid levels
     float acceleration_x = 0.0f, acceleration_y = GRAVITY;
-    bool device_allocated = false;
 
-    float *d_position_x = nullptr, *d_position_y = nullptr;
-    float *d_last_position_x = nullptr, *d_last_position_y = nullptr;
-    float *d_radius = nullptr;
-#endif
+    // capacity of every array, so creating up to count particles does not reallocate
+    void reserve(const int32_t count) {
+        for (std::vector<float> *values : {&position_x, &position_y, &last_position_x, &last_position_y, &radius, &sleep_anchor_x, &sleep_anchor_y}) {
+            values->reserve(count);
+        }
+        still_steps.reserve(count);
+        color.reserve(count);
+    }
+
+    // size of every array, size itself is left to the caller
+    void resize(const int32_t count) {
+        for (std::vector<float> *values : {&position_x, &position_y, &last_position_x, &last_position_y, &radius, &sleep_anchor_x, &sleep_anchor_y}) {
+            values->resize(count);
+        }
+        still_steps.resize(count);
+        color.resize(count);
+    }
+};
+
+// Particles created together by PhysicsHandler::createObjects, structure of arrays of the same length.
+// Velocities are displacements per update, like createObject's.
+struct ObjectBatch {
+    std::vector<float> position_x, position_y;
+    std::vector<float> velocity_x, velocity_y;
+    std::vector<float> radius;
+    std::vector<uint32_t> color; // packed, see packColor
+
+    [[nodiscard]]
+    int32_t size() const {
+        return static_cast<int32_t>(position_x.size());
+    }
+
+    void resize(const int32_t count) {
+        for (std::vector<float> *values : {&position_x, &position_y, &velocity_x, &velocity_y, &radius}) {
+            values->resize(count);
+        }
+        color.resize(count);
+    }
 };
 
 #endif
@@ -1,78 +1,13 @@
 ﻿#include <cuda_runtime.h>
 #include <device_launch_parameters.h>
-#include <cassert>
-// #include <__msvc_ostream.hpp>
-#include <iostream>
-#include <fstream>
+#include <thrust/execution_policy.h>
+#include <thrust/scan.h>
+#include <cmath>
+#include <memory>
 
 #include "utils.hpp"
 #include "object.hpp"
-
-#ifdef USE_GPU
-
-#ifdef OUTPUT_RESULTS
-extern std::ofstream output_file;
-#endif
-extern int32_t particle_min_count;
-
-constexpr int num_cell = 16;
-struct Grids_Cuda {
-    int32_t *grid_index;
-    int32_t *object_index;
-    int32_t *object_counts;
-    int32_t grid_count;
-} grids;
-
-void Object_initDeviceMemory(Object *objects) {
-    if (objects->device_allocated) return;
-    cudaMalloc(&objects->d_position_x,      sizeof(float) * N);
-    cudaMalloc(&objects->d_position_y,      sizeof(float) * N);
-    cudaMalloc(&objects->d_last_position_x, sizeof(float) * N);
-    cudaMalloc(&objects->d_last_position_y, sizeof(float) * N);
-    cudaMalloc(&objects->d_radius,          sizeof(float) * N);
-    objects->device_allocated = true;
-}
-
-void Object_freeDeviceMemory(Object *objects) {
-    if (!objects->device_allocated) return;
-    cudaFree(objects->d_position_x);
-    cudaFree(objects->d_position_y);
-    cudaFree(objects->d_last_position_x);
-    cudaFree(objects->d_last_position_y);
-    cudaFree(objects->d_radius);
-    objects->device_allocated = false;
-}
-
-void Grids_initDeviceMemory(const int32_t world_width, const int32_t world_height) {
-    const int32_t size = world_width * world_height;
-    cudaMalloc(&grids.grid_index, sizeof(int32_t) * size);
-    cudaMalloc(&grids.object_index, sizeof(int32_t) * size * num_cell);
-    cudaMalloc(&grids.object_counts, sizeof(int32_t) * size);
-    grids.grid_count = size;
-}
-
-void Grids_freeDeviceMemory() {
-    cudaFree(grids.grid_index);
-    cudaFree(grids.object_index);
-    cudaFree(grids.object_counts);
-}
-
-void objectCopyToDevice(const Object *objects) {
-    if (!objects->device_allocated) return;
-    cudaMemcpy(objects->d_position_x,      objects->position_x,      sizeof(float) * objects->size, cudaMemcpyHostToDevice);
-    cudaMemcpy(objects->d_position_y,      objects->position_y,      sizeof(float) * objects->size, cudaMemcpyHostToDevice);
-    cudaMemcpy(objects->d_last_position_x, objects->last_position_x, sizeof(float) * objects->size, cudaMemcpyHostToDevice);
-    cudaMemcpy(objects->d_last_position_y, objects->last_position_y, sizeof(float) * objects->size, cudaMemcpyHostToDevice);
-    cudaMemcpy(objects->d_radius,          objects->radius,          sizeof(float) * objects->size, cudaMemcpyHostToDevice);
-}
-
-void objectCopyToHost(Object *objects) {
-    if (!objects->device_allocated) return;
-    cudaMemcpy(objects->position_x,      objects->d_position_x,      sizeof(float) * objects->size, cudaMemcpyDeviceToHost);
-    cudaMemcpy(objects->position_y,      objects->d_position_y,      sizeof(float) * objects->size, cudaMemcpyDeviceToHost);
-    cudaMemcpy(objects->last_position_x, objects->d_last_position_x, sizeof(float) * objects->size, cudaMemcpyDeviceToHost);
-    cudaMemcpy(objects->last_position_y, objects->d_last_position_y, sizeof(float) * objects->size, cudaMemcpyDeviceToHost);
-}
+#include "simulation_backend.hpp"
 
 __global__ void updateObjects_kernel(
     float *position_x, float *position_y,
@@ -85,11 +20,11 @@ __global__ void updateObjects_kernel(
     if (idx >= size) return;
     const float last_movement_x = position_x[idx] - last_position_x[idx];
     const float last_movement_y = position_y[idx] - last_position_y[idx];
-    constexpr float velocity_damping = 40.0f;
+    constexpr float velocity_damping = VELOCITY_DAMPING;
     float new_position_x = position_x[idx] + last_movement_x + (acceleration_x - last_movement_x * velocity_damping) * (delta_time * delta_time);
     float new_position_y = position_y[idx] + last_movement_y + (acceleration_y - last_movement_y * velocity_damping) * (delta_time * delta_time);
 
-    constexpr float margin = 2.0f;
+    constexpr float margin = WORLD_MARGIN;
     if (new_position_x < margin + radius[idx])                     { new_position_x = margin + radius[idx]; }
     else if (new_position_x > world_size_x - margin - radius[idx]) { new_position_x = world_size_x - margin - radius[idx]; }
     if (new_position_y < margin + radius[idx])                     { new_position_y = margin + radius[idx]; }
@@ -108,30 +43,40 @@ __global__ void initGridCounts_kernel(int32_t *object_counts, const int grid_cou
     }
 }
 
-__global__ void assignObjectsToGrid_kernel(
+__global__ void countObjectsPerGrid_kernel(
     const float *position_x, const float *position_y,
     const int object_count,
+    const float inverse_cell_size,
     const int world_width,
     const int world_height,
-    int32_t *object_index,
+    int32_t *object_cell,
     int32_t *object_counts
 ) {
     const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
     if (i >= object_count) return;
-    const int grid_x = static_cast<int>(floorf(position_x[i]));
-    const int grid_y = static_cast<int>(floorf(position_y[i]));
-    if (grid_x < 0 || grid_x >= world_width || grid_y < 0 || grid_y >= world_height) return;
+    const int grid_x = min(max(static_cast<int>(floorf(position_x[i] * inverse_cell_size)), 0), world_width - 1);
+    const int grid_y = min(max(static_cast<int>(floorf(position_y[i] * inverse_cell_size)), 0), world_height - 1);
     // const int target_idx = grid_y * world_width + grid_x;
     const int target_idx = grid_x * world_height + grid_y;
-    const int offset = atomicAdd(&object_counts[target_idx], 1);
-    if (offset < num_cell) {
-        object_index[target_idx * num_cell + offset] = static_cast<int>(i);
-    }
+    object_cell[i] = target_idx;
+    atomicAdd(&object_counts[target_idx], 1);
+}
+
+__global__ void scatterObjectsToGrid_kernel(
+    const int32_t *object_cell,
+    const int object_count,
+    int32_t *cell_cursor,
+    int32_t *object_index
+) {
+    const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= object_count) return;
+    const int offset = atomicAdd(&cell_cursor[object_cell[i]], 1);
+    object_index[offset] = static_cast<int>(i);
 }
 
 __global__ void solveCollisions_kernel(
     float *position_x, float *position_y, const float *radius,
-    const int32_t *object_index, const int32_t *object_counts,
+    const int32_t *object_index, const int32_t *object_counts, const int32_t *cell_start,
     const int grid_count, const int world_width, const int world_height
 ) {
     const int grid_idx = blockIdx.x * blockDim.x + threadIdx.x;
@@ -141,6 +86,7 @@ __global__ void solveCollisions_kernel(
     const int grid_x = grid_idx / world_height;
     const int grid_y = grid_idx % world_height;
     const int count1 = object_counts[grid_idx];
+    const int start1 = cell_start[grid_idx];
     for (int dy = -1; dy <= 1; ++dy) {
         for (int dx = -1; dx <= 1; ++dx) {
             const int nx = grid_x + dx;
@@ -149,10 +95,11 @@ __global__ void solveCollisions_kernel(
             // int nidx = ny * world_width + nx;
             int nidx = nx * world_height + ny;
             int count2 = object_counts[nidx];
+            int start2 = cell_start[nidx];
             for (int i = 0; i < count1; ++i) {
-                int obj1 = object_index[grid_idx * num_cell + i];
+                int obj1 = object_index[start1 + i];
                 for (int j = 0; j < count2; ++j) {
-                    int obj2 = object_index[nidx * num_cell + j];
+                    int obj2 = object_index[start2 + j];
                     if (obj1 >= 0 && obj2 >= 0 && obj1 != obj2) {
                         float dx = position_x[obj1] - position_x[obj2];
                         float dy = position_y[obj1] - position_y[obj2];
@@ -175,85 +122,196 @@ __global__ void solveCollisions_kernel(
     }
 }
 
-void solveCollisions(const Object *objects, const int32_t *object_index, const int32_t *object_counts, const int grid_count, const int world_width, const int world_height) {
-    // int blockSize = 128;
-    int gridSize = (grid_count + gpu_block_size - 1) / gpu_block_size;
-    solveCollisions_kernel<<<gridSize, gpu_block_size>>>(
-        objects->d_position_x, objects->d_position_y, objects->d_radius,
-        object_index, object_counts,
-        grid_count, world_width, world_height
-    );
-    // cudaDeviceSynchronize();
-}
+// Keeps the particles and the grid on the device. Positions are uploaded in beginFrame and downloaded
+// in endFrame, the sub steps in between only queue kernels. The grid has a single level whose cells cover
+// the largest diameter, mixed radii are correct but every particle is binned at the coarsest cell size.
+class CudaBackend : public SimulationBackend {
+public:
+    explicit CudaBackend(const V2f world_size)
+        : world_size_x(world_size.x)
+        , world_size_y(world_size.y)
+    {
+        resizeGrid(1.0f);
+        cudaEventCreate(&frame_start);
+        cudaEventCreate(&frame_end);
+    }
 
-void updateObjects(const Object *objects, const float delta_time, const float world_size_x, const float world_size_y) {
-    const int size = objects->size;
-    // int blockSize = 256;
-    int gridSize = (size + gpu_block_size - 1) / gpu_block_size;
-    updateObjects_kernel<<<gridSize, gpu_block_size>>>(
-        objects->d_position_x, objects->d_position_y,
-        objects->d_last_position_x, objects->d_last_position_y,
-        objects->acceleration_x, objects->acceleration_y,
-        objects->d_radius,
-        size, delta_time, world_size_x, world_size_y
-    );
-    // cudaDeviceSynchronize();
-}
+    ~CudaBackend() override {
+        freeObjectBuffers();
+        freeGridBuffers();
+        cudaEventDestroy(frame_start);
+        cudaEventDestroy(frame_end);
+    }
 
-void updateGrids(const Object *objects, const int world_width, const int world_height) {
-    const int grid_count = grids.grid_count;
-    // int blockSize = 256;
-    int gridSize = (grid_count + gpu_block_size - 1) / gpu_block_size;
-    initGridCounts_kernel<<<gridSize, gpu_block_size>>>(grids.object_counts, grid_count);
-    // cudaDeviceSynchronize();
+    CudaBackend(const CudaBackend &) = delete;
+    CudaBackend &operator=(const CudaBackend &) = delete;
 
-    int object_count = objects->size;
-    gridSize = (object_count + gpu_block_size - 1) / gpu_block_size;
-    assignObjectsToGrid_kernel<<<gridSize, gpu_block_size>>>(
-        objects->d_position_x, objects->d_position_y,
-        object_count,
-        world_width,
-        world_height,
-        grids.object_index,
-        grids.object_counts
-    );
-    // cudaDeviceSynchronize();
-}
+    [[nodiscard]]
+    BackendType getType() const override {
+        return BackendType::CUDA;
+    }
+
+    void beginFrame(Object &objects) override {
+        reserveObjectBuffers(objects.size);
+        const size_t bytes = sizeof(float) * objects.size;
+        cudaMemcpy(d_position_x,      objects.position_x.data(),      bytes, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_position_y,      objects.position_y.data(),      bytes, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_last_position_x, objects.last_position_x.data(), bytes, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_last_position_y, objects.last_position_y.data(), bytes, cudaMemcpyHostToDevice);
+        cudaMemcpy(d_radius,          objects.radius.data(),          bytes, cudaMemcpyHostToDevice);
+        cudaEventRecord(frame_start, nullptr);
+    }
+
+    void endFrame(Object &objects) override {
+        cudaEventRecord(frame_end, nullptr);
+        cudaEventSynchronize(frame_end);
+        float elapsed_time = 0.0f;
+        cudaEventElapsedTime(&elapsed_time, frame_start, frame_end);
+        last_device_time = elapsed_time * 1000.0f;
+
+        const size_t bytes = sizeof(float) * objects.size;
+        cudaMemcpy(objects.position_x.data(),      d_position_x,      bytes, cudaMemcpyDeviceToHost);
+        cudaMemcpy(objects.position_y.data(),      d_position_y,      bytes, cudaMemcpyDeviceToHost);
+        cudaMemcpy(objects.last_position_x.data(), d_last_position_x, bytes, cudaMemcpyDeviceToHost);
+        cudaMemcpy(objects.last_position_y.data(), d_last_position_y, bytes, cudaMemcpyDeviceToHost);
+    }
+
+    void updateObjects(Object &objects, const float delta_time, const V2f world_size) override {
+        const int size = objects.size;
+        if (size <= 0) return;
+        const int grid_size = (size + gpu_block_size - 1) / gpu_block_size;
+        updateObjects_kernel<<<grid_size, gpu_block_size>>>(
+            d_position_x, d_position_y,
+            d_last_position_x, d_last_position_y,
+            objects.acceleration_x, objects.acceleration_y,
+            d_radius,
+            size, delta_time, world_size.x, world_size.y
+        );
+    }
+
+    void updateGrids(const Object &objects) override {
+        float required_cell_size = 1.0f;
+        while (2.0f * objects.max_radius > required_cell_size) {
+            required_cell_size *= 2.0f;
+        }
+        if (required_cell_size != cell_size) {
+            resizeGrid(required_cell_size);
+        }
+
+        int grid_size = (grid_count + gpu_block_size - 1) / gpu_block_size;
+        initGridCounts_kernel<<<grid_size, gpu_block_size>>>(object_counts, grid_count);
+
+        const int object_count = objects.size;
+        if (object_count <= 0) return;
+        grid_size = (object_count + gpu_block_size - 1) / gpu_block_size;
+        countObjectsPerGrid_kernel<<<grid_size, gpu_block_size>>>(
+            d_position_x, d_position_y,
+            object_count,
+            1.0f / cell_size,
+            world_width,
+            world_height,
+            object_cell,
+            object_counts
+        );
+
+        thrust::exclusive_scan(thrust::device, object_counts, object_counts + grid_count, cell_start);
+        cudaMemcpy(cell_cursor, cell_start, sizeof(int32_t) * grid_count, cudaMemcpyDeviceToDevice);
+
+        scatterObjectsToGrid_kernel<<<grid_size, gpu_block_size>>>(
+            object_cell,
+            object_count,
+            cell_cursor,
+            object_index
+        );
+    }
 
-extern void updatePhysics(Object *objects, const float sub_delta_time, const float sub_steps, const float world_size_x, const float world_size_y) {
-    if (objects->size < 0) return;
-    objectCopyToDevice(objects);
+    void solveCollisions(Object &objects) override {
+        if (objects.size <= 0) return;
+        const int grid_size = (grid_count + gpu_block_size - 1) / gpu_block_size;
+        solveCollisions_kernel<<<grid_size, gpu_block_size>>>(
+            d_position_x, d_position_y, d_radius,
+            object_index, object_counts, cell_start,
+            grid_count, world_width, world_height
+        );
+    }
 
-#ifdef OUTPUT_RESULTS
-    cudaEvent_t start, end;
-    float elapsedTime = 0.0f;
+    void synchronize() override {
+        cudaDeviceSynchronize();
+    }
 
-    cudaEventCreate(&start);
-    cudaEventCreate(&end);
+    [[nodiscard]]
+    float getLastDeviceTime() const override {
+        return last_device_time;
+    }
 
-    cudaEventRecord(start, nullptr);
-#endif
+private:
+    void resizeGrid(const float _cell_size) {
+        freeGridBuffers();
+        cell_size = _cell_size;
+        world_width  = static_cast<int>(std::ceil(world_size_x / cell_size));
+        world_height = static_cast<int>(std::ceil(world_size_y / cell_size));
+        grid_count = world_width * world_height;
+        cudaMalloc(&object_counts, sizeof(int32_t) * grid_count);
+        cudaMalloc(&cell_start, sizeof(int32_t) * grid_count);
+        cudaMalloc(&cell_cursor, sizeof(int32_t) * grid_count);
+    }
 
-    for (int i = 0; i < static_cast<int>(sub_steps); ++i) {
-        updateObjects(objects, sub_delta_time, world_size_x, world_size_y);
-        updateGrids(objects, static_cast<int>(world_size_x), static_cast<int>(world_size_y));
-        solveCollisions(objects, grids.object_index, grids.object_counts, grids.grid_count, static_cast<int>(world_size_x), static_cast<int>(world_size_y));
+    void freeGridBuffers() {
+        if (grid_count == 0) return;
+        cudaFree(object_counts);
+        cudaFree(cell_start);
+        cudaFree(cell_cursor);
+        grid_count = 0;
     }
 
-#ifdef OUTPUT_RESULTS
-    cudaEventRecord(end, nullptr);
-    cudaEventSynchronize(end);
+    // object buffers grow by doubling, so adding particles every frame does not reallocate every frame
+    void reserveObjectBuffers(const int32_t size) {
+        if (size <= capacity) return;
+        freeObjectBuffers();
+        capacity = std::max(size, std::max(capacity * 2, 1024));
+        cudaMalloc(&d_position_x,      sizeof(float) * capacity);
+        cudaMalloc(&d_position_y,      sizeof(float) * capacity);
+        cudaMalloc(&d_last_position_x, sizeof(float) * capacity);
+        cudaMalloc(&d_last_position_y, sizeof(float) * capacity);
+        cudaMalloc(&d_radius,          sizeof(float) * capacity);
+        cudaMalloc(&object_cell,       sizeof(int32_t) * capacity);
+        cudaMalloc(&object_index,      sizeof(int32_t) * capacity);
+    }
 
-    cudaEventElapsedTime(&elapsedTime, start, end);
-    if (objects->size > particle_min_count) {
-        output_file << elapsedTime * 1000 << ",";
+    void freeObjectBuffers() {
+        if (capacity == 0) return;
+        cudaFree(d_position_x);
+        cudaFree(d_position_y);
+        cudaFree(d_last_position_x);
+        cudaFree(d_last_position_y);
+        cudaFree(d_radius);
+        cudaFree(object_cell);
+        cudaFree(object_index);
+        capacity = 0;
     }
 
-    cudaEventDestroy(start);
-    cudaEventDestroy(end);
-#endif
+    float world_size_x, world_size_y;
+    float cell_size = 0.0f;
+    int world_width = 0, world_height = 0, grid_count = 0;
+    int32_t capacity = 0;
+    float *d_position_x = nullptr, *d_position_y = nullptr;
+    float *d_last_position_x = nullptr, *d_last_position_y = nullptr;
+    float *d_radius = nullptr;
+    // counting sort layout: the particles of cell c are object_index[cell_start[c], cell_start[c] + object_counts[c])
+    int32_t *object_cell = nullptr;
+    int32_t *object_index = nullptr;
+    int32_t *object_counts = nullptr;
+    int32_t *cell_start = nullptr;
+    int32_t *cell_cursor = nullptr;
+    cudaEvent_t frame_start = nullptr, frame_end = nullptr;
+    float last_device_time = 0.0f;
+};
 
-    objectCopyToHost(objects);
+bool isCudaAvailable() {
+    int device_count = 0;
+    return cudaGetDeviceCount(&device_count) == cudaSuccess && device_count > 0;
 }
 
-#endif
+std::unique_ptr<SimulationBackend> createCudaBackend(const V2f world_size) {
+    return std::make_unique<CudaBackend>(world_size);
+}
@@ -2,60 +2,227 @@
 #define PHYSICS_HANDLER_HPP
 
 #include <SFML/System/Vector2.hpp>
+#include <algorithm>
 #include <vector>
 #include <omp.h>
 #include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <utility>
 
-#include "grid_helper.hpp"
+#include "backend_factory.hpp"
+#include "checkpoint.hpp"
+#include "constraints.hpp"
 #include "object.hpp"
+#include "radix_sort.hpp"
+#include "simulation_backend.hpp"
+#include "tracing.hpp"
 #include "utils.hpp"
 
-#ifdef USE_GPU
-extern void Object_initDeviceMemory(Object *objects);
-extern void Object_freeDeviceMemory(Object *objects);
-extern void Grids_initDeviceMemory(int32_t world_width, int32_t world_height);
-extern void Grids_freeDeviceMemory();
-extern void updatePhysics(Object *objects, float sub_delta_time, float sub_steps, float world_size_x, float world_size_y);
-#endif
+// elapsed time of each phase of one sub step, in microseconds
+struct SubStepTimings {
+    float integrate_time  = 0.0f;
+    float constraint_time = 0.0f;
+    float grid_time       = 0.0f;
+    float collision_time  = 0.0f;
+};
+
+// Limits and targets of the adaptive sub step count, see PhysicsHandler::setAdaptiveSubSteps. The targets are
+// relative to the smallest radius.
+struct AdaptiveSubSteps {
+    int32_t min_sub_steps = 2;
+    int32_t max_sub_steps = 32;
+    float max_displacement = 1.0f;  // largest movement of a particle during one sub step
+    float max_overlap      = 0.5f;  // deepest overlap met by the collision pass of the last sub step
+    int32_t calm_frames    = 30;    // updates in a row well below both targets before lowering the sub steps
+};
+
+// errors measured after the last sub step of an update, relative to the smallest radius
+struct SubStepError {
+    float displacement = 0.0f;
+    float overlap      = 0.0f; // 0 when the backend does not measure it (CUDA)
+};
 
 class PhysicsHandler {
 public:
-    explicit PhysicsHandler(const V2f size)
+    explicit PhysicsHandler(const V2f size, const BackendType backend_type = BackendType::SIMD, const GridType _grid_type = GridType::Dense)
         : world_size(size)
-    #ifdef USE_CPU
-        , grid_helper(static_cast<int32_t>(size.x), static_cast<int32_t>(size.y))
-    #endif
-    {
-    #ifdef USE_GPU
-        objects = new Object();
-        Object_initDeviceMemory(objects);
-        Grids_initDeviceMemory(static_cast<int32_t>(size.x), static_cast<int32_t>(size.y));
-    #endif
+        , grid_type(_grid_type)
+        , backend(createBackend(backend_type, size, _grid_type))
+    {}
+
+    // returns a handle that stays valid when particles are reordered, see getObjectIndex, or -1 at the object limit
+    [[nodiscard]]
+    int32_t createObject(const float pos_x, const float pos_y, const float vel_x = 0.0f, const float vel_y = 0.0f, const float radius = 0.5f, const float color_r = 255.0f, const float color_g = 255.0f, const float color_b = 255.0f) {
+        if (object_limit > 0 && objects.size >= object_limit) return -1;
+        clearGhosts();
+        objects.position_x.push_back(pos_x);
+        objects.position_y.push_back(pos_y);
+        objects.last_position_x.push_back(pos_x - vel_x);
+        objects.last_position_y.push_back(pos_y - vel_y);
+        objects.radius.push_back(radius);
+        objects.max_radius = std::max(objects.max_radius, radius);
+        objects.sleep_anchor_x.push_back(pos_x);
+        objects.sleep_anchor_y.push_back(pos_y);
+        objects.still_steps.push_back(0);
+        objects.color.push_back(packColor(color_r, color_g, color_b));
+        index_to_handle.push_back(-1);
+        ++objects.layout_version;
+        return acquireHandle(objects.size++);
+    }
+
+    // Creates the particles of a batch in one pass, the arrays grow once and are filled in parallel. Only the
+    // particles below the object limit are created, from the start of the batch. When handles is given it
+    // receives the handle of each particle created. Returns the number created.
+    int32_t createObjects(const ObjectBatch &batch, int32_t *handles = nullptr) {
+        const int32_t first = objects.size;
+        int32_t count = batch.size();
+        if (object_limit > 0) {
+            count = std::min(count, std::max(0, object_limit - first));
+        }
+        if (count == 0) return 0;
+
+        clearGhosts();
+        objects.resize(first + count);
+        index_to_handle.resize(first + count);
+        for (int32_t i = 0; i < count; ++i) {
+            const int32_t handle = acquireHandle(first + i);
+            if (handles != nullptr) handles[i] = handle;
+        }
+        writeObjects(batch, first, count);
+        objects.size += count;
+        ++objects.layout_version;
+        return count;
     }
 
-    #ifdef USE_GPU
-    ~PhysicsHandler() {
-        Object_freeDeviceMemory(objects);
-        Grids_freeDeviceMemory();
+    // Ghosts are copies of particles owned by another PhysicsHandler, see DomainHandler. They are stored after
+    // the particles and are integrated and collided with them, but have no handle and are never constrained,
+    // reordered, compacted or saved, so replacing them leaves the layout version alone. Creating, removing or
+    // reordering particles drops them. Host backends only.
+    void addGhosts(const ObjectBatch &batch) {
+        const int32_t first = objects.size + objects.ghost_count;
+        const int32_t count = batch.size();
+        if (count == 0) return;
+        objects.resize(first + count);
+        writeObjects(batch, first, count);
+        objects.ghost_count += count;
+    }
+
+    // the arrays keep their capacity, so the next ghosts are written over the same memory
+    void clearGhosts() {
+        if (objects.ghost_count == 0) return;
+        objects.ghost_count = 0;
+        objects.resize(objects.size);
     }
-    #endif
 
     [[nodiscard]]
-    int32_t createObject(const float pos_x, const float pos_y, const float vel_x = 0.0f, const float vel_y = 0.0f, const float radius = 0.5f, const float color_r = 255.0f, const float color_g = 255.0f, const float color_b = 255.0f) {
-    #ifdef USE_CPU
-        objects.emplace_back(pos_x, pos_y, vel_x, vel_y, radius, color_r, color_g, color_b);
-        return static_cast<int32_t>(objects.size()) - 1;
-    #elif defined USE_GPU
-        objects->position_x[objects->size] = pos_x;
-        objects->position_y[objects->size] = pos_y;
-        objects->last_position_x[objects->size] = pos_x - vel_x;
-        objects->last_position_y[objects->size] = pos_y - vel_y;
-        objects->radius[objects->size] = radius;
-        objects->color_r[objects->size] = color_r;
-        objects->color_g[objects->size] = color_g;
-        objects->color_b[objects->size] = color_b;
-        return objects->size++;
-    #endif
+    int32_t getGhostCount() const {
+        return objects.ghost_count;
+    }
+
+    // Removes the particles of handles, free and repeated handles are skipped. The last particles move into the
+    // freed indices so the particles stay dense, and the freed handles go on a free list for the next particles
+    // created. Returns the number removed.
+    int32_t removeObjects(const int32_t *handles, const int32_t count) {
+        removed_indices.clear();
+        for (int32_t i = 0; i < count; ++i) {
+            const int32_t handle = handles[i];
+            if (!isLive(handle)) continue;
+            removed_indices.push_back(handle_to_index[handle]);
+            releaseHandle(handle);
+        }
+        std::sort(removed_indices.begin(), removed_indices.end());
+        return compactObjects();
+    }
+
+    // Creates the particles of a batch and links them as the batch says, see createObjects. Links to particles
+    // past the object limit are dropped. Returns the number of particles created.
+    int32_t createLinkedObjects(const LinkedBatch &batch, const float stiffness = 1.0f, int32_t *handles = nullptr) {
+        linked_handles.resize(batch.objects.size());
+        const int32_t count = createObjects(batch.objects, linked_handles.data());
+        for (size_t k = 0; k < batch.link_a.size(); ++k) {
+            const int32_t a = batch.link_a[k];
+            const int32_t b = batch.link_b[k];
+            if (a < count && b < count) {
+                addDistanceConstraint(linked_handles[a], linked_handles[b], stiffness);
+            }
+        }
+        if (handles != nullptr) std::copy_n(linked_handles.begin(), count, handles);
+        return count;
+    }
+
+    // Keeps the particles of two handles at their current distance, stiffness in [0, 1] is the fraction of the
+    // error corrected each sub step. The constraint goes away with either particle. CPU backends only.
+    bool addDistanceConstraint(const int32_t handle_a, const int32_t handle_b, const float stiffness = 1.0f) {
+        if (!isLive(handle_a) || !isLive(handle_b) || handle_a == handle_b) return false;
+        const int32_t a = handle_to_index[handle_a];
+        const int32_t b = handle_to_index[handle_b];
+        const float delta_x = objects.position_x[b] - objects.position_x[a];
+        const float delta_y = objects.position_y[b] - objects.position_y[a];
+        distance_constraints.add(handle_a, handle_b, std::sqrt(delta_x * delta_x + delta_y * delta_y), stiffness);
+        return true;
+    }
+
+    bool addDistanceConstraint(const int32_t handle_a, const int32_t handle_b, const float rest_length, const float stiffness) {
+        if (!isLive(handle_a) || !isLive(handle_b) || handle_a == handle_b) return false;
+        distance_constraints.add(handle_a, handle_b, std::max(0.0f, rest_length), stiffness);
+        return true;
+    }
+
+    void clearConstraints() {
+        distance_constraints.clear();
+    }
+
+    [[nodiscard]]
+    const DistanceConstraints &getDistanceConstraints() const {
+        return distance_constraints;
+    }
+
+    // passes over every constraint each sub step, more make long chains and cloth stiffer
+    void setConstraintIterations(const int32_t iterations) {
+        constraint_iterations = std::max(1, iterations);
+    }
+
+    [[nodiscard]]
+    int32_t getConstraintIterations() const {
+        return constraint_iterations;
+    }
+
+    bool removeObject(const int32_t handle) {
+        return removeObjects(&handle, 1) == 1;
+    }
+
+    // removes the particles whose center is inside the rectangle from min to max, returns the number removed
+    int32_t removeObjectsInRect(const V2f min, const V2f max) {
+        removed_indices.clear();
+        for (int32_t idx = 0; idx < objects.size; ++idx) {
+            const float x = objects.position_x[idx];
+            const float y = objects.position_y[idx];
+            if ((x >= min.x) & (x <= max.x) & (y >= min.y) & (y <= max.y)) {
+                removed_indices.push_back(idx);
+                releaseHandle(index_to_handle[idx]);
+            }
+        }
+        return compactObjects();
+    }
+
+    // room for count particles, so creating them does not reallocate in the middle of a run
+    void reserveObjects(const int32_t count) {
+        objects.reserve(count);
+        handle_to_index.reserve(count);
+        index_to_handle.reserve(count);
+        handle_generations.reserve(count);
+    }
+
+    // particles are no longer created past limit, 0 removes the limit
+    void setObjectLimit(const int32_t limit) {
+        object_limit = std::max(0, limit);
+    }
+
+    [[nodiscard]]
+    int32_t getObjectLimit() const {
+        return object_limit;
     }
 
     [[nodiscard]]
@@ -65,128 +232,545 @@ public:
 
     [[nodiscard]]
     int32_t getObjectsCount() const {
-    #ifdef USE_CPU
-        return static_cast<int32_t>(objects.size());
-    #elif defined USE_GPU
-        return objects->size;
-    #endif
+        return objects.size;
+    }
+
+    [[nodiscard]]
+    const Object *getObjects() const {
+        return &objects;
+    }
+
+    // current index in the particle arrays of the particle created with this handle, -1 once it is removed or
+    // for a handle that was never given out
+    [[nodiscard]]
+    int32_t getObjectIndex(const int32_t handle) const {
+        return isLive(handle) ? handle_to_index[handle] : -1;
+    }
+
+    // handles given out so far, live or free; handles are below it
+    [[nodiscard]]
+    int32_t getHandleCount() const {
+        return static_cast<int32_t>(handle_to_index.size());
+    }
+
+    // Bumped each time a handle gets or loses a particle, odd while it holds one. Copies in handle order tell
+    // a reused handle from the particle it held before by comparing it.
+    [[nodiscard]]
+    const uint32_t *getHandleGenerations() const {
+        return handle_generations.data();
+    }
+
+    // handle of the particle at each index
+    [[nodiscard]]
+    const int32_t *getObjectHandles() const {
+        return index_to_handle.data();
     }
 
-    #ifdef USE_CPU
-    Object &getObjectAoSAt(const int32_t idx) {
-        return objects[idx];
+    // nullptr when the backend does not build its grid on the host
+    [[nodiscard]]
+    const GridStats *getGridStats() const {
+        return backend->getGridStats();
+    }
+
+    // the CUDA backend falls back to the simd backend when no device is available, see getBackendType
+    void setBackend(const BackendType backend_type) {
+        if (backend_type == backend->getType()) return;
+        backend = createBackend(backend_type, world_size, grid_type);
+        backend->setSleeping(sleep_distance, sleep_steps);
+        backend->setNeighbourSkin(neighbour_skin);
+    }
+
+    [[nodiscard]]
+    BackendType getBackendType() const {
+        return backend->getType();
+    }
+
+    // the sparse grid only stores occupied cells, for large and mostly empty worlds (CPU backends only)
+    void setGridType(const GridType _grid_type) {
+        if (_grid_type == grid_type) return;
+        grid_type = _grid_type;
+        backend = createBackend(backend->getType(), world_size, grid_type);
+        backend->setSleeping(sleep_distance, sleep_steps);
+        backend->setNeighbourSkin(neighbour_skin);
+    }
+
+    // grid of the current backend, the CUDA backend always uses the dense grid
+    [[nodiscard]]
+    GridType getGridType() const {
+        return backend->getGridType();
+    }
+
+    // writes the particles, the world size and the sub steps, see checkpoint.hpp
+    bool saveCheckpoint(const std::string &path) const {
+        return writeCheckpoint(path, objects, index_to_handle, {world_size, sub_steps, getHandleCount()});
+    }
+
+    // Replaces every particle with the particles of a checkpoint, handles saved with them stay valid. The
+    // backend is recreated when the checkpoint was saved with another world size. Checkpoints hold no
+    // constraints, the current ones are removed. Nothing changes on failure.
+    bool loadCheckpoint(const std::string &path) {
+        CheckpointSettings settings;
+        Object loaded;
+        std::vector<int32_t> loaded_index_to_handle;
+        if (!readCheckpoint(path, loaded, loaded_index_to_handle, settings)) return false;
+        // handles given out before stay known, so their generations keep counting; the maps are built before
+        // anything is replaced
+        const int32_t handle_count = std::max(static_cast<int32_t>(handle_generations.size()), settings.handle_count);
+        std::vector<int32_t> loaded_handle_to_index(handle_count, -1);
+        for (int32_t idx = 0; idx < loaded.size; ++idx) {
+            loaded_handle_to_index[loaded_index_to_handle[idx]] = idx;
+        }
+        handle_generations.resize(handle_count, 0);
+        loaded.layout_version = objects.layout_version + 1;
+        objects = std::move(loaded);
+        index_to_handle.swap(loaded_index_to_handle);
+        handle_to_index.swap(loaded_handle_to_index);
+        distance_constraints.clear();
+        // every generation moves on, to the parity of the handle, so copies in handle order read every handle again
+        free_handles.clear();
+        for (int32_t handle = handle_count - 1; handle >= 0; --handle) {
+            const bool live = handle_to_index[handle] >= 0;
+            handle_generations[handle] += (handle_generations[handle] & 1u) == static_cast<uint32_t>(live) ? 2 : 1;
+            if (!live) free_handles.push_back(handle);
+        }
+        setSubSteps(settings.sub_steps);
+        frames_since_reorder = 0;
+        if (settings.world_size != world_size) {
+            world_size = settings.world_size;
+            backend = createBackend(backend->getType(), world_size, grid_type);
+            backend->setSleeping(sleep_distance, sleep_steps);
+            backend->setNeighbourSkin(neighbour_skin);
+        }
+        return true;
+    }
+
+    // particles staying within sleep_distance of the same point for sleep_steps sub steps stop being
+    // simulated until something pushes them, sleep_steps <= 0 disables sleeping (CPU backends only)
+    void setSleeping(const float _sleep_distance, const int32_t _sleep_steps) {
+        // the integration skips the sleep state while sleeping is off, so it starts over from here
+        if (sleep_steps <= 0 && _sleep_steps > 0) {
+            std::copy(objects.position_x.begin(), objects.position_x.end(), objects.sleep_anchor_x.begin());
+            std::copy(objects.position_y.begin(), objects.position_y.end(), objects.sleep_anchor_y.begin());
+            std::fill(objects.still_steps.begin(), objects.still_steps.end(), 0);
+        }
+        sleep_distance = _sleep_distance;
+        sleep_steps = std::max(0, _sleep_steps);
+        backend->setSleeping(sleep_distance, sleep_steps);
     }
-    #endif
 
-    #ifdef USE_GPU
     [[nodiscard]]
-    Object *getObjects() const {
-        return objects;
+    bool isSleeping() const {
+        return sleep_steps > 0;
+    }
+
+    // nullptr when sleeping is disabled or not supported by the backend
+    [[nodiscard]]
+    const SleepStats *getSleepStats() const {
+        return backend->getSleepStats();
+    }
+
+    // Solves collisions from neighbour lists of the particles within their radii plus skin of each other, kept
+    // over sub steps and frames until a particle moves more than half the skin; skin <= 0 rebuilds the grid
+    // every sub step instead. Ignored while sleeping is enabled and by the CUDA backend.
+    void setNeighbourSkin(const float skin) {
+        neighbour_skin = std::max(0.0f, skin);
+        backend->setNeighbourSkin(neighbour_skin);
+    }
+
+    [[nodiscard]]
+    float getNeighbourSkin() const {
+        return neighbour_skin;
+    }
+
+    // nullptr when the neighbour lists are not in use
+    [[nodiscard]]
+    const NeighbourListStats *getNeighbourListStats() const {
+        return backend->getNeighbourListStats();
+    }
+
+    // per thread busy time of the collision phases of the last update, nullptr for device backends
+    [[nodiscard]]
+    const WorkStats *getWorkStats() const {
+        return backend->getWorkStats();
+    }
+
+    // device time of the sub steps of the last update in microseconds, 0 for host backends
+    [[nodiscard]]
+    float getLastDeviceTime() const {
+        return backend->getLastDeviceTime();
+    }
+
+    [[nodiscard]]
+    int32_t getSubSteps() const {
+        return sub_steps;
+    }
+
+    void setSubSteps(const int32_t _sub_steps) {
+        sub_steps = std::max(1, _sub_steps);
+    }
+
+    // caps the sub steps an update runs, fixed or adaptive, for shedding load; 0 removes the cap
+    void setSubStepLimit(const int32_t limit) {
+        sub_step_limit = std::max(0, limit);
+    }
+
+    [[nodiscard]]
+    int32_t getSubStepLimit() const {
+        return sub_step_limit;
+    }
+
+    // When enabled, every update measures its error and picks the sub steps of the next update within the limits:
+    // more as soon as an error is above its target, fewer after calm_frames updates where both would have stayed
+    // well below it with fewer.
+    void setAdaptiveSubSteps(const bool enabled, const AdaptiveSubSteps &settings = {}) {
+        adaptive_sub_steps = enabled;
+        adaptive_settings = settings;
+        adaptive_settings.min_sub_steps = std::max(1, settings.min_sub_steps);
+        adaptive_settings.max_sub_steps = std::max(adaptive_settings.min_sub_steps, settings.max_sub_steps);
+        adaptive_settings.calm_frames   = std::max(1, settings.calm_frames);
+        calm_frames = 0;
+        if (enabled) {
+            sub_steps = std::clamp(sub_steps, adaptive_settings.min_sub_steps, adaptive_settings.max_sub_steps);
+        }
+    }
+
+    [[nodiscard]]
+    bool isAdaptiveSubSteps() const {
+        return adaptive_sub_steps;
+    }
+
+    // sub steps run by the last update, getSubSteps is the count of the next one
+    [[nodiscard]]
+    int32_t getLastSubSteps() const {
+        return last_sub_steps;
+    }
+
+    // only measured when the sub steps are adaptive
+    [[nodiscard]]
+    const SubStepError &getLastSubStepError() const {
+        return last_sub_step_error;
+    }
+
+    // when enabled, the phases of every sub step are timed, asynchronous backends are synchronized after each phase
+    void setProfiling(const bool enabled) {
+        profiling = enabled;
+    }
+
+    [[nodiscard]]
+    const std::vector<SubStepTimings> &getSubStepTimings() const {
+        return sub_step_timings;
+    }
+
+    // sorts the particles along a Morton curve of their cells every interval frames, 0 disables it
+    void setReorderInterval(const int32_t interval) {
+        reorder_interval = std::max(0, interval);
+    }
+
+    [[nodiscard]]
+    int32_t getReorderInterval() const {
+        return reorder_interval;
+    }
+
+    // elapsed time of the reordering done by the last update, 0 when it did not reorder, in microseconds
+    [[nodiscard]]
+    float getLastReorderTime() const {
+        return last_reorder_time;
+    }
+
+    // Sorts the particle arrays by the Morton code of their cell, so particles of neighbouring cells are
+    // close in memory. The handle maps follow the particles. Done by update every reorder interval, callers
+    // splitting a frame into several updates call it themselves, see DomainHandler.
+    void reorderObjects() {
+        clearGhosts();
+        const int32_t object_count = objects.size;
+        reorder_keys.resize(object_count);
+        reorder_indices.resize(object_count);
+        const auto max_x = static_cast<int32_t>(world_size.x) - 1;
+        const auto max_y = static_cast<int32_t>(world_size.y) - 1;
+        #pragma omp parallel for num_threads(cpu_threads)
+        for (int32_t idx = 0; idx < object_count; ++idx) {
+            const auto grid_x = static_cast<uint32_t>(std::clamp(static_cast<int32_t>(floorf(objects.position_x[idx])), 0, max_x));
+            const auto grid_y = static_cast<uint32_t>(std::clamp(static_cast<int32_t>(floorf(objects.position_y[idx])), 0, max_y));
+            reorder_keys[idx] = spreadBits(grid_x) | (spreadBits(grid_y) << 1);
+            reorder_indices[idx] = idx;
+        }
+        radix_sorter.sort(reorder_keys, reorder_indices);
+
+        permute(objects.position_x);
+        permute(objects.position_y);
+        permute(objects.last_position_x);
+        permute(objects.last_position_y);
+        permute(objects.radius);
+        permute(objects.sleep_anchor_x);
+        permute(objects.sleep_anchor_y);
+        permute(objects.still_steps);
+        permute(objects.color);
+        permute(index_to_handle);
+        for (int32_t idx = 0; idx < object_count; ++idx) {
+            handle_to_index[index_to_handle[idx]] = idx;
+        }
+        ++objects.layout_version;
     }
-    #endif
 
     void update(const float delta_time) {
-        constexpr float sub_steps = 8.0f;
-        const float sub_delta_time = delta_time / sub_steps;
-        #ifdef USE_CPU
-        for (int32_t i = 0; i < static_cast<int32_t>(sub_steps); ++i) {
-            updateObjects(sub_delta_time);
-            updateGrids();
-            solveCollisions();
+        PBD_TRACE_ZONE("update");
+        const int32_t step_count = sub_step_limit > 0 ? std::min(sub_steps, sub_step_limit) : sub_steps;
+        last_sub_steps = step_count;
+        const float sub_delta_time = delta_time / static_cast<float>(step_count);
+        last_reorder_time = 0.0f;
+        if (reorder_interval > 0 && ++frames_since_reorder >= reorder_interval) {
+            frames_since_reorder = 0;
+            const auto start = std::chrono::high_resolution_clock::now();
+            reorderObjects();
+            last_reorder_time = elapsedMicroseconds(start, std::chrono::high_resolution_clock::now());
+        }
+
+        const bool constrained = distance_constraints.size() > 0;
+        if (constrained) {
+            distance_constraints.prepare(handle_to_index, objects.layout_version);
+        }
+
+        backend->beginFrame(objects);
+        sub_step_timings.clear();
+        for (int32_t i = 0; i < step_count; ++i) {
+            if (profiling) {
+                SubStepTimings timings;
+                auto start = std::chrono::high_resolution_clock::now();
+                backend->updateObjects(objects, sub_delta_time, world_size);
+                backend->synchronize();
+                auto end = std::chrono::high_resolution_clock::now();
+                timings.integrate_time = elapsedMicroseconds(start, end);
+                start = end;
+                if (constrained) {
+                    backend->solveConstraints(objects, distance_constraints, constraint_iterations);
+                    backend->synchronize();
+                    end = std::chrono::high_resolution_clock::now();
+                    timings.constraint_time = elapsedMicroseconds(start, end);
+                    start = end;
+                }
+                backend->updateGrids(objects);
+                backend->synchronize();
+                end = std::chrono::high_resolution_clock::now();
+                timings.grid_time = elapsedMicroseconds(start, end);
+                start = end;
+                backend->solveCollisions(objects);
+                backend->synchronize();
+                end = std::chrono::high_resolution_clock::now();
+                timings.collision_time = elapsedMicroseconds(start, end);
+                sub_step_timings.push_back(timings);
+            } else {
+                backend->updateObjects(objects, sub_delta_time, world_size);
+                if (constrained) {
+                    backend->solveConstraints(objects, distance_constraints, constraint_iterations);
+                }
+                backend->updateGrids(objects);
+                backend->solveCollisions(objects);
+            }
+        }
+        backend->endFrame(objects);
+
+        if (adaptive_sub_steps) {
+            measureSubStepError();
+            adaptSubSteps();
         }
-        #elif defined USE_GPU
-            updatePhysics(objects, sub_delta_time, sub_steps, world_size.x, world_size.y);
-        #endif
     }
 
 
 private:
-    #ifdef USE_CPU
-    void solveCollisions() {
-        #pragma omp parallel for num_threads(cpu_threads)
-        for (int32_t idx = 0; idx < grid_helper.getGridsCount(); ++idx) {
-            if (grid_helper.getGridAt(idx).object_count <= 0) continue;
-            checkGridCollisions(idx, idx - 1);
-            checkGridCollisions(idx, idx);
-            checkGridCollisions(idx, idx + 1);
-            checkGridCollisions(idx, idx - grid_helper.getGridsHeightCount() - 1);
-            checkGridCollisions(idx, idx - grid_helper.getGridsHeightCount());
-            checkGridCollisions(idx, idx - grid_helper.getGridsHeightCount() + 1);
-            checkGridCollisions(idx, idx + grid_helper.getGridsHeightCount() - 1);
-            checkGridCollisions(idx, idx + grid_helper.getGridsHeightCount());
-            checkGridCollisions(idx, idx + grid_helper.getGridsHeightCount() + 1);
-        }
-    }
-
-    void checkGridCollisions(const int32_t grid1_idx, const int32_t grid2_idx) {
-        if (grid2_idx < 0 || grid2_idx >= grid_helper.getGridsCount()) {
+    static float elapsedMicroseconds(const std::chrono::high_resolution_clock::time_point start, const std::chrono::high_resolution_clock::time_point end) {
+        return std::chrono::duration<float, std::micro>(end - start).count();
+    }
+
+    void measureSubStepError() {
+        float max_displacement2 = 0.0f;
+        float min_radius = objects.max_radius;
+        const int32_t object_count = objects.size;
+        #pragma omp parallel for num_threads(cpu_threads) reduction(max: max_displacement2) reduction(min: min_radius)
+        for (int32_t idx = 0; idx < object_count; ++idx) {
+            const float movement_x = objects.position_x[idx] - objects.last_position_x[idx];
+            const float movement_y = objects.position_y[idx] - objects.last_position_y[idx];
+            max_displacement2 = std::max(max_displacement2, movement_x * movement_x + movement_y * movement_y);
+            min_radius = std::min(min_radius, objects.radius[idx]);
+        }
+        if (object_count == 0 || min_radius <= 0.0f) {
+            last_sub_step_error = {};
             return;
         }
+        last_sub_step_error.displacement = std::sqrt(max_displacement2) / min_radius;
+        last_sub_step_error.overlap      = backend->getLastMaxOverlap() / min_radius;
+    }
 
-        const Grid &grid1 = grid_helper.getGridAt(grid1_idx);
-        const Grid &grid2 = grid_helper.getGridAt(grid2_idx);
-
-        for (int i = 0; i < grid1.object_count; ++i) {
-            for (int j = 0; j < grid2.object_count; ++j) {
-                solveContact(grid1.object_idx[i], grid2.object_idx[j]);
+    // Both errors shrink about linearly with the sub step length. Raising is at most a doubling per update, so
+    // a single violent frame does not jump to the maximum. The errors are maxima over single contacts and vary a
+    // lot from frame to frame, so lowering waits for a run of calm updates, aims 20% below the targets from the
+    // worst update of the run and at most halves the sub steps.
+    void adaptSubSteps() {
+        const float ratio = std::max(last_sub_step_error.displacement / adaptive_settings.max_displacement,
+                                     last_sub_step_error.overlap / adaptive_settings.max_overlap);
+        int32_t next_sub_steps = sub_steps;
+        if (ratio > 1.0f) {
+            next_sub_steps = std::min(2 * sub_steps, static_cast<int32_t>(std::ceil(static_cast<float>(sub_steps) * ratio)));
+            calm_frames = 0;
+        } else if (sub_steps > 1 && ratio * static_cast<float>(sub_steps) / static_cast<float>(sub_steps - 1) < 0.8f) {
+            calm_ratio = calm_frames == 0 ? ratio : std::max(calm_ratio, ratio);
+            if (++calm_frames >= adaptive_settings.calm_frames) {
+                const auto wanted = static_cast<int32_t>(std::ceil(static_cast<float>(sub_steps) * calm_ratio / 0.8f));
+                next_sub_steps = std::clamp(wanted, (sub_steps + 1) / 2, sub_steps - 1);
+                calm_frames = 0;
             }
+        } else {
+            calm_frames = 0;
         }
+        sub_steps = std::clamp(next_sub_steps, adaptive_settings.min_sub_steps, adaptive_settings.max_sub_steps);
     }
 
-    void solveContact(const int32_t obj_idx1, const int32_t obj_idx2) {
-        const float delta_x = objects[obj_idx1].position_x - objects[obj_idx2].position_x;
-        const float delta_y = objects[obj_idx1].position_y - objects[obj_idx2].position_y;
-        const float dist2 = delta_x * delta_x + delta_y * delta_y;
-        const float dist = sqrt(dist2);
-        if (dist < objects[obj_idx1].radius + objects[obj_idx2].radius && dist > 1e-3f) {
-            constexpr float response_coef = 1.0f;
-            const float delta_dist = response_coef * 0.5f * (objects[obj_idx1].radius + objects[obj_idx2].radius - dist);
-            const float nx = delta_x / dist;
-            const float ny = delta_y / dist;
-            const float col_vec_x = nx * delta_dist;
-            const float col_vec_y = ny * delta_dist;
-            objects[obj_idx1].position_x += col_vec_x;
-            objects[obj_idx1].position_y += col_vec_y;
-            objects[obj_idx2].position_x -= col_vec_x;
-            objects[obj_idx2].position_y -= col_vec_y;
+    // a free handle, or a new one when none is free, for the particle at index
+    int32_t acquireHandle(const int32_t index) {
+        int32_t handle;
+        if (free_handles.empty()) {
+            handle = getHandleCount();
+            handle_to_index.push_back(index);
+            handle_generations.push_back(1);
+        } else {
+            handle = free_handles.back();
+            free_handles.pop_back();
+            handle_to_index[handle] = index;
+            ++handle_generations[handle];
         }
+        index_to_handle[index] = handle;
+        return handle;
     }
 
-    void updateObjects(const float delta_time) {
-        #pragma omp parallel for num_threads(cpu_threads)
-        for (int idx = 0; idx < objects.size(); ++idx) {
-            const float last_movement_x = objects[idx].position_x - objects[idx].last_position_x;
-            const float last_movement_y = objects[idx].position_y - objects[idx].last_position_y;
-            constexpr float velocity_damping = 40.0f;
-            float new_position_x = objects[idx].position_x + last_movement_x + (objects[idx].acceleration_x - last_movement_x * velocity_damping) * (delta_time * delta_time);
-            float new_position_y = objects[idx].position_y + last_movement_y + (objects[idx].acceleration_y - last_movement_y * velocity_damping) * (delta_time * delta_time);
+    [[nodiscard]]
+    bool isLive(const int32_t handle) const {
+        return handle >= 0 && handle < getHandleCount() && handle_to_index[handle] >= 0;
+    }
 
-            constexpr float margin = 2.0f;
-            if (new_position_x < margin + objects[idx].radius)                     { new_position_x = margin + objects[idx].radius; }
-            else if (new_position_x > world_size.x - margin - objects[idx].radius) { new_position_x = world_size.x - margin - objects[idx].radius; }
-            if (new_position_y < margin + objects[idx].radius)                     { new_position_y = margin + objects[idx].radius; }
-            else if (new_position_y > world_size.y - margin - objects[idx].radius) { new_position_y = world_size.y - margin - objects[idx].radius; }
+    void releaseHandle(const int32_t handle) {
+        handle_to_index[handle] = -1;
+        ++handle_generations[handle];
+        free_handles.push_back(handle);
+    }
 
-            objects[idx].last_position_x = objects[idx].position_x;
-            objects[idx].last_position_y = objects[idx].position_y;
-            objects[idx].position_x      = new_position_x;
-            objects[idx].position_y      = new_position_y;
+    // Fills the sorted removed_indices with the last particles that are kept, from the lowest hole up, then
+    // shrinks the arrays. Only as many particles move as were removed.
+    int32_t compactObjects() {
+        const auto removed_count = static_cast<int32_t>(removed_indices.size());
+        if (removed_count == 0) return 0;
+        clearGhosts();
+        if (removed_count > 0 && distance_constraints.size() > 0) {
+            distance_constraints.removeReleased(handle_to_index);
         }
+        int32_t end = objects.size;
+        int32_t tail = removed_count;
+        for (int32_t k = 0; k < tail; ++k) {
+            // removed particles at the end need no hole
+            while (tail > k && removed_indices[tail - 1] == end - 1) {
+                --tail;
+                --end;
+            }
+            if (tail == k) break;
+            moveObject(--end, removed_indices[k]);
+        }
+        objects.resize(end);
+        index_to_handle.resize(end);
+        objects.size = end;
+        ++objects.layout_version;
+        return removed_count;
+    }
+
+    // batch[0, count) into the particle arrays from first, the arrays already hold them
+    void writeObjects(const ObjectBatch &batch, const int32_t first, const int32_t count) {
+        float max_radius = objects.max_radius;
+        #pragma omp parallel for num_threads(cpu_threads) reduction(max: max_radius) if(count >= 4096)
+        for (int32_t i = 0; i < count; ++i) {
+            const int32_t idx = first + i;
+            const float pos_x = batch.position_x[i];
+            const float pos_y = batch.position_y[i];
+            objects.position_x[idx]      = pos_x;
+            objects.position_y[idx]      = pos_y;
+            objects.last_position_x[idx] = pos_x - batch.velocity_x[i];
+            objects.last_position_y[idx] = pos_y - batch.velocity_y[i];
+            objects.radius[idx]          = batch.radius[i];
+            objects.sleep_anchor_x[idx]  = pos_x;
+            objects.sleep_anchor_y[idx]  = pos_y;
+            objects.still_steps[idx]     = 0;
+            objects.color[idx]           = batch.color[i];
+            max_radius = std::max(max_radius, batch.radius[i]);
+        }
+        objects.max_radius = max_radius;
+    }
+
+    void moveObject(const int32_t from, const int32_t to) {
+        objects.position_x[to]      = objects.position_x[from];
+        objects.position_y[to]      = objects.position_y[from];
+        objects.last_position_x[to] = objects.last_position_x[from];
+        objects.last_position_y[to] = objects.last_position_y[from];
+        objects.radius[to]          = objects.radius[from];
+        objects.sleep_anchor_x[to]  = objects.sleep_anchor_x[from];
+        objects.sleep_anchor_y[to]  = objects.sleep_anchor_y[from];
+        objects.still_steps[to]     = objects.still_steps[from];
+        objects.color[to]           = objects.color[from];
+        const int32_t handle = index_to_handle[from];
+        index_to_handle[to] = handle;
+        handle_to_index[handle] = to;
+    }
+
+    // spreads the lower 16 bits of value to the even bits
+    static uint32_t spreadBits(uint32_t value) {
+        value &= 0x0000ffff;
+        value = (value | (value << 8)) & 0x00ff00ff;
+        value = (value | (value << 4)) & 0x0f0f0f0f;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
     }
 
-    void updateGrids() {
-        grid_helper.updateGrids(objects);
+    // new[i] = old[reorder_indices[i]]
+    template<typename T>
+    void permute(std::vector<T> &values) {
+        std::vector<T> permuted(values.size());
+        const auto count = static_cast<int32_t>(values.size());
+        #pragma omp parallel for num_threads(cpu_threads)
+        for (int32_t idx = 0; idx < count; ++idx) {
+            permuted[idx] = values[reorder_indices[idx]];
+        }
+        values.swap(permuted);
     }
-    #endif
 
 
     V2f world_size;
-    #ifdef USE_CPU
-    GridHelper grid_helper;
-    std::vector<Object> objects;
-    #elif defined USE_GPU
-    Object *objects = nullptr;
-    #endif
+    GridType grid_type;
+    int32_t sub_steps = 8;
+    int32_t last_sub_steps = 0;
+    int32_t sub_step_limit = 0;
+    bool adaptive_sub_steps = false;
+    AdaptiveSubSteps adaptive_settings;
+    SubStepError last_sub_step_error;
+    int32_t calm_frames = 0;
+    float calm_ratio = 0.0f; // largest error ratio of the current run of calm updates
+    bool profiling = false;
+    std::vector<SubStepTimings> sub_step_timings;
+    std::vector<int32_t> handle_to_index;
+    std::vector<int32_t> index_to_handle;
+    std::vector<uint32_t> handle_generations;
+    std::vector<int32_t> free_handles;
+    std::vector<int32_t> removed_indices;
+    std::unique_ptr<SimulationBackend> backend;
+    DistanceConstraints distance_constraints;
+    int32_t constraint_iterations = 1;
+    std::vector<int32_t> linked_handles;
+    float sleep_distance = SLEEP_DISTANCE;
+    int32_t sleep_steps = 0;
+    float neighbour_skin = 0.0f;
+    Object objects;
+    int32_t object_limit = 0;
+    int32_t reorder_interval = 0;
+    int32_t frames_since_reorder = 0;
+    float last_reorder_time = 0.0f;
+    RadixSorter radix_sorter;
+    std::vector<uint32_t> reorder_keys;
+    std::vector<int32_t> reorder_indices;
 };
 
 #endif
@@ -0,0 +1,173 @@
+#ifndef PHYSICS_THREAD_HPP
+#define PHYSICS_THREAD_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "object.hpp"
+#include "physics_handler.hpp"
+#include "tracing.hpp"
+
+// Runs PhysicsHandler::update on its own thread so a frame renders while the next one simulates. After the
+// updates started together the positions, radii, colors and handle generations are copied in handle order into
+// the back snapshot, free handles get a zero radius; wait makes it the front one and the former front the
+// previous one, so a renderer can interpolate between two physics states. The PhysicsHandler may only be used
+// between wait and the next start, the front and previous snapshots until the next wait.
+class PhysicsThread {
+public:
+    explicit PhysicsThread(PhysicsHandler &_physics_handler)
+        : physics_handler(_physics_handler)
+        , worker([this] { run(); })
+    {}
+
+    ~PhysicsThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        update_requested.notify_one();
+        worker.join();
+    }
+
+    PhysicsThread(const PhysicsThread &) = delete;
+    PhysicsThread &operator=(const PhysicsThread &) = delete;
+
+    // starts step_count updates of dt, the previous ones must have been waited for
+    void start(const float dt, const int32_t step_count = 1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            delta_time = dt;
+            steps = std::max(1, step_count);
+            back = 3 - front - previous;
+            updating = true;
+        }
+        update_requested.notify_one();
+    }
+
+    // waits for the update started last and publishes its snapshot, returns immediately when none is running
+    void wait() {
+        const auto wait_start = std::chrono::high_resolution_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!updating && !published) {
+            last_wait_time = 0.0f;
+            return;
+        }
+        update_finished.wait(lock, [this] { return !updating; });
+        last_wait_time = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - wait_start).count();
+        if (published) {
+            previous = front;
+            front = back;
+            published = false;
+        }
+    }
+
+    // particles after the last waited for updates
+    [[nodiscard]]
+    const Object &getSnapshot() const {
+        return snapshots[front];
+    }
+
+    // particles before them
+    [[nodiscard]]
+    const Object &getPreviousSnapshot() const {
+        return snapshots[previous];
+    }
+
+    // updates run between the previous and the front snapshot
+    [[nodiscard]]
+    int32_t getLastStepCount() const {
+        return last_step_count;
+    }
+
+    // duration of the last updates and snapshot copy, in microseconds
+    [[nodiscard]]
+    float getLastUpdateTime() const {
+        return last_update_time;
+    }
+
+    // time the last wait blocked, in microseconds
+    [[nodiscard]]
+    float getLastWaitTime() const {
+        return last_wait_time;
+    }
+
+private:
+    void run() {
+        PBD_TRACE_THREAD_NAME("physics");
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                update_requested.wait(lock, [this] { return updating || stopping; });
+                if (stopping) return;
+            }
+            const auto update_start = std::chrono::high_resolution_clock::now();
+            for (int32_t step = 0; step < steps; ++step) {
+                physics_handler.update(delta_time);
+            }
+            copySnapshot(snapshots[back]);
+            const float update_time = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - update_start).count();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                last_update_time = update_time;
+                last_step_count = steps;
+                published = true;
+                updating = false;
+            }
+            update_finished.notify_one();
+        }
+    }
+
+    // handle order keeps each particle at the same place in the snapshot when the backend reorders them
+    void copySnapshot(Object &snapshot) const {
+        PBD_TRACE_ZONE("copySnapshot");
+        const Object &objects = *physics_handler.getObjects();
+        const int32_t *handles = physics_handler.getObjectHandles();
+        const int32_t object_count = physics_handler.getObjectsCount();
+        const int32_t handle_count = physics_handler.getHandleCount();
+        snapshot.position_x.resize(handle_count);
+        snapshot.position_y.resize(handle_count);
+        snapshot.radius.resize(handle_count);
+        snapshot.color.resize(handle_count);
+        snapshot.generation.assign(physics_handler.getHandleGenerations(), physics_handler.getHandleGenerations() + handle_count);
+        if (object_count < handle_count) {
+            #pragma omp parallel for num_threads(cpu_threads)
+            for (int32_t handle = 0; handle < handle_count; ++handle) {
+                if ((snapshot.generation[handle] & 1u) == 0) snapshot.radius[handle] = 0.0f;
+            }
+        }
+        #pragma omp parallel for num_threads(cpu_threads)
+        for (int32_t idx = 0; idx < object_count; ++idx) {
+            const int32_t handle = handles[idx];
+            snapshot.position_x[handle] = objects.position_x[idx];
+            snapshot.position_y[handle] = objects.position_y[idx];
+            snapshot.radius[handle]     = objects.radius[idx];
+            snapshot.color[handle]      = objects.color[idx];
+        }
+        snapshot.size = handle_count;
+    }
+
+    PhysicsHandler &physics_handler;
+    std::array<Object, 3> snapshots;
+    int32_t front = 0;
+    int32_t previous = 1;
+    int32_t back = 2;
+    std::mutex mutex;
+    std::condition_variable update_requested;
+    std::condition_variable update_finished;
+    float delta_time = 0.0f;
+    int32_t steps = 1;
+    int32_t last_step_count = 0;
+    bool updating = false;
+    bool published = false;
+    bool stopping = false;
+    float last_update_time = 0.0f;
+    float last_wait_time = 0.0f;
+    std::thread worker; // started last, after the members it uses
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Stable LSD radix sort of 32-bit keys carrying an index, 16 bits per pass.
+// Passes over key bits that are zero for every key are skipped.
+class RadixSorter {
+public:
+    void sort(std::vector<uint32_t> &keys, std::vector<int32_t> &values) {
+        const size_t size = keys.size();
+        scratch_keys.resize(size);
+        scratch_values.resize(size);
+
+        uint32_t used_bits = 0;
+        for (const uint32_t key : keys) {
+            used_bits |= key;
+        }
+
+        for (uint32_t shift = 0; shift < 32; shift += radix_bits) {
+            if ((used_bits >> shift) == 0) break;
+
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for (const uint32_t key : keys) {
+                ++histogram[(key >> shift) & radix_mask];
+            }
+            uint32_t sum = 0;
+            for (uint32_t &count : histogram) {
+                const uint32_t bucket_count = count;
+                count = sum;
+                sum += bucket_count;
+            }
+            for (size_t i = 0; i < size; ++i) {
+                const uint32_t destination = histogram[(keys[i] >> shift) & radix_mask]++;
+                scratch_keys[destination]   = keys[i];
+                scratch_values[destination] = values[i];
+            }
+            std::swap(keys, scratch_keys);
+            std::swap(values, scratch_values);
+        }
+    }
+
+private:
+    static constexpr uint32_t radix_bits = 16;
+    static constexpr uint32_t radix_mask = (1u << radix_bits) - 1;
+
+    std::vector<uint32_t> histogram = std::vector<uint32_t>(1u << radix_bits);
+    std::vector<uint32_t> scratch_keys;
+    std::vector<int32_t> scratch_values;
+};
+
+#endif
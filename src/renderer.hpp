@@ -2,61 +2,134 @@
 #define RENDERER_HPP
 
 #include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <omp.h>
 
 #include "utils.hpp"
-#include "physics_handler.hpp"
+#include "object.hpp"
+#include "tracing.hpp"
 #include "window_handler.hpp"
 
+// Corners of the quad of each of the count particles, four vertices per particle in the order of the texture
+// coordinates; the part of a full render that runs every frame
+inline void writeParticleQuads(sf::Vertex *vertices, const float *position_x, const float *position_y, const float *radius, const int32_t count) {
+    #pragma omp parallel for num_threads(cpu_threads)
+    for (int32_t i = 0; i < count; ++i) {
+        const uint32_t idx = i << 2;
+        const float x = position_x[i];
+        const float y = position_y[i];
+        const float r = radius[i];
+        vertices[idx + 0].position = V2f{ x - r, y - r };
+        vertices[idx + 1].position = V2f{ x + r, y - r };
+        vertices[idx + 2].position = V2f{ x + r, y + r };
+        vertices[idx + 3].position = V2f{ x - r, y + r };
+    }
+}
+
+// Draws the world and the particles of an Object, from the physics or from a replayed trajectory. The Object
+// must be in handle order: the particle vertices persist between frames, their colors and texture coordinates
+// are written once when a particle first appears or its handle is reused, see Object::generation, and only the
+// positions are rewritten each frame. Free handles have a zero radius and draw nothing. They are
+// uploaded to a stream vertex buffer, or drawn from client memory when vertex buffers are not available.
+// When the window shows only part of the world or some particles are smaller than a pixel, only the visible
+// particles are drawn and those below a pixel are merged into one density splat per splat_pixels square.
+// Given the previous physics state, the positions are interpolated between the two states.
 class Renderer {
 public:
-    explicit Renderer(PhysicsHandler &_physics_handler)
-        : physics_handler(_physics_handler)
-        , world_va(sf::Quads, 4)
-        , objects_va(sf::Quads)
+    Renderer()
+        : world_va(sf::Quads, 4)
+        , objects_vb(sf::Quads, sf::VertexBuffer::Stream)
+        , use_vertex_buffer(sf::VertexBuffer::isAvailable())
     {
-        initializeWorldVA();
 
         object_texture.loadFromFile("D:/Workspace/C++/PBD/res/circle.png");
         object_texture.generateMipmap();
         object_texture.setSmooth(true);
     }
 
-    void render(WindowHandler &window_handler) {
+    // alpha is the fraction of the way from previous to objects to draw, particles newer than previous are
+    // drawn where they are in objects
+    void render(WindowHandler &window_handler, const Object &objects, const V2f world_size, const Object *previous = nullptr, const float alpha = 1.0f) {
+        // a loaded checkpoint or trajectory may change the world size
+        if (world_va[2].position != world_size) {
+            initializeWorldVA(world_size);
+        }
         window_handler.draw(world_va);
 
         sf::RenderStates states;
         states.texture = &object_texture;
         window_handler.draw(world_va, states);
 
-        updateParticlesVA();
-        window_handler.draw(objects_va, states);
-    }
+        if (objects.size == 0) return;
+        initializeParticleVertices(objects);
+        const float *position_x = objects.position_x.data();
+        const float *position_y = objects.position_y.data();
+        if (previous != nullptr && alpha < 1.0f) {
+            interpolatePositions(*previous, objects, alpha);
+            position_x = interpolated_x.data();
+            position_y = interpolated_y.data();
+        }
 
-    static void HSVtoRGB(const float h, const float s, const float v, float &r, float &g, float &b) {
-        const int i = static_cast<int>(h * 6);
-        const float f = h * 6 - static_cast<float>(i);
-        const float p = v * (1 - s);
-        const float q = v * (1 - f * s);
-        const float t = v * (1 - (1 - f) * s);
-        switch (i % 6) {
-            case 0: r = v, g = t, b = p; break;
-            case 1: r = q, g = v, b = p; break;
-            case 2: r = p, g = v, b = t; break;
-            case 3: r = p, g = q, b = v; break;
-            case 4: r = t, g = p, b = v; break;
-            default: r = v, g = p, b = q; break;
+        const sf::FloatRect view = window_handler.getVisibleWorldRect();
+        const float pixel_size = 1.0f / window_handler.getZoom();
+        const bool whole_world_visible = view.left <= 0.0f && view.top <= 0.0f && view.left + view.width >= world_size.x && view.top + view.height >= world_size.y;
+        if (whole_world_visible && 2.0f * min_radius >= pixel_size) {
+            updateParticleVertices(objects, position_x, position_y);
+            const size_t vertex_count = static_cast<size_t>(objects.size) * 4;
+            PBD_TRACE_ZONE("drawParticles");
+            if (use_vertex_buffer) {
+                window_handler.draw(objects_vb, 0, vertex_count, states);
+            } else {
+                window_handler.draw(object_vertices.data(), vertex_count, sf::Quads, states);
+            }
+            return;
         }
-        r *= 255;
-        g *= 255;
-        b *= 255;
+
+        updateVisibleVertices(objects, position_x, position_y, world_size, view, pixel_size);
+        PBD_TRACE_ZONE("drawParticles");
+        // one draw per thread, copying the threads' vertices together would cost more than the draw calls
+        for (const std::vector<sf::Vertex> &vertices : thread_vertices) {
+            if (!vertices.empty()) {
+                window_handler.draw(vertices.data(), vertices.size(), sf::Quads, states);
+            }
+        }
+        for (const std::vector<sf::Vertex> &vertices : thread_splat_vertices) {
+            if (!vertices.empty()) {
+                window_handler.draw(vertices.data(), vertices.size(), sf::Quads);
+            }
+        }
+    }
+
+    // the next render rewrites the colors of every particle, for when the particles are replaced
+    void resetParticles() {
+        initialized_objects = 0;
+        min_radius = std::numeric_limits<float>::max();
+    }
+
+    // particles drawn as quads and splats drawn by the last render that did not draw every particle
+    [[nodiscard]]
+    int32_t getVisibleQuadCount() const {
+        size_t vertex_count = 0;
+        for (const std::vector<sf::Vertex> &vertices : thread_vertices) vertex_count += vertices.size();
+        return static_cast<int32_t>(vertex_count / 4);
+    }
+
+    [[nodiscard]]
+    int32_t getSplatCount() const {
+        size_t vertex_count = 0;
+        for (const std::vector<sf::Vertex> &vertices : thread_splat_vertices) vertex_count += vertices.size();
+        return static_cast<int32_t>(vertex_count / 4);
     }
 
 private:
-    void initializeWorldVA() {
+    void initializeWorldVA(const V2f world_size) {
         world_va[0].position = {0.0f, 0.0f};
-        world_va[1].position = {physics_handler.getWorldSize().x, 0.0f};
-        world_va[2].position = {physics_handler.getWorldSize().x, physics_handler.getWorldSize().y};
-        world_va[3].position = {0.0f, physics_handler.getWorldSize().y};
+        world_va[1].position = {world_size.x, 0.0f};
+        world_va[2].position = {world_size.x, world_size.y};
+        world_va[3].position = {0.0f, world_size.y};
 
         const auto bg_color = sf::Color(50, 50, 50);
         world_va[0].color = bg_color;
@@ -65,61 +138,257 @@ private:
         world_va[3].color = bg_color;
     }
 
-    void updateParticlesVA() {
+    // colors and texture coordinates of the particles new since the last render or whose handle was reused
+    void initializeParticleVertices(const Object &object_storage) {
 
         constexpr float texture_size = 1024.0f;
 
-    #ifdef USE_CPU
-        objects_va.resize(physics_handler.getObjectsCount() * 4);
-        #pragma omp parallel for num_threads(cpu_threads)
-        for (int32_t i = 0; i < physics_handler.getObjectsCount(); ++i) {
-            const uint32_t idx = i << 2;
-
-            const Object &object = physics_handler.getObjectAoSAt(i);
-            objects_va[idx + 0].position = V2f{ object.position_x - object.radius, object.position_y - object.radius };
-            objects_va[idx + 1].position = V2f{ object.position_x + object.radius, object.position_y - object.radius };
-            objects_va[idx + 2].position = V2f{ object.position_x + object.radius, object.position_y + object.radius };
-            objects_va[idx + 3].position = V2f{ object.position_x - object.radius, object.position_y + object.radius };
-            const sf::Color color = { static_cast<sf::Uint8>(object.color_r), static_cast<sf::Uint8>(object.color_g), static_cast<sf::Uint8>(object.color_b)};
-            objects_va[idx + 0].color = color;
-            objects_va[idx + 1].color = color;
-            objects_va[idx + 2].color = color;
-            objects_va[idx + 3].color = color;
-            objects_va[idx + 0].texCoords = {0.0f, 0.0f};
-            objects_va[idx + 1].texCoords = {texture_size, 0.0f};
-            objects_va[idx + 2].texCoords = {texture_size, texture_size};
-            objects_va[idx + 3].texCoords = {0.0f, texture_size};
+        const int32_t object_count = object_storage.size;
+        if (object_vertices.size() < static_cast<size_t>(object_count) * 4) {
+            object_vertices.resize(static_cast<size_t>(object_count) * 4);
         }
-    #elif defined USE_GPU
-        objects_va.resize(physics_handler.getObjectsCount() * 4);
-        const Object *objects = physics_handler.getObjects();
-        #pragma omp parallel for num_threads(cpu_threads)
-        for (int32_t i = 0; i < physics_handler.getObjectsCount(); ++i) {
+        const Object *objects = &object_storage;
+        // particles beyond the count may be different ones when they come back
+        const int32_t first_new = std::min(initialized_objects, object_count);
+        const bool has_generations = objects->generation.size() == static_cast<size_t>(object_count);
+        if (has_generations) {
+            vertex_generations.resize(object_count);
+        }
+        float new_min_radius = min_radius;
+        #pragma omp parallel for num_threads(cpu_threads) reduction(min: new_min_radius)
+        for (int32_t i = has_generations ? 0 : first_new; i < object_count; ++i) {
+            if (i < first_new && vertex_generations[i] == objects->generation[i]) continue;
+            if (has_generations) vertex_generations[i] = objects->generation[i];
             const uint32_t idx = i << 2;
+            // free handles have no radius
+            if (objects->radius[i] > 0.0f) new_min_radius = std::min(new_min_radius, objects->radius[i]);
+            const sf::Color color(objects->color[i]);
+            object_vertices[idx + 0].color = color;
+            object_vertices[idx + 1].color = color;
+            object_vertices[idx + 2].color = color;
+            object_vertices[idx + 3].color = color;
+            object_vertices[idx + 0].texCoords = {0.0f, 0.0f};
+            object_vertices[idx + 1].texCoords = {texture_size, 0.0f};
+            object_vertices[idx + 2].texCoords = {texture_size, texture_size};
+            object_vertices[idx + 3].texCoords = {0.0f, texture_size};
+        }
+        min_radius = new_min_radius;
+        initialized_objects = object_count;
+    }
 
-            objects_va[idx + 0].position = V2f{ objects->position_x[i] - objects->radius[i], objects->position_y[i] - objects->radius[i] };
-            objects_va[idx + 1].position = V2f{ objects->position_x[i] + objects->radius[i], objects->position_y[i] - objects->radius[i] };
-            objects_va[idx + 2].position = V2f{ objects->position_x[i] + objects->radius[i], objects->position_y[i] + objects->radius[i] };
-            objects_va[idx + 3].position = V2f{ objects->position_x[i] - objects->radius[i], objects->position_y[i] + objects->radius[i] };
-            const sf::Color color = { static_cast<sf::Uint8>(objects->color_r[i]), static_cast<sf::Uint8>(objects->color_g[i]), static_cast<sf::Uint8>(objects->color_b[i])};
-            objects_va[idx + 0].color = color;
-            objects_va[idx + 1].color = color;
-            objects_va[idx + 2].color = color;
-            objects_va[idx + 3].color = color;
-            objects_va[idx + 0].texCoords = {0.0f, 0.0f};
-            objects_va[idx + 1].texCoords = {texture_size, 0.0f};
-            objects_va[idx + 2].texCoords = {texture_size, texture_size};
-            objects_va[idx + 3].texCoords = {0.0f, texture_size};
+    void interpolatePositions(const Object &previous, const Object &current, const float alpha) {
+        PBD_TRACE_ZONE("interpolatePositions");
+        const int32_t object_count = current.size;
+        const int32_t previous_count = std::min(previous.size, object_count);
+        interpolated_x.resize(object_count);
+        interpolated_y.resize(object_count);
+        // a handle reused in between holds a different particle, it is drawn where it is now
+        const bool has_generations = previous.generation.size() >= static_cast<size_t>(previous_count) && current.generation.size() >= static_cast<size_t>(previous_count);
+        const uint32_t *previous_generation = previous.generation.data();
+        const uint32_t *current_generation = current.generation.data();
+        #pragma omp parallel for num_threads(cpu_threads)
+        for (int32_t i = 0; i < previous_count; ++i) {
+            const float t = !has_generations || previous_generation[i] == current_generation[i] ? alpha : 1.0f;
+            interpolated_x[i] = previous.position_x[i] + (current.position_x[i] - previous.position_x[i]) * t;
+            interpolated_y[i] = previous.position_y[i] + (current.position_y[i] - previous.position_y[i]) * t;
         }
-    #endif
+        std::copy(current.position_x.begin() + previous_count, current.position_x.begin() + object_count, interpolated_x.begin() + previous_count);
+        std::copy(current.position_y.begin() + previous_count, current.position_y.begin() + object_count, interpolated_y.begin() + previous_count);
+    }
 
+    void updateParticleVertices(const Object &object_storage, const float *position_x, const float *position_y) {
+        PBD_TRACE_ZONE("updateParticleVertices");
+        const int32_t object_count = object_storage.size;
+        writeParticleQuads(object_vertices.data(), position_x, position_y, object_storage.radius.data(), object_count);
+
+        if (!use_vertex_buffer) return;
+        const size_t vertex_count = static_cast<size_t>(object_count) * 4;
+        // the buffer grows geometrically, creating it again discards its contents
+        if (objects_vb.getVertexCount() < vertex_count && !objects_vb.create(std::max(vertex_count, 2 * objects_vb.getVertexCount()))) {
+            use_vertex_buffer = false;
+            return;
+        }
+        objects_vb.update(object_vertices.data(), vertex_count, 0);
     }
 
+    // Quads of the visible particles of at least a pixel, and splats of the smaller ones: each splat cell gets
+    // the area weighted color of its particles and an opacity given by the area they cover. Each thread owns a
+    // band of splat rows, so no cell is shared between threads. The visible particles are first binned by band
+    // in one parallel pass, a histogram, prefix sum and scatter like GridHelper::updateGrids, so each thread then
+    // reads only its own band. A band keeps its particles in index order and the output does not depend on the
+    // thread count.
+    void updateVisibleVertices(const Object &object_storage, const float *positions_x, const float *positions_y, const V2f world_size, const sf::FloatRect &view, const float pixel_size) {
+        PBD_TRACE_ZONE("updateVisibleVertices");
+        const float view_right  = view.left + view.width;
+        const float view_bottom = view.top + view.height;
+        const float splat_left   = std::max(view.left, 0.0f);
+        const float splat_top    = std::max(view.top, 0.0f);
+        const float splat_right  = std::min(view_right, world_size.x);
+        const float splat_bottom = std::min(view_bottom, world_size.y);
+        const float splat_size = splat_pixels * pixel_size;
+        const float inverse_splat_size = 1.0f / splat_size;
+        const float splat_radius = 0.5f * pixel_size;
+        // no splat grid when every particle covers a pixel, the rows still split the work
+        const bool splatting = min_radius < splat_radius;
+        const int32_t splat_width  = splatting ? std::max(1, static_cast<int32_t>(std::ceil((splat_right - splat_left) * inverse_splat_size))) : 0;
+        const int32_t splat_height = std::max(1, static_cast<int32_t>(std::ceil((splat_bottom - splat_top) * inverse_splat_size)));
+        splat_cells.assign(static_cast<size_t>(splat_width) * splat_height, SplatCell{});
+        // cleared here as well, a thread the runtime does not start must not draw the vertices of an earlier frame
+        thread_vertices.resize(cpu_threads);
+        thread_splat_vertices.resize(cpu_threads);
+        for (int32_t thread = 0; thread < cpu_threads; ++thread) {
+            thread_vertices[thread].clear();
+            thread_splat_vertices[thread].clear();
+        }
+
+        const Object *objects = &object_storage;
+        const int32_t object_count = object_storage.size;
+        visible_band.resize(object_count);
+        band_offsets.resize(static_cast<size_t>(cpu_threads) * cpu_threads);
+        band_start.resize(cpu_threads + 1);
+        SplatCell *cells = splat_cells.data();
+        // private copies, the stores to the cells could alias shared floats and force them to be reloaded
+        #pragma omp parallel num_threads(cpu_threads) firstprivate(positions_x, positions_y, view_right, view_bottom, splat_left, splat_top, splat_size, inverse_splat_size, splat_radius, splat_width, splat_height, cells, object_count)
+        {
+            PBD_TRACE_ZONE("visibleRows");
+            const float view_left = view.left;
+            const float view_top  = view.top;
+            const float *position_x = positions_x;
+            const float *position_y = positions_y;
+            const float *radius     = objects->radius.data();
+            const int32_t thread_count = omp_get_num_threads();
+            const int32_t thread = omp_get_thread_num();
+            const int32_t first_row = static_cast<int32_t>(static_cast<int64_t>(splat_height) * thread / thread_count);
+            const int32_t last_row  = static_cast<int32_t>(static_cast<int64_t>(splat_height) * (thread + 1) / thread_count);
+            std::vector<sf::Vertex> &vertices = thread_vertices[thread];
+            std::vector<sf::Vertex> &splat_quads = thread_splat_vertices[thread];
+
+            // positions in handle order are scattered, a single branch is far better predicted than four
+            const auto isVisible = [&](const int32_t i) {
+                const float x = position_x[i];
+                const float y = position_y[i];
+                const float r = radius[i];
+                return (x + r >= view_left) & (x - r <= view_right) & (y + r >= view_top) & (y - r <= view_bottom);
+            };
+            const auto draw = [&](const int32_t i) {
+                const float x = position_x[i];
+                const float y = position_y[i];
+                const float r = radius[i];
+                if (r < splat_radius) {
+                    const int32_t splat_y = std::clamp(static_cast<int32_t>((y - splat_top) * inverse_splat_size), 0, splat_height - 1);
+                    const int32_t splat_x = std::clamp(static_cast<int32_t>((x - splat_left) * inverse_splat_size), 0, splat_width - 1);
+                    SplatCell &cell = cells[static_cast<size_t>(splat_y) * splat_width + splat_x];
+                    const float area = r * r;
+                    cell.area += area;
+                    cell.r    += area * static_cast<float>(getRed(objects->color[i]));
+                    cell.g    += area * static_cast<float>(getGreen(objects->color[i]));
+                    cell.b    += area * static_cast<float>(getBlue(objects->color[i]));
+                    return;
+                }
+                const uint32_t idx = i << 2;
+                vertices.insert(vertices.end(), object_vertices.begin() + idx, object_vertices.begin() + idx + 4);
+                sf::Vertex *quad = &vertices[vertices.size() - 4];
+                quad[0].position = V2f{ x - r, y - r };
+                quad[1].position = V2f{ x + r, y - r };
+                quad[2].position = V2f{ x + r, y + r };
+                quad[3].position = V2f{ x - r, y + r };
+            };
+
+            if (thread_count == 1) {
+                // a single band, nothing to bin
+                for (int32_t i = 0; i < object_count; ++i) {
+                    if (isVisible(i)) draw(i);
+                }
+            } else {
+                // band of each visible particle of this thread's slice, -1 when culled, counted per band
+                const int32_t object_begin = static_cast<int32_t>(static_cast<int64_t>(object_count) * thread / thread_count);
+                const int32_t object_end   = static_cast<int32_t>(static_cast<int64_t>(object_count) * (thread + 1) / thread_count);
+                int32_t *histogram = band_offsets.data() + static_cast<size_t>(thread) * thread_count;
+                std::fill(histogram, histogram + thread_count, 0);
+                for (int32_t i = object_begin; i < object_end; ++i) {
+                    if (!isVisible(i)) {
+                        visible_band[i] = -1;
+                        continue;
+                    }
+                    const int32_t splat_y = std::clamp(static_cast<int32_t>((position_y[i] - splat_top) * inverse_splat_size), 0, splat_height - 1);
+                    // the band whose rows [first_row, last_row) hold splat_y
+                    const auto band = static_cast<int32_t>((static_cast<int64_t>(splat_y + 1) * thread_count - 1) / splat_height);
+                    visible_band[i] = band;
+                    ++histogram[band];
+                }
+                #pragma omp barrier
+
+                // offsets by band, then by slice, so a band lists its particles in index order
+                #pragma omp single
+                {
+                    int32_t offset = 0;
+                    for (int32_t band = 0; band < thread_count; ++band) {
+                        band_start[band] = offset;
+                        for (int32_t slice = 0; slice < thread_count; ++slice) {
+                            const int32_t count = band_offsets[static_cast<size_t>(slice) * thread_count + band];
+                            band_offsets[static_cast<size_t>(slice) * thread_count + band] = offset;
+                            offset += count;
+                        }
+                    }
+                    band_start[thread_count] = offset;
+                    visible_objects.resize(offset);
+                }
+
+                for (int32_t i = object_begin; i < object_end; ++i) {
+                    const int32_t band = visible_band[i];
+                    if (band >= 0) visible_objects[histogram[band]++] = i;
+                }
+                #pragma omp barrier
+
+                for (int32_t k = band_start[thread]; k < band_start[thread + 1]; ++k) {
+                    draw(visible_objects[k]);
+                }
+            }
+
+            // a disc covers pi r^2, the sums above hold r^2
+            const float coverage_scale = 3.14159265f * inverse_splat_size * inverse_splat_size;
+            for (int32_t splat_y = first_row; splat_y < last_row; ++splat_y) {
+                for (int32_t splat_x = 0; splat_x < splat_width; ++splat_x) {
+                    const SplatCell &cell = cells[static_cast<size_t>(splat_y) * splat_width + splat_x];
+                    if (cell.area == 0.0f) continue;
+                    const float inverse_area = 1.0f / cell.area;
+                    const sf::Color color = {
+                        static_cast<sf::Uint8>(cell.r * inverse_area),
+                        static_cast<sf::Uint8>(cell.g * inverse_area),
+                        static_cast<sf::Uint8>(cell.b * inverse_area),
+                        static_cast<sf::Uint8>(std::min(1.0f, cell.area * coverage_scale) * 255.0f)};
+                    const float left = splat_left + static_cast<float>(splat_x) * splat_size;
+                    const float top  = splat_top + static_cast<float>(splat_y) * splat_size;
+                    splat_quads.emplace_back(V2f{left, top}, color);
+                    splat_quads.emplace_back(V2f{left + splat_size, top}, color);
+                    splat_quads.emplace_back(V2f{left + splat_size, top + splat_size}, color);
+                    splat_quads.emplace_back(V2f{left, top + splat_size}, color);
+                }
+            }
+        }
+    }
 
-    PhysicsHandler  &physics_handler;
-    sf::VertexArray world_va;
-    sf::VertexArray objects_va;
-    sf::Texture     object_texture;
+    sf::VertexArray         world_va;
+    sf::VertexBuffer        objects_vb;
+    bool                    use_vertex_buffer;
+    std::vector<sf::Vertex> object_vertices; // 4 per particle, in handle order
+    std::vector<float>      interpolated_x, interpolated_y;
+    std::vector<uint32_t>   vertex_generations; // generation of each handle when its vertices were initialized
+    int32_t                 initialized_objects = 0;
+    float                   min_radius = std::numeric_limits<float>::max(); // smallest particle initialized
+    struct SplatCell {
+        float area = 0.0f;          // sum of r^2 of its particles
+        float r = 0.0f, g = 0.0f, b = 0.0f; // r^2 weighted color sums
+    };
+    std::vector<SplatCell>  splat_cells;
+    std::vector<int32_t>    visible_band;    // band of splat rows of each particle, -1 when culled
+    std::vector<int32_t>    visible_objects; // visible particles grouped by band
+    std::vector<int32_t>    band_offsets;    // per slice of particles and band: count, then scatter offset
+    std::vector<int32_t>    band_start;      // visible_objects of band b are [band_start[b], band_start[b + 1])
+    std::vector<std::vector<sf::Vertex>> thread_vertices;       // quads kept by each thread
+    std::vector<std::vector<sf::Vertex>> thread_splat_vertices; // splats of the rows of each thread
+    static constexpr float  splat_pixels = 2.0f;
+    sf::Texture             object_texture;
 };
 
 #endif
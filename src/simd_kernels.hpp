@@ -0,0 +1,582 @@
+#ifndef SIMD_KERNELS_HPP
+#define SIMD_KERNELS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+constexpr int32_t simd_width = 8;
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+constexpr int32_t simd_width = 4;
+#else
+constexpr int32_t simd_width = 1;
+#endif
+
+#include "object.hpp"
+
+// Verlet integration with damping and clamping to the world borders for particles [begin, end).
+// A particle staying within sleep_distance2 (squared) of its sleep anchor for sleep_steps sub steps falls
+// asleep: it loses its velocity and stops moving, the pushes it receives from awake particles are undone
+// here until it is woken up by resetting its still_steps. Measuring the drift from an anchor instead of
+// the movement of one sub step lets particles jittering in a pile fall asleep. A negative sleep_distance2
+// keeps every particle awake.
+inline void integrateObjectsScalar(Object &objects, const int32_t begin, const int32_t end, const float delta_time, const float world_size_x, const float world_size_y, const float sleep_distance2, const int32_t sleep_steps) {
+    float *position_x      = objects.position_x.data();
+    float *position_y      = objects.position_y.data();
+    float *last_position_x = objects.last_position_x.data();
+    float *last_position_y = objects.last_position_y.data();
+    const float *radius    = objects.radius.data();
+    float *sleep_anchor_x  = objects.sleep_anchor_x.data();
+    float *sleep_anchor_y  = objects.sleep_anchor_y.data();
+    int32_t *still_steps   = objects.still_steps.data();
+    const float dt2 = delta_time * delta_time;
+
+    for (int32_t idx = begin; idx < end; ++idx) {
+        if (still_steps[idx] >= sleep_steps) {
+            position_x[idx] = last_position_x[idx];
+            position_y[idx] = last_position_y[idx];
+            continue;
+        }
+        const float drift_x = position_x[idx] - sleep_anchor_x[idx];
+        const float drift_y = position_y[idx] - sleep_anchor_y[idx];
+        if (drift_x * drift_x + drift_y * drift_y > sleep_distance2) {
+            sleep_anchor_x[idx] = position_x[idx];
+            sleep_anchor_y[idx] = position_y[idx];
+            still_steps[idx] = 0;
+        } else if (++still_steps[idx] >= sleep_steps) {
+            last_position_x[idx] = position_x[idx];
+            last_position_y[idx] = position_y[idx];
+            continue;
+        }
+
+        const float last_movement_x = position_x[idx] - last_position_x[idx];
+        const float last_movement_y = position_y[idx] - last_position_y[idx];
+        float new_position_x = position_x[idx] + last_movement_x + (objects.acceleration_x - last_movement_x * VELOCITY_DAMPING) * dt2;
+        float new_position_y = position_y[idx] + last_movement_y + (objects.acceleration_y - last_movement_y * VELOCITY_DAMPING) * dt2;
+
+        if (new_position_x < WORLD_MARGIN + radius[idx])                     { new_position_x = WORLD_MARGIN + radius[idx]; }
+        else if (new_position_x > world_size_x - WORLD_MARGIN - radius[idx]) { new_position_x = world_size_x - WORLD_MARGIN - radius[idx]; }
+        if (new_position_y < WORLD_MARGIN + radius[idx])                     { new_position_y = WORLD_MARGIN + radius[idx]; }
+        else if (new_position_y > world_size_y - WORLD_MARGIN - radius[idx]) { new_position_y = world_size_y - WORLD_MARGIN - radius[idx]; }
+
+        last_position_x[idx] = position_x[idx];
+        last_position_y[idx] = position_y[idx];
+        position_x[idx]      = new_position_x;
+        position_y[idx]      = new_position_y;
+    }
+}
+
+// vectorized integrateObjectsScalar, the particles that do not fill a vector are integrated by the scalar version
+inline void integrateObjectsSimd(Object &objects, const int32_t begin, const int32_t end, const float delta_time, const float world_size_x, const float world_size_y, const float sleep_distance2, const int32_t sleep_steps) {
+    float *position_x      = objects.position_x.data();
+    float *position_y      = objects.position_y.data();
+    float *last_position_x = objects.last_position_x.data();
+    float *last_position_y = objects.last_position_y.data();
+    const float *radius    = objects.radius.data();
+    float *sleep_anchor_x  = objects.sleep_anchor_x.data();
+    float *sleep_anchor_y  = objects.sleep_anchor_y.data();
+    int32_t *still_steps   = objects.still_steps.data();
+    const float dt2 = delta_time * delta_time;
+
+    int32_t idx = begin;
+#if defined SIMD_AVX2
+    const __m256 v_acc_x   = _mm256_set1_ps(objects.acceleration_x * dt2);
+    const __m256 v_acc_y   = _mm256_set1_ps(objects.acceleration_y * dt2);
+    const __m256 v_damping = _mm256_set1_ps(1.0f - VELOCITY_DAMPING * dt2);
+    const __m256 v_margin  = _mm256_set1_ps(WORLD_MARGIN);
+    const __m256 v_max_x   = _mm256_set1_ps(world_size_x - WORLD_MARGIN);
+    const __m256 v_max_y   = _mm256_set1_ps(world_size_y - WORLD_MARGIN);
+    const __m256 v_sleep_distance2 = _mm256_set1_ps(sleep_distance2);
+    const __m256i v_sleep_steps    = _mm256_set1_epi32(sleep_steps);
+    const __m256i v_one            = _mm256_set1_epi32(1);
+    for (; idx + 8 <= end; idx += 8) {
+        const __m256 pos_x      = _mm256_loadu_ps(position_x + idx);
+        const __m256 pos_y      = _mm256_loadu_ps(position_y + idx);
+        const __m256 last_pos_x = _mm256_loadu_ps(last_position_x + idx);
+        const __m256 last_pos_y = _mm256_loadu_ps(last_position_y + idx);
+        const __m256 r          = _mm256_loadu_ps(radius + idx);
+        const __m256 movement_x = _mm256_sub_ps(pos_x, last_pos_x);
+        const __m256 movement_y = _mm256_sub_ps(pos_y, last_pos_y);
+        __m256 new_x = _mm256_add_ps(_mm256_add_ps(pos_x, _mm256_mul_ps(movement_x, v_damping)), v_acc_x);
+        __m256 new_y = _mm256_add_ps(_mm256_add_ps(pos_y, _mm256_mul_ps(movement_y, v_damping)), v_acc_y);
+        new_x = _mm256_min_ps(_mm256_max_ps(new_x, _mm256_add_ps(v_margin, r)), _mm256_sub_ps(v_max_x, r));
+        new_y = _mm256_min_ps(_mm256_max_ps(new_y, _mm256_add_ps(v_margin, r)), _mm256_sub_ps(v_max_y, r));
+
+        // lanes awake before this step count their still steps and move their anchor when they drifted,
+        // asleep lanes go back to their resting position, lanes falling asleep now rest where they are
+        const __m256i steps       = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(still_steps + idx));
+        const __m256i was_awake_i = _mm256_cmpgt_epi32(v_sleep_steps, steps);
+        const __m256 was_awake    = _mm256_castsi256_ps(was_awake_i);
+        const __m256 anchor_x = _mm256_loadu_ps(sleep_anchor_x + idx);
+        const __m256 anchor_y = _mm256_loadu_ps(sleep_anchor_y + idx);
+        const __m256 drift_x  = _mm256_sub_ps(pos_x, anchor_x);
+        const __m256 drift_y  = _mm256_sub_ps(pos_y, anchor_y);
+        const __m256 drift2   = _mm256_add_ps(_mm256_mul_ps(drift_x, drift_x), _mm256_mul_ps(drift_y, drift_y));
+        const __m256 drifted  = _mm256_and_ps(was_awake, _mm256_cmp_ps(drift2, v_sleep_distance2, _CMP_GT_OQ));
+        _mm256_storeu_ps(sleep_anchor_x + idx, _mm256_blendv_ps(anchor_x, pos_x, drifted));
+        _mm256_storeu_ps(sleep_anchor_y + idx, _mm256_blendv_ps(anchor_y, pos_y, drifted));
+        const __m256i counted   = _mm256_andnot_si256(_mm256_castps_si256(drifted), _mm256_add_epi32(steps, v_one));
+        const __m256i new_steps = _mm256_blendv_epi8(steps, counted, was_awake_i);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(still_steps + idx), new_steps);
+        const __m256 awake  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(v_sleep_steps, new_steps));
+        const __m256 rest_x = _mm256_blendv_ps(last_pos_x, pos_x, was_awake);
+        const __m256 rest_y = _mm256_blendv_ps(last_pos_y, pos_y, was_awake);
+
+        _mm256_storeu_ps(last_position_x + idx, rest_x);
+        _mm256_storeu_ps(last_position_y + idx, rest_y);
+        _mm256_storeu_ps(position_x + idx, _mm256_blendv_ps(rest_x, new_x, awake));
+        _mm256_storeu_ps(position_y + idx, _mm256_blendv_ps(rest_y, new_y, awake));
+    }
+#elif defined SIMD_SSE
+    const __m128 v_acc_x   = _mm_set1_ps(objects.acceleration_x * dt2);
+    const __m128 v_acc_y   = _mm_set1_ps(objects.acceleration_y * dt2);
+    const __m128 v_damping = _mm_set1_ps(1.0f - VELOCITY_DAMPING * dt2);
+    const __m128 v_margin  = _mm_set1_ps(WORLD_MARGIN);
+    const __m128 v_max_x   = _mm_set1_ps(world_size_x - WORLD_MARGIN);
+    const __m128 v_max_y   = _mm_set1_ps(world_size_y - WORLD_MARGIN);
+    const __m128 v_sleep_distance2 = _mm_set1_ps(sleep_distance2);
+    const __m128i v_sleep_steps    = _mm_set1_epi32(sleep_steps);
+    const __m128i v_one            = _mm_set1_epi32(1);
+    // blendv needs SSE4.1
+    const auto select = [](const __m128 mask, const __m128 a, const __m128 b) {
+        return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+    };
+    for (; idx + 4 <= end; idx += 4) {
+        const __m128 pos_x      = _mm_loadu_ps(position_x + idx);
+        const __m128 pos_y      = _mm_loadu_ps(position_y + idx);
+        const __m128 last_pos_x = _mm_loadu_ps(last_position_x + idx);
+        const __m128 last_pos_y = _mm_loadu_ps(last_position_y + idx);
+        const __m128 r          = _mm_loadu_ps(radius + idx);
+        const __m128 movement_x = _mm_sub_ps(pos_x, last_pos_x);
+        const __m128 movement_y = _mm_sub_ps(pos_y, last_pos_y);
+        __m128 new_x = _mm_add_ps(_mm_add_ps(pos_x, _mm_mul_ps(movement_x, v_damping)), v_acc_x);
+        __m128 new_y = _mm_add_ps(_mm_add_ps(pos_y, _mm_mul_ps(movement_y, v_damping)), v_acc_y);
+        new_x = _mm_min_ps(_mm_max_ps(new_x, _mm_add_ps(v_margin, r)), _mm_sub_ps(v_max_x, r));
+        new_y = _mm_min_ps(_mm_max_ps(new_y, _mm_add_ps(v_margin, r)), _mm_sub_ps(v_max_y, r));
+
+        // same as the AVX2 path
+        const __m128i steps       = _mm_loadu_si128(reinterpret_cast<const __m128i *>(still_steps + idx));
+        const __m128i was_awake_i = _mm_cmplt_epi32(steps, v_sleep_steps);
+        const __m128 was_awake    = _mm_castsi128_ps(was_awake_i);
+        const __m128 anchor_x = _mm_loadu_ps(sleep_anchor_x + idx);
+        const __m128 anchor_y = _mm_loadu_ps(sleep_anchor_y + idx);
+        const __m128 drift_x  = _mm_sub_ps(pos_x, anchor_x);
+        const __m128 drift_y  = _mm_sub_ps(pos_y, anchor_y);
+        const __m128 drift2   = _mm_add_ps(_mm_mul_ps(drift_x, drift_x), _mm_mul_ps(drift_y, drift_y));
+        const __m128 drifted  = _mm_and_ps(was_awake, _mm_cmpgt_ps(drift2, v_sleep_distance2));
+        _mm_storeu_ps(sleep_anchor_x + idx, select(drifted, anchor_x, pos_x));
+        _mm_storeu_ps(sleep_anchor_y + idx, select(drifted, anchor_y, pos_y));
+        const __m128i counted   = _mm_andnot_si128(_mm_castps_si128(drifted), _mm_add_epi32(steps, v_one));
+        const __m128i new_steps = _mm_or_si128(_mm_and_si128(was_awake_i, counted), _mm_andnot_si128(was_awake_i, steps));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(still_steps + idx), new_steps);
+        const __m128 awake  = _mm_castsi128_ps(_mm_cmplt_epi32(new_steps, v_sleep_steps));
+        const __m128 rest_x = select(was_awake, last_pos_x, pos_x);
+        const __m128 rest_y = select(was_awake, last_pos_y, pos_y);
+
+        _mm_storeu_ps(last_position_x + idx, rest_x);
+        _mm_storeu_ps(last_position_y + idx, rest_y);
+        _mm_storeu_ps(position_x + idx, select(awake, rest_x, new_x));
+        _mm_storeu_ps(position_y + idx, select(awake, rest_y, new_y));
+    }
+#endif
+
+    integrateObjectsScalar(objects, idx, end, delta_time, world_size_x, world_size_y, sleep_distance2, sleep_steps);
+}
+
+// integrateObjectsScalar with sleeping off: every particle is awake, so the sleep anchors and still steps are
+// neither read nor written
+inline void integrateAwakeObjectsScalar(Object &objects, const int32_t begin, const int32_t end, const float delta_time, const float world_size_x, const float world_size_y) {
+    float *position_x      = objects.position_x.data();
+    float *position_y      = objects.position_y.data();
+    float *last_position_x = objects.last_position_x.data();
+    float *last_position_y = objects.last_position_y.data();
+    const float *radius    = objects.radius.data();
+    const float dt2 = delta_time * delta_time;
+
+    for (int32_t idx = begin; idx < end; ++idx) {
+        const float last_movement_x = position_x[idx] - last_position_x[idx];
+        const float last_movement_y = position_y[idx] - last_position_y[idx];
+        float new_position_x = position_x[idx] + last_movement_x + (objects.acceleration_x - last_movement_x * VELOCITY_DAMPING) * dt2;
+        float new_position_y = position_y[idx] + last_movement_y + (objects.acceleration_y - last_movement_y * VELOCITY_DAMPING) * dt2;
+
+        if (new_position_x < WORLD_MARGIN + radius[idx])                     { new_position_x = WORLD_MARGIN + radius[idx]; }
+        else if (new_position_x > world_size_x - WORLD_MARGIN - radius[idx]) { new_position_x = world_size_x - WORLD_MARGIN - radius[idx]; }
+        if (new_position_y < WORLD_MARGIN + radius[idx])                     { new_position_y = WORLD_MARGIN + radius[idx]; }
+        else if (new_position_y > world_size_y - WORLD_MARGIN - radius[idx]) { new_position_y = world_size_y - WORLD_MARGIN - radius[idx]; }
+
+        last_position_x[idx] = position_x[idx];
+        last_position_y[idx] = position_y[idx];
+        position_x[idx]      = new_position_x;
+        position_y[idx]      = new_position_y;
+    }
+}
+
+// vectorized integrateAwakeObjectsScalar
+inline void integrateAwakeObjectsSimd(Object &objects, const int32_t begin, const int32_t end, const float delta_time, const float world_size_x, const float world_size_y) {
+    float *position_x      = objects.position_x.data();
+    float *position_y      = objects.position_y.data();
+    float *last_position_x = objects.last_position_x.data();
+    float *last_position_y = objects.last_position_y.data();
+    const float *radius    = objects.radius.data();
+    const float dt2 = delta_time * delta_time;
+
+    int32_t idx = begin;
+#if defined SIMD_AVX2
+    const __m256 v_acc_x   = _mm256_set1_ps(objects.acceleration_x * dt2);
+    const __m256 v_acc_y   = _mm256_set1_ps(objects.acceleration_y * dt2);
+    const __m256 v_damping = _mm256_set1_ps(1.0f - VELOCITY_DAMPING * dt2);
+    const __m256 v_margin  = _mm256_set1_ps(WORLD_MARGIN);
+    const __m256 v_max_x   = _mm256_set1_ps(world_size_x - WORLD_MARGIN);
+    const __m256 v_max_y   = _mm256_set1_ps(world_size_y - WORLD_MARGIN);
+    for (; idx + 8 <= end; idx += 8) {
+        const __m256 pos_x      = _mm256_loadu_ps(position_x + idx);
+        const __m256 pos_y      = _mm256_loadu_ps(position_y + idx);
+        const __m256 r          = _mm256_loadu_ps(radius + idx);
+        const __m256 movement_x = _mm256_sub_ps(pos_x, _mm256_loadu_ps(last_position_x + idx));
+        const __m256 movement_y = _mm256_sub_ps(pos_y, _mm256_loadu_ps(last_position_y + idx));
+        __m256 new_x = _mm256_add_ps(_mm256_add_ps(pos_x, _mm256_mul_ps(movement_x, v_damping)), v_acc_x);
+        __m256 new_y = _mm256_add_ps(_mm256_add_ps(pos_y, _mm256_mul_ps(movement_y, v_damping)), v_acc_y);
+        new_x = _mm256_min_ps(_mm256_max_ps(new_x, _mm256_add_ps(v_margin, r)), _mm256_sub_ps(v_max_x, r));
+        new_y = _mm256_min_ps(_mm256_max_ps(new_y, _mm256_add_ps(v_margin, r)), _mm256_sub_ps(v_max_y, r));
+
+        _mm256_storeu_ps(last_position_x + idx, pos_x);
+        _mm256_storeu_ps(last_position_y + idx, pos_y);
+        _mm256_storeu_ps(position_x + idx, new_x);
+        _mm256_storeu_ps(position_y + idx, new_y);
+    }
+#elif defined SIMD_SSE
+    const __m128 v_acc_x   = _mm_set1_ps(objects.acceleration_x * dt2);
+    const __m128 v_acc_y   = _mm_set1_ps(objects.acceleration_y * dt2);
+    const __m128 v_damping = _mm_set1_ps(1.0f - VELOCITY_DAMPING * dt2);
+    const __m128 v_margin  = _mm_set1_ps(WORLD_MARGIN);
+    const __m128 v_max_x   = _mm_set1_ps(world_size_x - WORLD_MARGIN);
+    const __m128 v_max_y   = _mm_set1_ps(world_size_y - WORLD_MARGIN);
+    for (; idx + 4 <= end; idx += 4) {
+        const __m128 pos_x      = _mm_loadu_ps(position_x + idx);
+        const __m128 pos_y      = _mm_loadu_ps(position_y + idx);
+        const __m128 r          = _mm_loadu_ps(radius + idx);
+        const __m128 movement_x = _mm_sub_ps(pos_x, _mm_loadu_ps(last_position_x + idx));
+        const __m128 movement_y = _mm_sub_ps(pos_y, _mm_loadu_ps(last_position_y + idx));
+        __m128 new_x = _mm_add_ps(_mm_add_ps(pos_x, _mm_mul_ps(movement_x, v_damping)), v_acc_x);
+        __m128 new_y = _mm_add_ps(_mm_add_ps(pos_y, _mm_mul_ps(movement_y, v_damping)), v_acc_y);
+        new_x = _mm_min_ps(_mm_max_ps(new_x, _mm_add_ps(v_margin, r)), _mm_sub_ps(v_max_x, r));
+        new_y = _mm_min_ps(_mm_max_ps(new_y, _mm_add_ps(v_margin, r)), _mm_sub_ps(v_max_y, r));
+
+        _mm_storeu_ps(last_position_x + idx, pos_x);
+        _mm_storeu_ps(last_position_y + idx, pos_y);
+        _mm_storeu_ps(position_x + idx, new_x);
+        _mm_storeu_ps(position_y + idx, new_y);
+    }
+#endif
+
+    integrateAwakeObjectsScalar(objects, idx, end, delta_time, world_size_x, world_size_y);
+}
+
+// Resolves the contacts of particle idx against every particle of others[0, count) one by one.
+// Entries equal to idx are ignored. Returns the deepest overlap found, 0 without contact.
+inline float solveContactBatchScalar(Object &objects, const int32_t idx, const int32_t *others, const int32_t count) {
+    float *position_x   = objects.position_x.data();
+    float *position_y   = objects.position_y.data();
+    const float *radius = objects.radius.data();
+    constexpr float response_coef = 1.0f;
+    constexpr float min_dist2 = 1e-6f;
+
+    float max_overlap = 0.0f;
+    for (int32_t k = 0; k < count; ++k) {
+        const int32_t other = others[k];
+        const float delta_x = position_x[idx] - position_x[other];
+        const float delta_y = position_y[idx] - position_y[other];
+        const float dist2 = delta_x * delta_x + delta_y * delta_y;
+        const float r_sum = radius[idx] + radius[other];
+        if (dist2 < r_sum * r_sum && dist2 > min_dist2) {
+            const float dist = std::sqrt(dist2);
+            max_overlap = std::max(max_overlap, r_sum - dist);
+            const float delta_dist = response_coef * 0.5f * (r_sum - dist);
+            const float col_vec_x = delta_x / dist * delta_dist;
+            const float col_vec_y = delta_y / dist * delta_dist;
+            position_x[idx]   += col_vec_x;
+            position_y[idx]   += col_vec_y;
+            position_x[other] -= col_vec_x;
+            position_y[other] -= col_vec_y;
+        }
+    }
+    return max_overlap;
+}
+
+// Resolves the contacts of particle idx against every particle of others[0, count) in vector batches.
+// The corrections of a batch are computed from the same position of idx and summed, the other
+// particles are pushed back one by one. Entries equal to idx are ignored. Returns the deepest overlap found.
+inline float solveContactBatchSimd(Object &objects, const int32_t idx, const int32_t *others, const int32_t count) {
+    float *position_x   = objects.position_x.data();
+    float *position_y   = objects.position_y.data();
+    const float *radius = objects.radius.data();
+    constexpr float response_coef = 1.0f;
+    constexpr float min_dist2 = 1e-6f;
+
+    int32_t k = 0;
+    float max_overlap = 0.0f;
+#if defined SIMD_AVX2
+    const __m256 pos_x = _mm256_set1_ps(position_x[idx]);
+    const __m256 pos_y = _mm256_set1_ps(position_y[idx]);
+    const __m256 r     = _mm256_set1_ps(radius[idx]);
+    const __m256 half_response = _mm256_set1_ps(response_coef * 0.5f);
+    const __m256 v_min_dist2   = _mm256_set1_ps(min_dist2);
+    __m256 sum_x = _mm256_setzero_ps();
+    __m256 sum_y = _mm256_setzero_ps();
+    __m256 overlap = _mm256_setzero_ps();
+    alignas(32) int32_t lanes[8];
+    alignas(32) float col_x[8], col_y[8];
+    const __m256i self_index = _mm256_set1_epi32(idx);
+    const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (; k < count; k += 8) {
+        // lanes past the end are filled with idx, which is rejected by the distance test
+        const __m256i valid   = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - k), lane_index);
+        const __m256i indices = _mm256_blendv_epi8(self_index, _mm256_maskload_epi32(others + k, valid), valid);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), indices);
+        const __m256 delta_x = _mm256_sub_ps(pos_x, _mm256_i32gather_ps(position_x, indices, 4));
+        const __m256 delta_y = _mm256_sub_ps(pos_y, _mm256_i32gather_ps(position_y, indices, 4));
+        const __m256 r_sum   = _mm256_add_ps(r, _mm256_i32gather_ps(radius, indices, 4));
+        const __m256 dist2   = _mm256_add_ps(_mm256_mul_ps(delta_x, delta_x), _mm256_mul_ps(delta_y, delta_y));
+        const __m256 contact = _mm256_and_ps(_mm256_cmp_ps(dist2, _mm256_mul_ps(r_sum, r_sum), _CMP_LT_OQ),
+                                             _mm256_cmp_ps(dist2, v_min_dist2, _CMP_GT_OQ));
+        const int mask = _mm256_movemask_ps(contact);
+        if (mask == 0) continue;
+
+        const __m256 dist  = _mm256_sqrt_ps(dist2);
+        const __m256 depth = _mm256_and_ps(contact, _mm256_sub_ps(r_sum, dist));
+        overlap = _mm256_max_ps(overlap, depth);
+        const __m256 scale = _mm256_and_ps(contact, _mm256_div_ps(_mm256_mul_ps(half_response, depth), dist));
+        const __m256 cx = _mm256_mul_ps(delta_x, scale);
+        const __m256 cy = _mm256_mul_ps(delta_y, scale);
+        sum_x = _mm256_add_ps(sum_x, cx);
+        sum_y = _mm256_add_ps(sum_y, cy);
+        _mm256_store_ps(col_x, cx);
+        _mm256_store_ps(col_y, cy);
+        for (int32_t l = 0; l < 8; ++l) {
+            if (mask & (1 << l)) {
+                position_x[lanes[l]] -= col_x[l];
+                position_y[lanes[l]] -= col_y[l];
+            }
+        }
+    }
+    alignas(32) float total_x[8], total_y[8], overlaps[8];
+    _mm256_store_ps(total_x, sum_x);
+    _mm256_store_ps(total_y, sum_y);
+    _mm256_store_ps(overlaps, overlap);
+    for (int32_t l = 0; l < 8; ++l) {
+        position_x[idx] += total_x[l];
+        position_y[idx] += total_y[l];
+        max_overlap = std::max(max_overlap, overlaps[l]);
+    }
+#elif defined SIMD_SSE
+    const __m128 pos_x = _mm_set1_ps(position_x[idx]);
+    const __m128 pos_y = _mm_set1_ps(position_y[idx]);
+    const __m128 r     = _mm_set1_ps(radius[idx]);
+    const __m128 half_response = _mm_set1_ps(response_coef * 0.5f);
+    const __m128 v_min_dist2   = _mm_set1_ps(min_dist2);
+    __m128 sum_x = _mm_setzero_ps();
+    __m128 sum_y = _mm_setzero_ps();
+    __m128 overlap = _mm_setzero_ps();
+    int32_t lanes[4];
+    alignas(16) float col_x[4], col_y[4];
+    for (; k < count; k += 4) {
+        for (int32_t l = 0; l < 4; ++l) {
+            lanes[l] = k + l < count ? others[k + l] : idx;
+        }
+        const __m128 other_x = _mm_setr_ps(position_x[lanes[0]], position_x[lanes[1]], position_x[lanes[2]], position_x[lanes[3]]);
+        const __m128 other_y = _mm_setr_ps(position_y[lanes[0]], position_y[lanes[1]], position_y[lanes[2]], position_y[lanes[3]]);
+        const __m128 other_r = _mm_setr_ps(radius[lanes[0]], radius[lanes[1]], radius[lanes[2]], radius[lanes[3]]);
+        const __m128 delta_x = _mm_sub_ps(pos_x, other_x);
+        const __m128 delta_y = _mm_sub_ps(pos_y, other_y);
+        const __m128 r_sum   = _mm_add_ps(r, other_r);
+        const __m128 dist2   = _mm_add_ps(_mm_mul_ps(delta_x, delta_x), _mm_mul_ps(delta_y, delta_y));
+        const __m128 contact = _mm_and_ps(_mm_cmplt_ps(dist2, _mm_mul_ps(r_sum, r_sum)), _mm_cmpgt_ps(dist2, v_min_dist2));
+        const int mask = _mm_movemask_ps(contact);
+        if (mask == 0) continue;
+
+        const __m128 dist  = _mm_sqrt_ps(dist2);
+        const __m128 depth = _mm_and_ps(contact, _mm_sub_ps(r_sum, dist));
+        overlap = _mm_max_ps(overlap, depth);
+        const __m128 scale = _mm_and_ps(contact, _mm_div_ps(_mm_mul_ps(half_response, depth), dist));
+        const __m128 cx = _mm_mul_ps(delta_x, scale);
+        const __m128 cy = _mm_mul_ps(delta_y, scale);
+        sum_x = _mm_add_ps(sum_x, cx);
+        sum_y = _mm_add_ps(sum_y, cy);
+        _mm_store_ps(col_x, cx);
+        _mm_store_ps(col_y, cy);
+        for (int32_t l = 0; l < 4; ++l) {
+            if (mask & (1 << l)) {
+                position_x[lanes[l]] -= col_x[l];
+                position_y[lanes[l]] -= col_y[l];
+            }
+        }
+    }
+    alignas(16) float total_x[4], total_y[4], overlaps[4];
+    _mm_store_ps(total_x, sum_x);
+    _mm_store_ps(total_y, sum_y);
+    _mm_store_ps(overlaps, overlap);
+    position_x[idx] += total_x[0] + total_x[1] + total_x[2] + total_x[3];
+    position_y[idx] += total_y[0] + total_y[1] + total_y[2] + total_y[3];
+    max_overlap = std::max(std::max(overlaps[0], overlaps[1]), std::max(overlaps[2], overlaps[3]));
+#endif
+
+    return std::max(max_overlap, solveContactBatchScalar(objects, idx, others + k, count - k));
+}
+
+// Writes to neighbours, in order, the candidates [0, count) other than idx whose distance to (x, y) is below
+// radius plus their candidate_radius plus skin, and returns how many. The candidates are written unconditionally
+// and kept by advancing the count, so neighbours must have room for count entries.
+inline int32_t selectNeighboursScalar(const int32_t idx, const float x, const float y, const float radius, const float skin, const int32_t *candidates, const float *candidate_x, const float *candidate_y, const float *candidate_radius, const int32_t count, int32_t *neighbours) {
+    int32_t neighbour_count = 0;
+    for (int32_t k = 0; k < count; ++k) {
+        const float delta_x = x - candidate_x[k];
+        const float delta_y = y - candidate_y[k];
+        const float distance = radius + candidate_radius[k] + skin;
+        neighbours[neighbour_count] = candidates[k];
+        neighbour_count += (candidates[k] != idx) & (delta_x * delta_x + delta_y * delta_y < distance * distance);
+    }
+    return neighbour_count;
+}
+
+// Same as selectNeighboursScalar with the distances tested in vector batches.
+inline int32_t selectNeighboursSimd(const int32_t idx, const float x, const float y, const float radius, const float skin, const int32_t *candidates, const float *candidate_x, const float *candidate_y, const float *candidate_radius, const int32_t count, int32_t *neighbours) {
+    int32_t k = 0;
+    int32_t neighbour_count = 0;
+#if defined SIMD_AVX2
+    const __m256 pos_x  = _mm256_set1_ps(x);
+    const __m256 pos_y  = _mm256_set1_ps(y);
+    const __m256 r      = _mm256_set1_ps(radius);
+    const __m256 v_skin = _mm256_set1_ps(skin);
+    const __m256i self_index = _mm256_set1_epi32(idx);
+    for (; k + 8 <= count; k += 8) {
+        const __m256i indices = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(candidates + k));
+        const __m256 delta_x  = _mm256_sub_ps(pos_x, _mm256_loadu_ps(candidate_x + k));
+        const __m256 delta_y  = _mm256_sub_ps(pos_y, _mm256_loadu_ps(candidate_y + k));
+        const __m256 distance = _mm256_add_ps(_mm256_add_ps(r, _mm256_loadu_ps(candidate_radius + k)), v_skin);
+        const __m256 dist2    = _mm256_add_ps(_mm256_mul_ps(delta_x, delta_x), _mm256_mul_ps(delta_y, delta_y));
+        const __m256 close    = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, self_index)),
+                                                 _mm256_cmp_ps(dist2, _mm256_mul_ps(distance, distance), _CMP_LT_OQ));
+        const int mask = _mm256_movemask_ps(close);
+        for (int32_t l = 0; l < 8; ++l) {
+            neighbours[neighbour_count] = candidates[k + l];
+            neighbour_count += (mask >> l) & 1;
+        }
+    }
+#elif defined SIMD_SSE
+    const __m128 pos_x  = _mm_set1_ps(x);
+    const __m128 pos_y  = _mm_set1_ps(y);
+    const __m128 r      = _mm_set1_ps(radius);
+    const __m128 v_skin = _mm_set1_ps(skin);
+    const __m128i self_index = _mm_set1_epi32(idx);
+    for (; k + 4 <= count; k += 4) {
+        const __m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(candidates + k));
+        const __m128 delta_x  = _mm_sub_ps(pos_x, _mm_loadu_ps(candidate_x + k));
+        const __m128 delta_y  = _mm_sub_ps(pos_y, _mm_loadu_ps(candidate_y + k));
+        const __m128 distance = _mm_add_ps(_mm_add_ps(r, _mm_loadu_ps(candidate_radius + k)), v_skin);
+        const __m128 dist2    = _mm_add_ps(_mm_mul_ps(delta_x, delta_x), _mm_mul_ps(delta_y, delta_y));
+        const __m128 close    = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(indices, self_index)),
+                                              _mm_cmplt_ps(dist2, _mm_mul_ps(distance, distance)));
+        const int mask = _mm_movemask_ps(close);
+        for (int32_t l = 0; l < 4; ++l) {
+            neighbours[neighbour_count] = candidates[k + l];
+            neighbour_count += (mask >> l) & 1;
+        }
+    }
+#endif
+
+    return neighbour_count + selectNeighboursScalar(idx, x, y, radius, skin, candidates + k, candidate_x + k, candidate_y + k, candidate_radius + k, count - k, neighbours + neighbour_count);
+}
+
+// Pulls the two particles of each distance constraint [begin, end) toward its rest length, each by half the
+// error scaled by the constraint's stiffness. The constraints must not share a particle, like those of a color.
+inline void solveDistanceConstraintsScalar(Object &objects, const int32_t *index_a, const int32_t *index_b, const float *rest_length, const float *stiffness, const int32_t begin, const int32_t end) {
+    float *position_x = objects.position_x.data();
+    float *position_y = objects.position_y.data();
+    constexpr float min_dist2 = 1e-12f;
+
+    for (int32_t i = begin; i < end; ++i) {
+        const int32_t a = index_a[i];
+        const int32_t b = index_b[i];
+        const float delta_x = position_x[b] - position_x[a];
+        const float delta_y = position_y[b] - position_y[a];
+        const float dist2 = delta_x * delta_x + delta_y * delta_y;
+        if (dist2 <= min_dist2) continue;
+        const float dist = std::sqrt(dist2);
+        const float scale = 0.5f * stiffness[i] * (dist - rest_length[i]) / dist;
+        position_x[a] += delta_x * scale;
+        position_y[a] += delta_y * scale;
+        position_x[b] -= delta_x * scale;
+        position_y[b] -= delta_y * scale;
+    }
+}
+
+// Same as solveDistanceConstraintsScalar with the constraints taken in vector batches: positions are gathered,
+// the corrections computed side by side and written back lane by lane, safe as no two lanes share a particle.
+inline void solveDistanceConstraintsSimd(Object &objects, const int32_t *index_a, const int32_t *index_b, const float *rest_length, const float *stiffness, const int32_t begin, const int32_t end) {
+    float *position_x = objects.position_x.data();
+    float *position_y = objects.position_y.data();
+    constexpr float min_dist2 = 1e-12f;
+
+    int32_t i = begin;
+#if defined SIMD_AVX2
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 v_min_dist2 = _mm256_set1_ps(min_dist2);
+    alignas(32) int32_t lanes_a[8], lanes_b[8];
+    alignas(32) float cor_x[8], cor_y[8];
+    for (; i + 8 <= end; i += 8) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_a + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_b + i));
+        const __m256 delta_x = _mm256_sub_ps(_mm256_i32gather_ps(position_x, b, 4), _mm256_i32gather_ps(position_x, a, 4));
+        const __m256 delta_y = _mm256_sub_ps(_mm256_i32gather_ps(position_y, b, 4), _mm256_i32gather_ps(position_y, a, 4));
+        const __m256 dist2   = _mm256_add_ps(_mm256_mul_ps(delta_x, delta_x), _mm256_mul_ps(delta_y, delta_y));
+        const __m256 valid   = _mm256_cmp_ps(dist2, v_min_dist2, _CMP_GT_OQ);
+        const __m256 dist    = _mm256_sqrt_ps(_mm256_max_ps(dist2, v_min_dist2));
+        const __m256 error   = _mm256_sub_ps(dist, _mm256_loadu_ps(rest_length + i));
+        const __m256 scale   = _mm256_and_ps(valid, _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(half, _mm256_loadu_ps(stiffness + i)), error), dist));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes_a), a);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes_b), b);
+        _mm256_store_ps(cor_x, _mm256_mul_ps(delta_x, scale));
+        _mm256_store_ps(cor_y, _mm256_mul_ps(delta_y, scale));
+        for (int32_t l = 0; l < 8; ++l) {
+            position_x[lanes_a[l]] += cor_x[l];
+            position_y[lanes_a[l]] += cor_y[l];
+            position_x[lanes_b[l]] -= cor_x[l];
+            position_y[lanes_b[l]] -= cor_y[l];
+        }
+    }
+#elif defined SIMD_SSE
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 v_min_dist2 = _mm_set1_ps(min_dist2);
+    alignas(16) float cor_x[4], cor_y[4];
+    for (; i + 4 <= end; i += 4) {
+        const int32_t *a = index_a + i;
+        const int32_t *b = index_b + i;
+        const __m128 delta_x = _mm_sub_ps(_mm_setr_ps(position_x[b[0]], position_x[b[1]], position_x[b[2]], position_x[b[3]]),
+                                          _mm_setr_ps(position_x[a[0]], position_x[a[1]], position_x[a[2]], position_x[a[3]]));
+        const __m128 delta_y = _mm_sub_ps(_mm_setr_ps(position_y[b[0]], position_y[b[1]], position_y[b[2]], position_y[b[3]]),
+                                          _mm_setr_ps(position_y[a[0]], position_y[a[1]], position_y[a[2]], position_y[a[3]]));
+        const __m128 dist2 = _mm_add_ps(_mm_mul_ps(delta_x, delta_x), _mm_mul_ps(delta_y, delta_y));
+        const __m128 valid = _mm_cmpgt_ps(dist2, v_min_dist2);
+        const __m128 dist  = _mm_sqrt_ps(_mm_max_ps(dist2, v_min_dist2));
+        const __m128 error = _mm_sub_ps(dist, _mm_loadu_ps(rest_length + i));
+        const __m128 scale = _mm_and_ps(valid, _mm_div_ps(_mm_mul_ps(_mm_mul_ps(half, _mm_loadu_ps(stiffness + i)), error), dist));
+        _mm_store_ps(cor_x, _mm_mul_ps(delta_x, scale));
+        _mm_store_ps(cor_y, _mm_mul_ps(delta_y, scale));
+        for (int32_t l = 0; l < 4; ++l) {
+            position_x[a[l]] += cor_x[l];
+            position_y[a[l]] += cor_y[l];
+            position_x[b[l]] -= cor_x[l];
+            position_y[b[l]] -= cor_y[l];
+        }
+    }
+#endif
+
+    solveDistanceConstraintsScalar(objects, index_a, index_b, rest_length, stiffness, i, end);
+}
+
+#endif
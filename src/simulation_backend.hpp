@@ -0,0 +1,148 @@
+#ifndef SIMULATION_BACKEND_HPP
+#define SIMULATION_BACKEND_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "constraints.hpp"
+#include "grid_helper.hpp"
+#include "object.hpp"
+#include "task_scheduler.hpp"
+#include "utils.hpp"
+
+enum class BackendType {
+    Scalar, // one thread, scalar kernels
+    OpenMP, // cpu_threads threads, scalar kernels
+    SIMD,   // cpu_threads threads, AVX2/SSE kernels
+    CUDA,   // device kernels, only when built with CUDA and a device is present
+};
+
+inline const char *getBackendName(const BackendType type) {
+    switch (type) {
+        case BackendType::Scalar: return "scalar";
+        case BackendType::OpenMP: return "openmp";
+        case BackendType::SIMD:   return "simd";
+        case BackendType::CUDA:   return "cuda";
+    }
+    return "unknown";
+}
+
+inline bool parseBackendType(const std::string &name, BackendType &type) {
+    for (const BackendType candidate : {BackendType::Scalar, BackendType::OpenMP, BackendType::SIMD, BackendType::CUDA}) {
+        if (name == getBackendName(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+enum class GridType {
+    Dense,  // every cell of the world, see GridHelper
+    Sparse, // occupied cells only, see SparseGridHelper; host backends only
+};
+
+inline const char *getGridTypeName(const GridType type) {
+    switch (type) {
+        case GridType::Dense:  return "dense";
+        case GridType::Sparse: return "sparse";
+    }
+    return "unknown";
+}
+
+inline bool parseGridType(const std::string &name, GridType &type) {
+    for (const GridType candidate : {GridType::Dense, GridType::Sparse}) {
+        if (name == getGridTypeName(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct SleepStats {
+    int32_t active_objects = 0; // particles awake after the last sub step
+    int32_t active_cells   = 0; // cells holding at least one awake particle, the only cells solved
+};
+
+// totals since the neighbour skin was last set
+struct NeighbourListStats {
+    int64_t sub_steps = 0;    // sub steps solved from the neighbour lists
+    int64_t rebuilds  = 0;    // sub steps among them that rebuilt the grid and the lists
+    int64_t listed_pairs = 0; // entries of the current lists, a pair of the same grid level is listed from both sides
+};
+
+// One sub step is updateObjects, solveConstraints, updateGrids and solveCollisions. Backends that keep the particles
+// elsewhere than the host arrays synchronize them in beginFrame and endFrame.
+class SimulationBackend {
+public:
+    virtual ~SimulationBackend() = default;
+
+    [[nodiscard]]
+    virtual BackendType getType() const = 0;
+
+    [[nodiscard]]
+    virtual GridType getGridType() const {
+        return GridType::Dense;
+    }
+
+    virtual void beginFrame(Object &) {}
+    virtual void endFrame(Object &) {}
+
+    virtual void updateObjects(Object &objects, float delta_time, V2f world_size) = 0;
+
+    // iterations passes over the colors of prepared constraints; backends without a constraint solver ignore them
+    virtual void solveConstraints(Object &, const DistanceConstraints &, int32_t) {}
+
+    virtual void updateGrids(const Object &objects) = 0;
+    virtual void solveCollisions(Object &objects) = 0;
+
+    // particles staying within sleep_distance of the same point for sleep_steps sub steps are put to sleep,
+    // sleep_steps <= 0 keeps every particle awake; backends that do not support sleeping ignore it
+    virtual void setSleeping(float, int32_t) {}
+
+    // see PhysicsHandler::setNeighbourSkin, backends without neighbour lists ignore it
+    virtual void setNeighbourSkin(float) {}
+
+    // waits for queued work, so the phases of asynchronous backends can be timed on the host
+    virtual void synchronize() {}
+
+    [[nodiscard]]
+    virtual const GridStats *getGridStats() const {
+        return nullptr;
+    }
+
+    // nullptr when sleeping is disabled or not supported
+    [[nodiscard]]
+    virtual const SleepStats *getSleepStats() const {
+        return nullptr;
+    }
+
+    // nullptr when the neighbour lists are disabled or not supported
+    [[nodiscard]]
+    virtual const NeighbourListStats *getNeighbourListStats() const {
+        return nullptr;
+    }
+
+    // load of the threads over the collision phases of the last update, nullptr when the backend does not
+    // schedule them on host threads
+    [[nodiscard]]
+    virtual const WorkStats *getWorkStats() const {
+        return nullptr;
+    }
+
+    // deepest overlap between two particles met by the last solveCollisions, before it was resolved; 0 when the
+    // backend does not measure it
+    [[nodiscard]]
+    virtual float getLastMaxOverlap() const {
+        return 0.0f;
+    }
+
+    // device time of the sub steps of the last frame in microseconds, 0 for host backends
+    [[nodiscard]]
+    virtual float getLastDeviceTime() const {
+        return 0.0f;
+    }
+};
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef SPARSE_GRID_HELPER_HPP
+#define SPARSE_GRID_HELPER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <omp.h>
+
+#include "grid_helper.hpp"
+#include "object.hpp"
+
+// Grid storing only the occupied cells, for large and mostly empty worlds. Particles are sorted by column, then
+// by row inside their column. The occupied cells of a column are consecutive and sorted by row, and the particles
+// of consecutive cells are contiguous in cell_objects, as in GridHelper. Memory is proportional to the particle
+// count plus the world width and height, a cell is found by a binary search in its column. The levels are the
+// same as GridHelper's, the columns of every level are numbered one after the other.
+class SparseGridHelper {
+public:
+    SparseGridHelper(const int32_t _world_width, const int32_t _world_height)
+        : world_width(_world_width)
+        , world_height(_world_height)
+    {}
+
+    [[nodiscard]]
+    int32_t getLevelCount() const {
+        return static_cast<int32_t>(levels.size());
+    }
+
+    [[nodiscard]]
+    const GridLevel &getLevel(const int32_t level) const {
+        return levels[level];
+    }
+
+    // occupied cells of every level
+    [[nodiscard]]
+    int32_t getGridsCount() const {
+        return static_cast<int32_t>(cell_count.size());
+    }
+
+    [[nodiscard]]
+    int32_t getCellCount(const int32_t index) const {
+        return cell_count[index];
+    }
+
+    // indices of the particles in the occupied cells [first_index, last_index)
+    [[nodiscard]]
+    const int32_t *getCellObjects(const int32_t first_index) const {
+        return cell_objects.data() + cell_start[first_index];
+    }
+
+    [[nodiscard]]
+    int32_t getCellsObjectCount(const int32_t first_index, const int32_t last_index) const {
+        return cell_start[last_index] - cell_start[first_index];
+    }
+
+    // particles in a column of a level
+    [[nodiscard]]
+    int32_t getColumnObjectCount(const int32_t level, const int32_t grid_x) const {
+        const auto [first, last] = getColumnCells(level, grid_x);
+        return getCellsObjectCount(first, last);
+    }
+
+    // occupied cells [first, last) of a column of a level
+    [[nodiscard]]
+    std::pair<int32_t, int32_t> getColumnCells(const int32_t level, const int32_t grid_x) const {
+        const int32_t column = first_column[level] + grid_x;
+        return {column_cell_start[column], column_cell_start[column + 1]};
+    }
+
+    [[nodiscard]]
+    int32_t getCellRow(const int32_t, const int32_t index) const {
+        return cell_row[index];
+    }
+
+    // occupied cells [first, last) of a column of a level with a row in [first_y, last_y]
+    [[nodiscard]]
+    std::pair<int32_t, int32_t> findCells(const int32_t level, const int32_t grid_x, const int32_t first_y, const int32_t last_y) const {
+        const auto [column_first, column_last] = getColumnCells(level, grid_x);
+        return {findFirstCell(column_first, column_last, first_y), findFirstCell(column_first, column_last, last_y + 1)};
+    }
+
+    // appends the particles of the occupied cells among the 3x3 cells around (grid_x, grid_y) of a level
+    void gatherNeighbours(const int32_t level, const int32_t grid_x, const int32_t grid_y, std::vector<int32_t> &neighbours) const {
+        gatherCells(level, grid_x - 1, grid_y - 1, grid_x + 1, grid_y + 1, neighbours);
+    }
+
+    // appends the particles of the occupied cells from (first_x, first_y) to (last_x, last_y) included of a level
+    void gatherCells(const int32_t level, const int32_t first_x, const int32_t first_y, const int32_t last_x, const int32_t last_y, std::vector<int32_t> &neighbours) const {
+        const GridLevel &grid_level = levels[level];
+        for (int32_t neighbour_x = std::max(first_x, 0); neighbour_x <= std::min(last_x, grid_level.width - 1); ++neighbour_x) {
+            const auto [first, last] = findCells(level, neighbour_x, first_y, last_y);
+            const int32_t *column_objects = getCellObjects(first);
+            neighbours.insert(neighbours.end(), column_objects, column_objects + getCellsObjectCount(first, last));
+        }
+    }
+
+    // occupied cell of a particle at the last updateGrids
+    [[nodiscard]]
+    int32_t getObjectCell(const int32_t object_index) const {
+        return object_cell[object_index];
+    }
+
+    // whether a particle moved out of the cell it was binned in by the last updateGrids
+    [[nodiscard]]
+    bool leftCell(const Object &objects, const int32_t object_index) const {
+        const int32_t top_level = getLevelCount() - 1;
+        int32_t level = 0;
+        while (level < top_level && 2.0f * objects.radius[object_index] > levels[level].cell_size) {
+            ++level;
+        }
+        return first_column[level] + getGridX(level, objects.position_x[object_index]) != object_column[object_index]
+            || getGridY(level, objects.position_y[object_index]) != object_row[object_index];
+    }
+
+    [[nodiscard]]
+    int32_t getGridX(const int32_t level, const float position_x) const {
+        const GridLevel &grid_level = levels[level];
+        return std::clamp(static_cast<int32_t>(floorf(position_x * grid_level.inverse_cell_size)), 0, grid_level.width - 1);
+    }
+
+    [[nodiscard]]
+    int32_t getGridY(const int32_t level, const float position_y) const {
+        const GridLevel &grid_level = levels[level];
+        return std::clamp(static_cast<int32_t>(floorf(position_y * grid_level.inverse_cell_size)), 0, grid_level.height - 1);
+    }
+
+    [[nodiscard]]
+    const GridStats &getStats() const {
+        return stats;
+    }
+
+    // adds the levels needed by the largest particle, levels are never removed
+    void reserveLevels(const float max_radius) {
+        const int32_t level_count = getGridLevelForRadius(max_radius) + 1;
+        if (level_count <= getLevelCount()) return;
+        levels = makeGridLevels(world_width, world_height, level_count);
+        first_column.clear();
+        int32_t columns_count = 0;
+        for (const GridLevel &grid_level : levels) {
+            first_column.push_back(columns_count);
+            columns_count += grid_level.width;
+        }
+        column_start.assign(static_cast<size_t>(columns_count) + 1, 0);
+        column_cell_start.assign(static_cast<size_t>(columns_count) + 1, 0);
+    }
+
+    // Two stable parallel counting sorts, by row then by column, give the particles ordered by column, row and
+    // index, so the cells do not depend on the thread count. Each column is then split into its occupied cells.
+    void updateGrids(const Object &objects, const int32_t thread_count_limit) {
+        reserveLevels(objects.max_radius);
+        const int32_t object_count = objects.size + objects.ghost_count;
+        const int32_t top_level = getLevelCount() - 1;
+        const auto columns_count = static_cast<int32_t>(column_start.size()) - 1;
+        object_column.resize(object_count);
+        object_row.resize(object_count);
+        object_cell.resize(object_count);
+        row_objects.resize(object_count);
+        cell_objects.resize(object_count);
+        row_start.resize(static_cast<size_t>(levels[0].height) + 1);
+
+        #pragma omp parallel for num_threads(thread_count_limit) schedule(static)
+        for (int32_t idx = 0; idx < object_count; ++idx) {
+            int32_t level = 0;
+            while (level < top_level && 2.0f * objects.radius[idx] > levels[level].cell_size) {
+                ++level;
+            }
+            object_column[idx] = first_column[level] + getGridX(level, objects.position_x[idx]);
+            object_row[idx]    = getGridY(level, objects.position_y[idx]);
+        }
+        countingSort(object_row, nullptr, object_count, row_objects, row_start, thread_count_limit);
+        countingSort(object_column, row_objects.data(), object_count, cell_objects, column_start, thread_count_limit);
+
+        // column_cell_start[column + 1] first holds the occupied cell count of the column
+        #pragma omp parallel for num_threads(thread_count_limit) schedule(dynamic, 64)
+        for (int32_t column = 0; column < columns_count; ++column) {
+            int32_t cells = 0;
+            for (int32_t i = column_start[column]; i < column_start[column + 1]; ++i) {
+                cells += i == column_start[column] || object_row[cell_objects[i]] != object_row[cell_objects[i - 1]];
+            }
+            column_cell_start[column + 1] = cells;
+        }
+        column_cell_start[0] = 0;
+        for (int32_t column = 0; column < columns_count; ++column) {
+            column_cell_start[column + 1] += column_cell_start[column];
+        }
+
+        const int32_t cells_count = column_cell_start[columns_count];
+        cell_row.resize(cells_count);
+        cell_count.resize(cells_count);
+        cell_start.resize(static_cast<size_t>(cells_count) + 1);
+        cell_start[cells_count] = object_count;
+
+        int32_t max_occupancy = 0, overflow_cells = 0, overflow_objects = 0;
+        #pragma omp parallel for num_threads(thread_count_limit) schedule(dynamic, 64) reduction(+: overflow_cells, overflow_objects) reduction(max: max_occupancy)
+        for (int32_t column = 0; column < columns_count; ++column) {
+            int32_t cell = column_cell_start[column] - 1;
+            for (int32_t i = column_start[column]; i < column_start[column + 1]; ++i) {
+                const int32_t idx = cell_objects[i];
+                if (i == column_start[column] || object_row[idx] != cell_row[cell]) {
+                    ++cell;
+                    cell_row[cell]   = object_row[idx];
+                    cell_start[cell] = i;
+                    cell_count[cell] = 0;
+                }
+                ++cell_count[cell];
+                object_cell[idx] = cell;
+            }
+            for (int32_t c = column_cell_start[column]; c < column_cell_start[column + 1]; ++c) {
+                max_occupancy = std::max(max_occupancy, cell_count[c]);
+                if (cell_count[c] > nominal_cell_capacity) {
+                    ++overflow_cells;
+                    overflow_objects += cell_count[c] - nominal_cell_capacity;
+                }
+            }
+        }
+
+        stats.occupied_cells   = cells_count;
+        stats.max_occupancy    = max_occupancy;
+        stats.overflow_cells   = overflow_cells;
+        stats.overflow_objects = overflow_objects;
+    }
+
+private:
+    // First cell of [column_first, column_last) with a row of at least grid_y. Rows increase by at least one per
+    // cell, which bounds the search to a few cells in densely occupied columns.
+    [[nodiscard]]
+    int32_t findFirstCell(const int32_t column_first, const int32_t column_last, const int32_t grid_y) const {
+        if (column_first == column_last) return column_first;
+        const int64_t below_last = static_cast<int64_t>(cell_row[column_last - 1]) - grid_y + 1;
+        const int64_t above_first = static_cast<int64_t>(grid_y) - cell_row[column_first];
+        const auto first = static_cast<int32_t>(std::max<int64_t>(column_first, column_last - std::max<int64_t>(below_last, 0)));
+        const auto last  = static_cast<int32_t>(std::min<int64_t>(column_last, column_first + std::max<int64_t>(above_first, 0)));
+        return static_cast<int32_t>(std::lower_bound(cell_row.begin() + first, cell_row.begin() + std::max(first, last), grid_y) - cell_row.begin());
+    }
+
+    // Stable parallel counting sort of the particles input[0, count) (0, ..., count - 1 when input is nullptr)
+    // by keys[particle] into output. bucket_start[key] is set to the first position of the key in output.
+    void countingSort(const std::vector<int32_t> &keys, const int32_t *input, const int32_t count, std::vector<int32_t> &output, std::vector<int32_t> &bucket_start, const int32_t thread_count_limit) {
+        const auto buckets_count = static_cast<int32_t>(bucket_start.size()) - 1;
+        thread_offsets.resize(static_cast<size_t>(thread_count_limit) * buckets_count);
+        #pragma omp parallel num_threads(thread_count_limit)
+        {
+            const int32_t thread_count = omp_get_num_threads();
+            const int32_t thread = omp_get_thread_num();
+            int32_t *histogram = thread_offsets.data() + static_cast<size_t>(thread) * buckets_count;
+            std::fill(histogram, histogram + buckets_count, 0);
+
+            const int32_t begin = static_cast<int32_t>(static_cast<int64_t>(count) * thread / thread_count);
+            const int32_t end   = static_cast<int32_t>(static_cast<int64_t>(count) * (thread + 1) / thread_count);
+            for (int32_t i = begin; i < end; ++i) {
+                ++histogram[keys[input ? input[i] : i]];
+            }
+            #pragma omp barrier
+
+            #pragma omp for
+            for (int32_t key = 0; key < buckets_count; ++key) {
+                int32_t bucket_count = 0;
+                for (int32_t t = 0; t < thread_count; ++t) {
+                    int32_t &offset = thread_offsets[static_cast<size_t>(t) * buckets_count + key];
+                    const int32_t thread_count_in_bucket = offset;
+                    offset = bucket_count;
+                    bucket_count += thread_count_in_bucket;
+                }
+                bucket_start[key + 1] = bucket_count;
+            }
+
+            #pragma omp single
+            {
+                bucket_start[0] = 0;
+                for (int32_t key = 0; key < buckets_count; ++key) {
+                    bucket_start[key + 1] += bucket_start[key];
+                }
+            }
+
+            for (int32_t i = begin; i < end; ++i) {
+                const int32_t idx = input ? input[i] : i;
+                const int32_t key = keys[idx];
+                output[bucket_start[key] + histogram[key]++] = idx;
+            }
+        }
+    }
+
+    int32_t world_width, world_height;
+    std::vector<GridLevel> levels;
+    std::vector<int32_t> first_column;
+    std::vector<int32_t> column_start;      // first particle of a column in cell_objects
+    std::vector<int32_t> column_cell_start; // first occupied cell of a column
+    std::vector<int32_t> row_start;
+    std::vector<int32_t> cell_row;
+    std::vector<int32_t> cell_start;
+    std::vector<int32_t> cell_count;
+    std::vector<int32_t> cell_objects;
+    std::vector<int32_t> object_cell;
+    std::vector<int32_t> object_column;
+    std::vector<int32_t> object_row;
+    std::vector<int32_t> row_objects; // particles sorted by row
+    std::vector<int32_t> thread_offsets;
+    GridStats stats;
+};
+
+#endif
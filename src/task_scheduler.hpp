@@ -0,0 +1,173 @@
+#ifndef TASK_SCHEDULER_HPP
+#define TASK_SCHEDULER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <omp.h>
+
+// Per thread load of the work run by a TaskScheduler since its last resetStats
+struct WorkStats {
+    std::vector<float> busy_time;     // time spent in tasks by each thread, in microseconds
+    std::vector<int32_t> task_counts; // tasks run by each thread
+    int32_t stolen_tasks = 0;         // tasks run by another thread than the one they were given to
+    int32_t thread_count = 0;         // most threads the runtime started for one run, the threads counted below
+
+    // busiest thread over the mean of the threads that ran, 1 when they were evenly loaded
+    [[nodiscard]]
+    float getImbalance() const {
+        float total = 0.0f, busiest = 0.0f;
+        for (int32_t thread = 0; thread < thread_count; ++thread) {
+            total += busy_time[thread];
+            busiest = std::max(busiest, busy_time[thread]);
+        }
+        return total > 0.0f ? busiest * static_cast<float>(thread_count) / total : 1.0f;
+    }
+};
+
+// Runs tasks [0, task_count) on a team of OpenMP threads. Each thread is given a contiguous range of tasks of
+// about the same total weight and runs it from the front; a thread that runs out steals single tasks from the
+// back of the range with the most tasks left. A range is one 64 bit atomic holding its front and back, so the
+// owner and the thieves only meet on a compare and swap.
+class TaskScheduler {
+public:
+    // task(index, thread) for every index, weights[index] the expected cost of the task; returns once all ran
+    template<typename Task>
+    void run(const int32_t task_count, const int64_t *weights, const int32_t thread_count_limit, const Task &task) {
+        if (task_count <= 0) return;
+        const int32_t range_count = std::max(1, std::min(thread_count_limit, task_count));
+        if (range_capacity < range_count) {
+            ranges = std::make_unique<Range[]>(range_count);
+            range_capacity = range_count;
+        }
+        if (static_cast<int32_t>(stats.busy_time.size()) < range_count) {
+            stats.busy_time.resize(range_count, 0.0f);
+            stats.task_counts.resize(range_count, 0);
+        }
+        int32_t stolen_tasks = 0;
+        #pragma omp parallel num_threads(range_count) reduction(+: stolen_tasks)
+        {
+            const int32_t thread_count = omp_get_num_threads();
+            const int32_t thread = omp_get_thread_num();
+            #pragma omp single
+            {
+                distribute(task_count, weights, thread_count);
+                stats.thread_count = std::max(stats.thread_count, thread_count);
+            }
+
+            float busy_time = 0.0f;
+            int32_t task_count_run = 0;
+            int32_t index = 0;
+            for (int32_t victim = thread; victim >= 0; victim = findVictim(thread_count)) {
+                const bool own = victim == thread;
+                while (own ? popFront(ranges[victim], index) : popBack(ranges[victim], index)) {
+                    const auto task_start = std::chrono::high_resolution_clock::now();
+                    task(index, thread);
+                    busy_time += std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - task_start).count();
+                    ++task_count_run;
+                    if (!own) {
+                        ++stolen_tasks;
+                        break;
+                    }
+                }
+            }
+            stats.busy_time[thread] += busy_time;
+            stats.task_counts[thread] += task_count_run;
+        }
+        stats.stolen_tasks += stolen_tasks;
+    }
+
+    [[nodiscard]]
+    const WorkStats &getStats() const {
+        return stats;
+    }
+
+    void resetStats() {
+        std::fill(stats.busy_time.begin(), stats.busy_time.end(), 0.0f);
+        std::fill(stats.task_counts.begin(), stats.task_counts.end(), 0);
+        stats.stolen_tasks = 0;
+        stats.thread_count = 0;
+    }
+
+private:
+    // tasks [front, back) left in a thread's range, front in the low half
+    struct alignas(64) Range {
+        std::atomic<uint64_t> bounds {0};
+    };
+
+    static uint64_t pack(const int32_t front, const int32_t back) {
+        return static_cast<uint32_t>(front) | static_cast<uint64_t>(static_cast<uint32_t>(back)) << 32;
+    }
+
+    static int32_t getFront(const uint64_t bounds) {
+        return static_cast<int32_t>(static_cast<uint32_t>(bounds));
+    }
+
+    static int32_t getBack(const uint64_t bounds) {
+        return static_cast<int32_t>(static_cast<uint32_t>(bounds >> 32));
+    }
+
+    // cuts the tasks where the running weight crosses each thread's share
+    void distribute(const int32_t task_count, const int64_t *weights, const int32_t thread_count) {
+        int64_t total = 0;
+        for (int32_t idx = 0; idx < task_count; ++idx) {
+            total += std::max<int64_t>(weights[idx], 1);
+        }
+        int64_t sum = 0;
+        int32_t front = 0;
+        for (int32_t thread = 0; thread < thread_count; ++thread) {
+            int32_t back = front;
+            const int64_t target = total * (thread + 1) / thread_count;
+            while (back < task_count && (sum < target || thread == thread_count - 1)) {
+                sum += std::max<int64_t>(weights[back++], 1);
+            }
+            ranges[thread].bounds.store(pack(front, back), std::memory_order_relaxed);
+            front = back;
+        }
+    }
+
+    static bool popFront(Range &range, int32_t &index) {
+        uint64_t bounds = range.bounds.load(std::memory_order_acquire);
+        while (getFront(bounds) < getBack(bounds)) {
+            if (range.bounds.compare_exchange_weak(bounds, pack(getFront(bounds) + 1, getBack(bounds)), std::memory_order_acq_rel)) {
+                index = getFront(bounds);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool popBack(Range &range, int32_t &index) {
+        uint64_t bounds = range.bounds.load(std::memory_order_acquire);
+        while (getFront(bounds) < getBack(bounds)) {
+            if (range.bounds.compare_exchange_weak(bounds, pack(getFront(bounds), getBack(bounds) - 1), std::memory_order_acq_rel)) {
+                index = getBack(bounds) - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // thread with the most tasks left, -1 when every range is empty
+    int32_t findVictim(const int32_t thread_count) const {
+        int32_t victim = -1, most_left = 0;
+        for (int32_t thread = 0; thread < thread_count; ++thread) {
+            const uint64_t bounds = ranges[thread].bounds.load(std::memory_order_relaxed);
+            const int32_t left = getBack(bounds) - getFront(bounds);
+            if (left > most_left) {
+                victim = thread;
+                most_left = left;
+            }
+        }
+        return victim;
+    }
+
+    std::unique_ptr<Range[]> ranges;
+    int32_t range_capacity = 0;
+    WorkStats stats;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped zone tracing of the hot paths, exported as Chrome trace JSON for chrome://tracing or Perfetto. Only
+// built with PBD_WITH_TRACING (the PBD_ENABLE_TRACING CMake option), PBD_TRACE_ZONE and PBD_TRACE_THREAD_NAME
+// expand to nothing otherwise. Zone names must be string literals.
+#ifdef PBD_WITH_TRACING
+constexpr bool tracing_enabled = true;
+#else
+constexpr bool tracing_enabled = false;
+#endif
+
+struct TraceEvent {
+    const char *name;
+    int64_t start; // nanoseconds since the tracer was created
+    int64_t end;
+};
+
+// Zones of one thread. Only that thread writes, and it publishes each event with a release store of the
+// count, so the buffers can be exported while the threads still run. Zones beyond the capacity are dropped.
+class TraceBuffer {
+public:
+    TraceBuffer(const int32_t _thread_id, const size_t capacity)
+        : thread_id(_thread_id)
+        , name("thread " + std::to_string(_thread_id))
+        , events(capacity)
+    {}
+
+    void add(const char *zone_name, const int64_t start, const int64_t end) {
+        const size_t index = count.load(std::memory_order_relaxed);
+        if (index == events.size()) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        events[index] = {zone_name, start, end};
+        count.store(index + 1, std::memory_order_release);
+    }
+
+    const int32_t thread_id;
+    std::string name;
+    std::vector<TraceEvent> events;
+    std::atomic<size_t> count {0};
+    std::atomic<int64_t> dropped {0};
+};
+
+class Tracer {
+public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // buffer of the calling thread, registered by its first zone
+    TraceBuffer &getThreadBuffer() {
+        thread_local TraceBuffer *buffer = nullptr;
+        if (buffer == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_back(std::make_unique<TraceBuffer>(static_cast<int32_t>(buffers.size()), events_per_thread));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    // name of the calling thread in the trace, set before its zones are exported
+    void setThreadName(const std::string &name) {
+        TraceBuffer &buffer = getThreadBuffer();
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer.name = name;
+    }
+
+    [[nodiscard]]
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    // writes the zones recorded so far as complete events, one track per thread
+    bool writeChromeTrace(const std::string &path) {
+        std::ofstream file(path);
+        if (!file) {
+            std::cerr << "cannot open " << path << "\n";
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        file.setf(std::ios::fixed);
+        file.precision(3);
+        bool first = true;
+        int64_t dropped = 0;
+        for (const std::unique_ptr<TraceBuffer> &buffer : buffers) {
+            file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id
+                 << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+            first = false;
+            const size_t count = buffer->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; ++i) {
+                const TraceEvent &event = buffer->events[i];
+                file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id
+                     << ",\"ts\":" << static_cast<double>(event.start) * 1e-3
+                     << ",\"dur\":" << static_cast<double>(event.end - event.start) * 1e-3 << "}";
+            }
+            dropped += buffer->dropped.load(std::memory_order_relaxed);
+        }
+        file << "\n]}\n";
+        if (dropped > 0) {
+            std::cerr << "trace buffers full, " << dropped << " zones dropped\n";
+        }
+        if (!file) {
+            std::cerr << "cannot write " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    Tracer()
+        : epoch(std::chrono::steady_clock::now())
+    {}
+
+    static constexpr size_t events_per_thread = 1 << 18;
+    const std::chrono::steady_clock::time_point epoch;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+// records the time from its construction to its destruction on the calling thread
+class TraceZone {
+public:
+    explicit TraceZone(const char *_name)
+        : name(_name)
+        , buffer(Tracer::instance().getThreadBuffer())
+        , start(Tracer::instance().now())
+    {}
+
+    ~TraceZone() {
+        buffer.add(name, start, Tracer::instance().now());
+    }
+
+    TraceZone(const TraceZone &) = delete;
+    TraceZone &operator=(const TraceZone &) = delete;
+
+private:
+    const char *name;
+    TraceBuffer &buffer;
+    int64_t start;
+};
+
+#ifdef PBD_WITH_TRACING
+#define PBD_TRACE_CONCAT_IMPL(a, b) a##b
+#define PBD_TRACE_CONCAT(a, b) PBD_TRACE_CONCAT_IMPL(a, b)
+#define PBD_TRACE_ZONE(name) const TraceZone PBD_TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define PBD_TRACE_THREAD_NAME(name) Tracer::instance().setThreadName(name)
+#else
+#define PBD_TRACE_ZONE(name) ((void) 0)
+#define PBD_TRACE_THREAD_NAME(name) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "object.hpp"
+#include "physics_handler.hpp"
+#include "utils.hpp"
+
+// Trajectory file: a TrajectoryHeader followed by one record per frame, little-endian. A frame record is
+//   uint32 size of the rest of the record
+//   int32  handle count, it never shrinks
+//   varint count, then as many varint handles: particles removed since the previous frame
+//   varint count, then for as many particles created since the previous frame: varint handle, float radius,
+//          uint8 red, green, blue
+//   for each handle: x then y as zigzag varints of the difference with the previous frame
+// Positions are quantized to 16 bits of the world size. Free handles stay at 0, removed and created particles
+// start from 0.
+constexpr char trajectory_magic[8] = {'P', 'B', 'D', 'T', 'R', 'A', 'J', '\0'};
+constexpr uint32_t trajectory_version = 2;
+constexpr float trajectory_quantization = 65535.0f;
+
+struct TrajectoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    float world_size_x, world_size_y;
+};
+
+// Records the particles after each update. record copies the positions into a ring buffer slot and returns,
+// a background thread encodes and writes the frames. record only waits when every slot is still queued.
+class TrajectoryRecorder {
+public:
+    TrajectoryRecorder() = default;
+
+    ~TrajectoryRecorder() {
+        close();
+    }
+
+    TrajectoryRecorder(const TrajectoryRecorder &) = delete;
+    TrajectoryRecorder &operator=(const TrajectoryRecorder &) = delete;
+
+    bool open(const std::string &path, const V2f world_size) {
+        close();
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "cannot open " << path << std::endl;
+            return false;
+        }
+        TrajectoryHeader header {};
+        std::memcpy(header.magic, trajectory_magic, sizeof(header.magic));
+        header.version      = trajectory_version;
+        header.header_size  = sizeof(TrajectoryHeader);
+        header.world_size_x = world_size.x;
+        header.world_size_y = world_size.y;
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        scale_x = trajectory_quantization / world_size.x;
+        scale_y = trajectory_quantization / world_size.y;
+        recorded_generations.clear();
+        queued_frames = written_frames = 0;
+        written_bytes = sizeof(header);
+        wait_time = 0.0f;
+        previous_x.clear();
+        previous_y.clear();
+        stopping = false;
+        writer = std::thread([this] { writeFrames(); });
+        return true;
+    }
+
+    [[nodiscard]]
+    bool isOpen() const {
+        return writer.joinable();
+    }
+
+    void record(const PhysicsHandler &physics_handler) {
+        if (!isOpen()) return;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (queued_frames - written_frames == slot_count) {
+                const auto wait_start = std::chrono::high_resolution_clock::now();
+                slot_written.wait(lock, [this] { return queued_frames - written_frames < slot_count; });
+                wait_time += std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - wait_start).count();
+            }
+        }
+
+        // the writer does not read this slot until queued_frames is incremented
+        Snapshot &snapshot = slots[queued_frames % slot_count];
+        const Object *objects = physics_handler.getObjects();
+        const int32_t object_count = physics_handler.getObjectsCount();
+        const int32_t handle_count = physics_handler.getHandleCount();
+        snapshot.object_count = object_count;
+        snapshot.handle_count = handle_count;
+        snapshot.position_x.assign(objects->position_x.begin(), objects->position_x.begin() + object_count);
+        snapshot.position_y.assign(objects->position_y.begin(), objects->position_y.begin() + object_count);
+        snapshot.handles.assign(physics_handler.getObjectHandles(), physics_handler.getObjectHandles() + object_count);
+        snapshot.removed_handles.clear();
+        snapshot.new_handles.clear();
+        snapshot.new_radius.clear();
+        snapshot.new_color.clear();
+        // a changed generation is a removal, a creation or both since the previous frame
+        const uint32_t *generations = physics_handler.getHandleGenerations();
+        recorded_generations.resize(handle_count, 0);
+        for (int32_t handle = 0; handle < handle_count; ++handle) {
+            const uint32_t generation = generations[handle];
+            const uint32_t recorded = recorded_generations[handle];
+            if (generation == recorded) continue;
+            recorded_generations[handle] = generation;
+            if ((generation & 1u) == 0) {
+                if ((recorded & 1u) != 0) snapshot.removed_handles.push_back(handle);
+                continue;
+            }
+            const int32_t idx = physics_handler.getObjectIndex(handle);
+            snapshot.new_handles.push_back(handle);
+            snapshot.new_radius.push_back(objects->radius[idx]);
+            snapshot.new_color.push_back(getRed(objects->color[idx]));
+            snapshot.new_color.push_back(getGreen(objects->color[idx]));
+            snapshot.new_color.push_back(getBlue(objects->color[idx]));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++queued_frames;
+        }
+        frame_queued.notify_one();
+    }
+
+    // writes the queued frames and closes the file
+    void close() {
+        if (!isOpen()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        frame_queued.notify_one();
+        writer.join();
+        file.close();
+    }
+
+    [[nodiscard]]
+    int64_t getRecordedFrames() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return written_frames;
+    }
+
+    [[nodiscard]]
+    uint64_t getWrittenBytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return written_bytes;
+    }
+
+    // time record spent waiting for the writer, in microseconds
+    [[nodiscard]]
+    float getWaitTime() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return wait_time;
+    }
+
+private:
+    struct Snapshot {
+        int32_t object_count = 0;
+        int32_t handle_count = 0;
+        std::vector<float> position_x, position_y;
+        std::vector<int32_t> handles;
+        std::vector<int32_t> removed_handles; // particles removed since the previous frame, in handle order
+        std::vector<int32_t> new_handles;     // particles created since the previous frame, in handle order
+        std::vector<float> new_radius;        // radius of each of them
+        std::vector<uint8_t> new_color;       // red, green and blue of each of them
+    };
+
+    static uint8_t *writeVarint(uint8_t *out, uint32_t value) {
+        while (value >= 0x80) {
+            *out++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(value);
+        return out;
+    }
+
+    static uint32_t zigzag(const int32_t value) {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+    [[nodiscard]]
+    static int32_t quantize(const float position, const float scale) {
+        return static_cast<int32_t>(std::clamp(position * scale + 0.5f, 0.0f, trajectory_quantization));
+    }
+
+    void writeFrames() {
+        std::vector<uint8_t> buffer;
+        std::vector<int32_t> current_x, current_y;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frame_queued.wait(lock, [this] { return queued_frames > written_frames || stopping; });
+                if (queued_frames == written_frames) return;
+            }
+            const Snapshot &snapshot = slots[written_frames % slot_count];
+            const int32_t object_count = snapshot.object_count;
+            const int32_t handle_count = snapshot.handle_count;
+            const auto removed_count = static_cast<int32_t>(snapshot.removed_handles.size());
+            const auto new_count = static_cast<int32_t>(snapshot.new_handles.size());
+
+            // positions in handle order, free handles at 0
+            current_x.assign(handle_count, 0);
+            current_y.assign(handle_count, 0);
+            for (int32_t idx = 0; idx < object_count; ++idx) {
+                current_x[snapshot.handles[idx]] = quantize(snapshot.position_x[idx], scale_x);
+                current_y[snapshot.handles[idx]] = quantize(snapshot.position_y[idx], scale_y);
+            }
+            previous_x.resize(handle_count, 0);
+            previous_y.resize(handle_count, 0);
+
+            // a varint takes at most 5 bytes and a 17 bit zigzag value at most 3
+            buffer.resize(2 * sizeof(uint32_t) + 10 + static_cast<size_t>(removed_count) * 5 + static_cast<size_t>(new_count) * 12 + static_cast<size_t>(handle_count) * 6);
+            uint8_t *out = buffer.data() + 2 * sizeof(uint32_t);
+            out = writeVarint(out, static_cast<uint32_t>(removed_count));
+            for (const int32_t handle : snapshot.removed_handles) {
+                out = writeVarint(out, static_cast<uint32_t>(handle));
+                previous_x[handle] = previous_y[handle] = 0;
+            }
+            out = writeVarint(out, static_cast<uint32_t>(new_count));
+            for (int32_t i = 0; i < new_count; ++i) {
+                const int32_t handle = snapshot.new_handles[i];
+                out = writeVarint(out, static_cast<uint32_t>(handle));
+                std::memcpy(out, &snapshot.new_radius[i], sizeof(float));
+                std::memcpy(out + sizeof(float), &snapshot.new_color[3 * i], 3);
+                out += sizeof(float) + 3;
+                previous_x[handle] = previous_y[handle] = 0;
+            }
+            for (int32_t handle = 0; handle < handle_count; ++handle) {
+                out = writeVarint(out, zigzag(current_x[handle] - previous_x[handle]));
+                out = writeVarint(out, zigzag(current_y[handle] - previous_y[handle]));
+            }
+            previous_x.swap(current_x);
+            previous_y.swap(current_y);
+
+            const auto record_size = static_cast<uint32_t>(out - buffer.data());
+            const uint32_t payload_size = record_size - sizeof(uint32_t);
+            std::memcpy(buffer.data(), &payload_size, sizeof(uint32_t));
+            std::memcpy(buffer.data() + sizeof(uint32_t), &handle_count, sizeof(int32_t));
+            file.write(reinterpret_cast<const char *>(buffer.data()), record_size);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++written_frames;
+                written_bytes += record_size;
+            }
+            slot_written.notify_one();
+        }
+    }
+
+    static constexpr int64_t slot_count = 4;
+
+    std::ofstream file;
+    std::thread writer;
+    mutable std::mutex mutex;
+    std::condition_variable frame_queued;
+    std::condition_variable slot_written;
+    std::array<Snapshot, slot_count> slots;
+    int64_t queued_frames = 0;
+    int64_t written_frames = 0;
+    bool stopping = false;
+    uint64_t written_bytes = 0;
+    float wait_time = 0.0f;
+    std::vector<uint32_t> recorded_generations; // handle generations of the last recorded frame; only used by record
+    float scale_x = 1.0f, scale_y = 1.0f;
+    // quantized positions of the last written frame, in handle order; only used by the writer
+    std::vector<int32_t> previous_x, previous_y;
+};
+
+// Decodes the frames of a trajectory file one after the other into an Object, in handle order. Only the
+// positions, radii, colors and generations are filled, free handles get a zero radius.
+class TrajectoryReader {
+public:
+    bool open(const std::string &path) {
+        file = std::make_unique<MappedFile>(path);
+        if (!file->isOpen() || file->getSize() < sizeof(TrajectoryHeader)) {
+            std::cerr << "cannot map " << path << std::endl;
+            file.reset();
+            return false;
+        }
+        TrajectoryHeader header {};
+        std::memcpy(&header, file->getData(), sizeof(header));
+        if (std::memcmp(header.magic, trajectory_magic, sizeof(header.magic)) != 0 || header.version != trajectory_version || header.header_size != sizeof(TrajectoryHeader)) {
+            std::cerr << path << " is not a version " << trajectory_version << " trajectory" << std::endl;
+            file.reset();
+            return false;
+        }
+        world_size = {header.world_size_x, header.world_size_y};
+        rewind();
+        return true;
+    }
+
+    [[nodiscard]]
+    V2f getWorldSize() const {
+        return world_size;
+    }
+
+    // index of the next frame readFrame returns
+    [[nodiscard]]
+    int32_t getFrameIndex() const {
+        return frame_index;
+    }
+
+    void rewind() {
+        offset = sizeof(TrajectoryHeader);
+        frame_index = 0;
+        handle_count_read = 0;
+        current_x.clear();
+        current_y.clear();
+    }
+
+    // false at the end of the file or on a truncated frame; objects must not be modified between frames
+    bool readFrame(Object &objects) {
+        if (!file) return false;
+        const uint8_t *data = file->getData();
+        const size_t size = file->getSize();
+        uint32_t payload_size = 0;
+        int32_t handle_count = 0;
+        if (size - offset < 2 * sizeof(uint32_t)) return false;
+        std::memcpy(&payload_size, data + offset, sizeof(uint32_t));
+        std::memcpy(&handle_count, data + offset + sizeof(uint32_t), sizeof(int32_t));
+        if (size - offset - sizeof(uint32_t) < payload_size || handle_count < handle_count_read) return false;
+
+        const uint8_t *in  = data + offset + 2 * sizeof(uint32_t);
+        const uint8_t *end = data + offset + sizeof(uint32_t) + payload_size;
+        // handles new since the last frame are free unless they are created below
+        objects.radius.resize(handle_count, 0.0f);
+        objects.color.resize(handle_count);
+        objects.generation.resize(handle_count, 0);
+        current_x.resize(handle_count, 0);
+        current_y.resize(handle_count, 0);
+        uint32_t removed_count = 0;
+        if (!readVarint(in, end, removed_count)) return false;
+        for (uint32_t i = 0; i < removed_count; ++i) {
+            uint32_t handle = 0;
+            if (!readVarint(in, end, handle) || handle >= static_cast<uint32_t>(handle_count)) return false;
+            objects.radius[handle] = 0.0f;
+            objects.generation[handle] += (objects.generation[handle] & 1u) != 0 ? 1 : 2;
+            current_x[handle] = current_y[handle] = 0;
+        }
+        uint32_t new_count = 0;
+        if (!readVarint(in, end, new_count)) return false;
+        for (uint32_t i = 0; i < new_count; ++i) {
+            uint32_t handle = 0;
+            if (!readVarint(in, end, handle) || handle >= static_cast<uint32_t>(handle_count) || end - in < 7) return false;
+            std::memcpy(&objects.radius[handle], in, sizeof(float));
+            objects.color[handle] = packColor(in[4], in[5], in[6]);
+            in += sizeof(float) + 3;
+            objects.generation[handle] += (objects.generation[handle] & 1u) != 0 ? 2 : 1;
+            current_x[handle] = current_y[handle] = 0;
+        }
+        objects.position_x.resize(handle_count);
+        objects.position_y.resize(handle_count);
+        const float inverse_scale_x = world_size.x / trajectory_quantization;
+        const float inverse_scale_y = world_size.y / trajectory_quantization;
+        for (int32_t handle = 0; handle < handle_count; ++handle) {
+            uint32_t delta_x = 0, delta_y = 0;
+            if (!readVarint(in, end, delta_x) || !readVarint(in, end, delta_y)) return false;
+            current_x[handle] += unzigzag(delta_x);
+            current_y[handle] += unzigzag(delta_y);
+            objects.position_x[handle] = static_cast<float>(current_x[handle]) * inverse_scale_x;
+            objects.position_y[handle] = static_cast<float>(current_y[handle]) * inverse_scale_y;
+        }
+        objects.size = handle_count;
+        handle_count_read = handle_count;
+        offset += sizeof(uint32_t) + payload_size;
+        ++frame_index;
+        return true;
+    }
+
+private:
+    static bool readVarint(const uint8_t *&in, const uint8_t *end, uint32_t &value) {
+        value = 0;
+        for (uint32_t shift = 0; shift < 35 && in < end; shift += 7) {
+            const uint8_t byte = *in++;
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    static int32_t unzigzag(const uint32_t value) {
+        return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+    }
+
+    std::unique_ptr<MappedFile> file;
+    V2f world_size;
+    size_t offset = 0;
+    int32_t frame_index = 0;
+    int32_t handle_count_read = 0;
+    std::vector<int32_t> current_x, current_y;
+};
+
+#endif
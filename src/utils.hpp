@@ -3,12 +3,11 @@
 
 #include <SFML/System/Vector2.hpp>
 #include <SFML/Window/Event.hpp>
+#include <algorithm>
 #include <functional>
 #include <unordered_map>
 #include <omp.h>
 
-#define USE_CPU
-// #define USE_GPU
 // #define OUTPUT_RESULTS
 
 using V2f = sf::Vector2f;
@@ -19,9 +18,27 @@ template<typename T>
 using EventCallbackMap = std::unordered_map<T, EventCallback>;
 
 // threads count: 1, 2, 4, 8, 16
-const int cpu_threads = std::min(16, omp_get_max_threads());
+inline int cpu_threads = std::min(16, omp_get_max_threads());
 // gpu block size: 32, 64, 128, 256, 512, 1024
-constexpr int gpu_block_size = 512;
+inline int gpu_block_size = 512;
 
+inline void HSVtoRGB(const float h, const float s, const float v, float &r, float &g, float &b) {
+    const int i = static_cast<int>(h * 6);
+    const float f = h * 6 - static_cast<float>(i);
+    const float p = v * (1 - s);
+    const float q = v * (1 - f * s);
+    const float t = v * (1 - (1 - f) * s);
+    switch (i % 6) {
+        case 0: r = v, g = t, b = p; break;
+        case 1: r = q, g = v, b = p; break;
+        case 2: r = p, g = v, b = t; break;
+        case 3: r = p, g = q, b = v; break;
+        case 4: r = t, g = p, b = v; break;
+        default: r = v, g = p, b = q; break;
+    }
+    r *= 255;
+    g *= 255;
+    b *= 255;
+}
 
 #endif
@@ -82,6 +82,13 @@ public:
         return state.transform.transformPoint(world_pos);
     }
 
+    // part of the world covered by the window
+    [[nodiscard]]
+    sf::FloatRect getVisibleWorldRect() const {
+        const V2f half_size = state.center / state.zoom;
+        return {state.offset.x - half_size.x, state.offset.y - half_size.y, 2.0f * half_size.x, 2.0f * half_size.y};
+    }
+
     [[nodiscard]]
     sf::Transform getTransform() const {
         return state.transform;
@@ -27,6 +27,16 @@ public:
         return m_viewport_handler.getMouseWorldPosition();
     }
 
+    [[nodiscard]]
+    float getZoom() const {
+        return m_viewport_handler.getZoom();
+    }
+
+    [[nodiscard]]
+    sf::FloatRect getVisibleWorldRect() const {
+        return m_viewport_handler.getVisibleWorldRect();
+    }
+
     EventManager &getEventManager() {
         return m_event_manager;
     }
@@ -56,6 +66,17 @@ public:
         m_window.draw(drawable, render_states);
     }
 
+    // draws vertices [first, first + count) of a vertex buffer
+    void draw(const sf::VertexBuffer &vertex_buffer, const size_t first, const size_t count, sf::RenderStates render_states = {}) {
+        render_states.transform = m_viewport_handler.getTransform();
+        m_window.draw(vertex_buffer, first, count, render_states);
+    }
+
+    void draw(const sf::Vertex *vertices, const size_t count, const sf::PrimitiveType type, sf::RenderStates render_states = {}) {
+        render_states.transform = m_viewport_handler.getTransform();
+        m_window.draw(vertices, count, type, render_states);
+    }
+
     bool run() const {
         m_event_manager.processEvent();
         return m_window.isOpen();